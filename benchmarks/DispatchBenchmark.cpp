@@ -0,0 +1,110 @@
+//! \file DispatchBenchmark.cpp
+//! \brief Reports how many instructions per second the stack interpreter dispatches.
+/*!
+  Built twice: DispatchBenchmark dispatches through computed gotos, DispatchBenchmarkSwitch
+  through the portable switch, see ILIAD_SWITCH_DISPATCH. Both run the same loop of cheap
+  instructions, where dispatching is most of the work.
+
+  The instructions are counted without slowing the VM down: the loop body runs straight through,
+  so the number of instructions run follows from the compiled code and the number of iterations.
+
+  Usage: DispatchBenchmark [iterations]
+*/
+#include "stdafx.h"
+#include "VM.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+
+namespace {
+	//! Declarations of the globals the loop uses.
+	const char* const SETUP = "int32 i = 0; int32 n = 0; int32 a = 1; int32 b = 2; int32 c = 3; int64 d = 4; double e = 0.5;";
+
+	//! The loop timed. It declares nothing, so the VM caches it and the timed run doesn't compile.
+	const char* const LOOP =
+		"i = 0;\n"
+		"while (i < n) {\n"
+		"	a = b - a; b = a - b; c = a * 3 + i;\n"
+		"	d = d + a - d; e = e * 0.5 + c;\n"
+		"	{ int32 x = c; x = x * 2 - x; a = x - c + a; }\n"
+		"	i = i + 1;\n"
+		"}\n";
+
+	//! Counts the instructions of a chunk run by the loop.
+	/*!
+	  The chunk holds a single loop, whose body has no jumps but the one leaving the loop.
+	  \param chunk The compiled loop.
+	  \param iterations Number of times the body runs.
+	  \return Number of instructions dispatched, or 0 if the chunk isn't a single loop.
+	*/
+	size_t countInstructions(const Chunk& chunk, size_t iterations) {
+		const byte* code = chunk.getStart();
+		size_t loopStart = 0, loopEnd = 0;
+
+		for (size_t offset = 0; offset < chunk.codeSize(); offset += instructionLength(code + offset)) {
+			OpCode op = static_cast<OpCode>(code[offset]);
+			if (op == OpCode::Loop || op == OpCode::LoopLong) {
+				loopStart = jumpTarget(code, offset);
+				loopEnd = offset + instructionLength(code + offset);
+			}
+		}
+		if (loopEnd == 0) return 0;
+
+		// Every iteration runs the whole loop, the last test of the condition runs up to the jump out.
+		size_t outside = 0, loop = 0, exit = 0;
+		bool exited = false;
+		for (size_t offset = 0; offset < chunk.codeSize(); offset += instructionLength(code + offset)) {
+			if (offset < loopStart || offset >= loopEnd) {
+				outside++;
+				continue;
+			}
+
+			loop++;
+			if (!exited) exit++;
+			if (isJump(static_cast<OpCode>(code[offset])) && jumpTarget(code, offset) >= loopEnd) exited = true;
+		}
+
+		return outside + iterations * loop + exit;
+	}
+}
+
+int main(int argc, char** argv) {
+	size_t iterations = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10000000;
+	std::string setIterations = "n = " + std::to_string(iterations) + ";";
+
+	// Compiled as the VM compiles it, to count its instructions.
+	StringTable strings;
+	Compiler compiler;
+	auto chunk = std::make_shared<Chunk>();
+	if (!compiler.Compile(SETUP, std::make_shared<Chunk>(), strings) || !compiler.Compile(LOOP, chunk, strings)) {
+		std::cerr << "The loop doesn't compile." << std::endl;
+		return 1;
+	}
+	size_t instructions = countInstructions(*chunk, iterations);
+
+	VM vm;
+	if (vm.Interpret(SETUP) != InterpretResults::OK || vm.Interpret(LOOP) != InterpretResults::OK) {
+		std::cerr << "The loop doesn't run." << std::endl;
+		return 1;
+	}
+
+	vm.Interpret(setIterations);
+	auto start = std::chrono::steady_clock::now();
+	InterpretResults result = vm.Interpret(LOOP);
+	std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+	if (result != InterpretResults::OK || vm.Cache().Hits() == 0) {
+		std::cerr << "The loop doesn't run from the cache." << std::endl;
+		return 1;
+	}
+
+#ifdef COMPUTED_GOTO
+	const char* dispatch = "computed goto";
+#else
+	const char* dispatch = "switch";
+#endif
+	std::cout << std::fixed << std::setprecision(3);
+	std::cout << dispatch << ": " << instructions << " instructions in " << time.count() << " s, ";
+	std::cout << instructions / time.count() / 1e6 << " million instructions per second" << std::endl;
+	return 0;
+}
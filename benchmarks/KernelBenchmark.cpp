@@ -0,0 +1,172 @@
+//! \file KernelBenchmark.cpp
+//! \brief Times the Value operators for every pair of numeric types.
+/*!
+  Each operator runs through the kernel tables of Value, and through a switch over the types
+  written like the operators the tables replaced: a switch on the type of the result for the
+  arithmetic, a switch on each operand for the comparisons, and <= done as < then ==. Both read
+  the same Values, so only the dispatch differs. Build in release to get meaningful times.
+
+  Usage: KernelBenchmark [repeats]
+*/
+#include "stdafx.h"
+#include "Value.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+
+namespace {
+	//! Values of each operand array.
+	const size_t VALUE_COUNT = 1024;
+
+	//! The types benchmarked, every pair of them is timed.
+	const ValueType NUMERIC_TYPES[] = {
+		ValueType::Int8, ValueType::Int16, ValueType::Int32, ValueType::Int64, ValueType::Float, ValueType::Double,
+	};
+
+	//! \return A Value of a numeric type holding number.
+	Value makeNumber(ValueType type, int number) {
+		switch (type) {
+		case ValueType::Int8: return Value(static_cast<int8_t>(number));
+		case ValueType::Int16: return Value(static_cast<int16_t>(number));
+		case ValueType::Int32: return Value(static_cast<int32_t>(number));
+		case ValueType::Int64: return Value(static_cast<int64_t>(number));
+		case ValueType::Float: return Value(static_cast<float>(number));
+		default: return Value(static_cast<double>(number));
+		}
+	}
+
+	//! \return VALUE_COUNT operands of a type, from 1 to 100 so every division is defined.
+	std::vector<Value> makeOperands(ValueType type, int seed) {
+		std::vector<Value> operands;
+		for (size_t i = 0; i < VALUE_COUNT; i++) operands.push_back(makeNumber(type, static_cast<int>((i * 7 + seed) % 100 + 1)));
+		return operands;
+	}
+
+	//!@{ \name Switch operators
+	//! The operators as they were before the kernel tables.
+
+	//! Applies an arithmetic operator in the type the result is given.
+	template<typename Op>
+	Value switchArithmetic(const Value& a, const Value& b) {
+		if (!(a.IsNumber() && b.IsNumber())) return Value();
+
+		Op op;
+		switch (smallestTypeNeeded(a.Type(), b.Type())) {
+		case ValueType::Int8: return Value(static_cast<int8_t>(op(a.AsValue<int8_t>(), b.AsValue<int8_t>())));
+		case ValueType::Int16: return Value(static_cast<int16_t>(op(a.AsValue<int16_t>(), b.AsValue<int16_t>())));
+		case ValueType::Int32: return Value(static_cast<int32_t>(op(a.AsValue<int32_t>(), b.AsValue<int32_t>())));
+		case ValueType::Int64: return Value(static_cast<int64_t>(op(a.AsValue<int64_t>(), b.AsValue<int64_t>())));
+		case ValueType::Float: return Value(static_cast<float>(op(a.AsValue<float>(), b.AsValue<float>())));
+		case ValueType::Double: return Value(static_cast<double>(op(a.AsValue<double>(), b.AsValue<double>())));
+		default: return Value();
+		}
+	}
+
+	//! Compares a number to a Value, switching on the type of the Value.
+	template<typename Op, typename T>
+	bool switchCompareTo(T lhs, const Value& b) {
+		Op op;
+		switch (b.Type()) {
+		case ValueType::Int8: return op(lhs, b.AsValue<int8_t>());
+		case ValueType::Int16: return op(lhs, b.AsValue<int16_t>());
+		case ValueType::Int32: return op(lhs, b.AsValue<int32_t>());
+		case ValueType::Int64: return op(lhs, b.AsValue<int64_t>());
+		case ValueType::Float: return op(lhs, b.AsValue<float>());
+		case ValueType::Double: return op(lhs, b.AsValue<double>());
+		default: return false;
+		}
+	}
+
+	//! Compares two numbers, switching on the type of each.
+	template<typename Op>
+	bool switchComparison(const Value& a, const Value& b) {
+		switch (a.Type()) {
+		case ValueType::Int8: return switchCompareTo<Op>(a.AsValue<int8_t>(), b);
+		case ValueType::Int16: return switchCompareTo<Op>(a.AsValue<int16_t>(), b);
+		case ValueType::Int32: return switchCompareTo<Op>(a.AsValue<int32_t>(), b);
+		case ValueType::Int64: return switchCompareTo<Op>(a.AsValue<int64_t>(), b);
+		case ValueType::Float: return switchCompareTo<Op>(a.AsValue<float>(), b);
+		case ValueType::Double: return switchCompareTo<Op>(a.AsValue<double>(), b);
+		default: return false;
+		}
+	}
+	//!@}
+
+	//! Times an operator over every pair of operands.
+	/*!
+	  \param op Operator to time, returning a Value or a bool.
+	  \param lhs Left operands.
+	  \param rhs Right operands.
+	  \param repeats Number of times the operands are run through.
+	  \param [in,out] checksum Mixed with the results, so they aren't optimized away.
+	  \return Nanoseconds per operation.
+	*/
+	template<typename Op>
+	double timeOperator(Op op, const std::vector<Value>& lhs, const std::vector<Value>& rhs, int repeats, double& checksum) {
+		std::vector<decltype(op(lhs[0], rhs[0]))> results(VALUE_COUNT);
+
+		auto start = std::chrono::steady_clock::now();
+		for (int repeat = 0; repeat < repeats; repeat++) {
+			for (size_t i = 0; i < VALUE_COUNT; i++) results[i] = op(lhs[i], rhs[i]);
+		}
+		std::chrono::duration<double, std::nano> time = std::chrono::steady_clock::now() - start;
+
+		for (const auto& result : results) checksum += Value(result).AsValue<double>();
+		return time.count() / (static_cast<double>(repeats) * VALUE_COUNT);
+	}
+
+	//! Times an operator through the kernel tables and through the switches, for every pair of types.
+	/*!
+	  \param name Name of the operator.
+	  \param table The operator of Value.
+	  \param switched The operator as a switch.
+	  \param repeats Number of times the operands of each pair are run through.
+	  \param [in,out] checksum Mixed with the results.
+	*/
+	template<typename Table, typename Switched>
+	void benchmarkOperator(const char* name, Table table, Switched switched, int repeats, double& checksum) {
+		double tableTotal = 0, switchTotal = 0;
+		int pairs = 0;
+
+		for (ValueType lhsType : NUMERIC_TYPES) {
+			std::vector<Value> lhs = makeOperands(lhsType, 3);
+			for (ValueType rhsType : NUMERIC_TYPES) {
+				std::vector<Value> rhs = makeOperands(rhsType, 11);
+
+				double tableTime = timeOperator(table, lhs, rhs, repeats, checksum);
+				double switchTime = timeOperator(switched, lhs, rhs, repeats, checksum);
+				tableTotal += tableTime;
+				switchTotal += switchTime;
+				pairs++;
+
+				std::cout << std::setw(3) << name << " " << std::setw(6) << ValueTypeToString(lhsType) << " " << std::setw(6) << ValueTypeToString(rhsType);
+				std::cout << std::setw(12) << tableTime << std::setw(12) << switchTime << std::endl;
+			}
+		}
+
+		std::cout << std::setw(3) << name << " " << std::setw(13) << "mean" << std::setw(12) << tableTotal / pairs << std::setw(12) << switchTotal / pairs << std::endl;
+	}
+}
+
+int main(int argc, char** argv) {
+	int repeats = argc > 1 ? std::atoi(argv[1]) : 2000;
+	double checksum = 0;
+
+	std::cout << std::fixed << std::setprecision(2);
+	std::cout << " op    lhs    rhs  table ns/op switch ns/op" << std::endl;
+
+	benchmarkOperator("+", [](const Value& a, const Value& b) { return a + b; }, switchArithmetic<std::plus<>>, repeats, checksum);
+	benchmarkOperator("-", [](const Value& a, const Value& b) { return a - b; }, switchArithmetic<std::minus<>>, repeats, checksum);
+	benchmarkOperator("*", [](const Value& a, const Value& b) { return a * b; }, switchArithmetic<std::multiplies<>>, repeats, checksum);
+	benchmarkOperator("/", [](const Value& a, const Value& b) { return a / b; }, switchArithmetic<std::divides<>>, repeats, checksum);
+	benchmarkOperator("==", [](const Value& a, const Value& b) { return a == b; }, switchComparison<std::equal_to<>>, repeats, checksum);
+	benchmarkOperator("<", [](const Value& a, const Value& b) { return a < b; }, switchComparison<std::less<>>, repeats, checksum);
+	benchmarkOperator("<=", [](const Value& a, const Value& b) { return a <= b; }, [](const Value& a, const Value& b) {
+		return switchComparison<std::less<>>(a, b) || switchComparison<std::equal_to<>>(a, b);
+	}, repeats, checksum);
+
+	std::cout << "Checksum " << checksum << std::endl;
+	return 0;
+}
@@ -0,0 +1,114 @@
+//! \file MemoryBenchmark.cpp
+//! \brief Compiles a large generated source and reports the peak memory of the process.
+/*!
+  The source is written to a temporary file and mapped like Iliad maps a script, so it isn't
+  copied. The peak resident set size, read from getrusage(), counts the pages of the source
+  read while compiling and the bytecode written, on top of what the Compiler keeps.
+
+  The Compiler pulls tokens from the Scanner as it parses. With --all-tokens, every token is
+  scanned first and kept while compiling, each with its own copy of its lexeme, as the parser
+  did before. Run both to compare: each run is its own process, so its peak is its own.
+
+  Usage: MemoryBenchmark [--all-tokens] [megabytes]
+*/
+#include "stdafx.h"
+#include "Compiler.h"
+#include "MappedFile.h"
+
+#include <sys/resource.h>
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+
+namespace {
+	//! A token as the parser kept them when it scanned the whole source first.
+	struct OwnedToken {
+		TokenType type; //!< Type of the token.
+		std::string lexeme; //!< Copy of the lexeme of the token.
+		int line; //!< Line of the token.
+	};
+
+	//! \return Peak resident set size of the process in megabytes.
+	double peakResidentMegabytes() {
+		rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+		return usage.ru_maxrss / (1024.0 * 1024.0); // Bytes.
+#else
+		return usage.ru_maxrss / 1024.0; // Kilobytes.
+#endif
+	}
+
+	//! Writes a source of blocks of locals, which compile to code without declaring globals.
+	/*!
+	  \param path Path of the file to write.
+	  \param size Number of bytes to write, rounded up to a whole line.
+	  \return False if the file couldn't be written.
+	*/
+	bool writeSource(const std::filesystem::path& path, size_t size) {
+		std::ofstream file(path, std::ios::binary);
+		std::string line;
+		for (size_t written = 0, i = 0; written < size && file; written += line.size(), i++) {
+			std::string number = std::to_string(i % 1000);
+			line = "{ int32 a" + number + " = " + number + "; int32 b = a" + number + " * 3 + 7; a" + number + " = b - a" + number + " / 2; }\n";
+			file << line;
+		}
+		return static_cast<bool>(file);
+	}
+}
+
+int main(int argc, char** argv) {
+	bool allTokens = false;
+	size_t megabytes = 100;
+	for (int i = 1; i < argc; i++) {
+		std::string argument = argv[i];
+		if (argument == "--all-tokens") allTokens = true;
+		else megabytes = std::strtoull(argv[i], nullptr, 10);
+	}
+
+	std::filesystem::path path = std::filesystem::temp_directory_path() / "IliadMemoryBenchmark.il";
+	if (!writeSource(path, megabytes * 1024 * 1024)) {
+		std::cerr << "Could not write " << path << "." << std::endl;
+		return 1;
+	}
+
+	int result = 0;
+	{
+		MappedFile file(path.string());
+		if (!file.IsOpen()) {
+			std::cerr << "Could not read " << path << ": " << file.Error() << std::endl;
+			std::filesystem::remove(path);
+			return 1;
+		}
+		double before = peakResidentMegabytes();
+
+		std::vector<OwnedToken> tokens;
+		if (allTokens) {
+			Scanner scanner(file.View());
+			Token token;
+			do {
+				token = scanner.ScanToken();
+				tokens.push_back({ token.type, std::string(token.lexeme), token.line });
+			} while (token.type != TokenType::EoF);
+		}
+
+		StringTable strings;
+		Compiler compiler;
+		auto chunk = std::make_shared<Chunk>();
+		if (!compiler.Compile(file.View(), chunk, strings)) {
+			std::cerr << "The source doesn't compile." << std::endl;
+			result = 1;
+		}
+
+		std::cout << std::fixed << std::setprecision(1);
+		std::cout << (allTokens ? "all tokens kept" : "tokens pulled") << ": " << file.View().size() / (1024.0 * 1024.0) << " MB of source";
+		if (allTokens) std::cout << ", " << tokens.size() << " tokens";
+		std::cout << ", " << chunk->codeSize() / (1024.0 * 1024.0) << " MB of bytecode" << std::endl;
+		std::cout << "peak RSS " << peakResidentMegabytes() << " MB, " << before << " MB before compiling" << std::endl;
+	}
+
+	std::filesystem::remove(path);
+	return result;
+}
@@ -0,0 +1,124 @@
+//! \file RegisterBenchmark.cpp
+//! \brief Runs the same scripts as stack bytecode and as register bytecode, and compares them.
+/*!
+  Built against a VM counting its VMStatistics. For each script and each bytecode, prints the
+  number of instructions dispatched and of Values copied while running, and the time of a run.
+
+  The built-in scripts declare their globals first, then run a body that only uses them. A body
+  declares nothing, so the VM caches it, and it is timed over many runs that don't compile. The
+  times include looking the body up in the cache.
+  Scripts given on the command line are run once, their counts include the declarations.
+
+  Usage: RegisterBenchmark [--runs count] [path...]
+*/
+#include "stdafx.h"
+#include "VM.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+namespace {
+	//! A script to benchmark.
+	struct Script {
+		std::string name; //!< Name printed for the script.
+		std::string setup; //!< Declarations, run once.
+		std::string body; //!< Code timed over many runs, empty to only run the setup once.
+	};
+
+	//! \return The body repeated count times.
+	std::string repeat(const std::string& body, int count) {
+		std::string code;
+		for (int i = 0; i < count; i++) code += body;
+		return code;
+	}
+
+	//! \return Scripts of straight code, the register bytecode has no jumps. Their values stay small.
+	std::vector<Script> builtInScripts() {
+		return {
+			{ "int32 globals", "int32 a = 1; int32 b = 2; int32 c = 3;",
+				repeat("a = (b + c) * 2 - a; b = c - b + a; c = a * 3 - b * 2;\n", 100) },
+			{ "mixed globals", "int8 p = 3; int16 q = 5; int64 r = 7; double s = 0.5;",
+				repeat("p = p * p - p * p + p; q = q - p + q - q; r = r * 2 - r + q; s = s * 0.5 + r;\n", 100) },
+			{ "locals", "int32 g = 1;",
+				repeat("{ int32 x = g; int32 y = x + 2; x = x * y - x; y = (x + y) - y * 2; g = y - x + 1; }\n", 100) },
+		};
+	}
+
+	//! Runs a script with one of the bytecodes and prints what the VM did.
+	/*!
+	  \param script Script to run.
+	  \param target Bytecode to run.
+	  \param runs Number of runs of the body timed.
+	  \return False if the script doesn't run.
+	*/
+	bool benchmark(const Script& script, CompileTarget target, int runs) {
+		VM vm;
+		vm.SetTarget(target);
+
+		const std::string& counted = script.body.empty() ? script.setup : script.body;
+		if (!script.body.empty() && vm.Interpret(script.setup) != InterpretResults::OK) return false;
+
+		// The counted run compiles the code, the timed runs take it from the cache.
+		vm.ResetStatistics();
+		if (vm.Interpret(counted) != InterpretResults::OK) return false;
+		VMStatistics statistics = vm.Statistics();
+
+		double time = 0;
+		if (!script.body.empty()) {
+			auto start = std::chrono::steady_clock::now();
+			for (int run = 0; run < runs; run++) vm.Interpret(script.body);
+			std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+			time = elapsed.count() / runs;
+		}
+
+		bool registers = target == CompileTarget::Registers;
+		std::cout << std::setw(16) << script.name << std::setw(10) << (registers ? "registers" : "stack");
+		std::cout << std::setw(12) << statistics.stackDispatches + statistics.registerDispatches << std::setw(12) << statistics.copies;
+		if (!script.body.empty()) std::cout << std::setw(12) << time;
+		else std::cout << std::setw(12) << "-";
+		// The register bytecode can't express every program, the VM runs the stack bytecode then.
+		if (registers && statistics.stackDispatches) std::cout << "  (ran as stack bytecode)";
+		std::cout << std::endl;
+		return true;
+	}
+}
+
+int main(int argc, char** argv) {
+	int runs = 2000;
+	std::vector<Script> scripts;
+
+	for (int i = 1; i < argc; i++) {
+		std::string argument = argv[i];
+		if (argument == "--runs" && i + 1 < argc) {
+			runs = std::atoi(argv[++i]);
+			continue;
+		}
+
+		std::ifstream file(argument);
+		if (!file) {
+			std::cerr << "Could not read \"" << argument << "\"." << std::endl;
+			return 1;
+		}
+		std::stringstream contents;
+		contents << file.rdbuf();
+		scripts.push_back({ argument, contents.str(), "" });
+	}
+	if (scripts.empty()) scripts = builtInScripts();
+
+	std::cout << std::fixed << std::setprecision(2);
+	std::cout << std::setw(16) << "script" << std::setw(10) << "bytecode" << std::setw(12) << "dispatches" << std::setw(12) << "copies" << std::setw(12) << "us/run" << std::endl;
+
+	int result = 0;
+	for (const Script& script : scripts) {
+		for (CompileTarget target : { CompileTarget::Stack, CompileTarget::Registers }) {
+			if (!benchmark(script, target, runs)) {
+				std::cerr << script.name << " doesn't run." << std::endl;
+				result = 1;
+			}
+		}
+	}
+	return result;
+}
@@ -0,0 +1,346 @@
+//! \file ScannerBenchmark.cpp
+//! \brief Measures the throughput of the Scanner in MB/s, against the scanner it replaced.
+/*!
+  PreviousScanner is the Scanner before the character class table and the block scans: it
+  classifies characters with isdigit()/isalpha() and chained comparisons, skips whitespace,
+  comments and strings a character at a time, and matches keywords with nested switches and
+  string comparisons. Both scanners go through the same input, and their tokens are checked to
+  be the same before they are timed. Build in release to get meaningful numbers.
+
+  The built-in input is a generated script of code, comments and strings. Scripts given on the
+  command line are scanned instead.
+
+  Usage: ScannerBenchmark [--repeats count] [path...]
+*/
+#include "stdafx.h"
+#include "Scanner.h"
+#include "MappedFile.h"
+
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+
+namespace {
+	//! The Scanner as it was before the character class table and the block scans.
+	class PreviousScanner {
+		std::string_view m_Source;
+		int m_Line = 1;
+		const char* m_TokenStart;
+		const char* m_CurrentChar;
+
+	public:
+		explicit PreviousScanner(std::string_view source) : m_Source(source), m_TokenStart(source.data()), m_CurrentChar(source.data()) {}
+
+		Token ScanToken() {
+			skipWhitespace();
+			m_TokenStart = m_CurrentChar;
+			if (isAtEnd()) return makeToken(TokenType::EoF);
+
+			char c = advance();
+			if (isdigit(c)) return number();
+			if (isalpha(c)) return identifier();
+
+			switch (c) {
+			case '(': return makeToken(TokenType::LeftParen);
+			case ')': return makeToken(TokenType::RightParen);
+			case '{': return makeToken(TokenType::LeftBrace);
+			case '}': return makeToken(TokenType::RightBrace);
+			case ';': return makeToken(TokenType::Semicolon);
+			case ',': return makeToken(TokenType::Comma);
+			case '.': return makeToken(TokenType::Dot);
+			case '-': return makeToken(TokenType::Minus);
+			case '+': return makeToken(TokenType::Plus);
+			case '*': return makeToken(TokenType::Star);
+			case '/': return makeToken(TokenType::Slash);
+			case '!': return makeToken(match('=') ? TokenType::BangEqual : TokenType::Bang);
+			case '=': return makeToken(match('=') ? TokenType::EqualEqual : TokenType::Equal);
+			case '<': return makeToken(match('=') ? TokenType::LessEqual : TokenType::Less);
+			case '>': return makeToken(match('=') ? TokenType::GreaterEqual : TokenType::Greater);
+			case '&': return match('&') ? makeToken(TokenType::And) : errorToken("Expected another '&' for 'and' operator.");
+			case '|': return match('|') ? makeToken(TokenType::Or) : errorToken("Expected another '|' for 'or' operator.");
+			case '\'': return character();
+			case '"': return string();
+			}
+
+			return errorToken("Unexpected character.");
+		}
+
+	private:
+		char advance() { m_CurrentChar++; return *(m_CurrentChar - 1); }
+		bool isAtEnd() const { return m_CurrentChar == m_Source.data() + m_Source.size(); }
+		char peek() const { return isAtEnd() ? '\0' : *m_CurrentChar; }
+		char peekNext() const { return isAtEnd() || m_CurrentChar + 1 == m_Source.data() + m_Source.size() ? '\0' : *(m_CurrentChar + 1); }
+		bool isDigit(char c) const { return c >= '0' && c <= '9'; }
+		bool isAlpha(char c) const { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; }
+
+		bool match(char expected) {
+			if (isAtEnd() || expected != *m_CurrentChar) return false;
+			m_CurrentChar++;
+			return true;
+		}
+
+		void skipWhitespace() {
+			while (true) {
+				switch (peek()) {
+				case ' ':
+				case '\r':
+				case '\t':
+					advance();
+					break;
+				case '\n':
+					m_Line++;
+					advance();
+					break;
+				case '/':
+					if (peekNext() != '/') return;
+					while (peek() != '\n' && !isAtEnd()) advance();
+					break;
+				default:
+					return;
+				}
+			}
+		}
+
+		Token character() {
+			if (isAtEnd()) return errorToken("Unterminated char literal.");
+
+			if (peek() == '\\') {
+				advance();
+				switch (peek()) {
+				case '\\':
+				case 'n':
+				case 'r':
+				case '0':
+				case '\'':
+				case '\"':
+					advance(); break;
+				default: return errorToken("Invalid escape character.");
+				}
+			} else advance();
+
+			if (isAtEnd() || peek() != '\'') return errorToken("Unterminated char literal.");
+			advance();
+			return makeToken(TokenType::Character);
+		}
+
+		Token string() {
+			while (peek() != '"' && !isAtEnd()) {
+				if (peek() == '\n') m_Line++;
+				advance();
+			}
+
+			if (isAtEnd()) return errorToken("Unterminated string.");
+			advance();
+			return makeToken(TokenType::String);
+		}
+
+		Token number() {
+			TokenType type = TokenType::Integer;
+			while (isDigit(peek())) advance();
+
+			if (peek() == '.') {
+				type = TokenType::Float;
+				advance();
+				while (isDigit(peek())) advance();
+			}
+			return makeToken(type);
+		}
+
+		Token identifier() {
+			while (isAlpha(peek()) || isDigit(peek())) advance();
+			return makeToken(identifierType());
+		}
+
+		TokenType checkKeyword(std::string_view token, std::string_view keyword, TokenType type) const { return token == keyword ? type : TokenType::Identifier; }
+
+		TokenType identifierType() {
+			const std::string_view token(m_TokenStart, m_CurrentChar - m_TokenStart);
+
+			switch (token[0]) {
+			case 'b': return checkKeyword(token, "bool", TokenType::DecBool);
+			case 'c':
+				if (token.length() > 1) {
+					switch (token[1]) {
+					case 'h': return checkKeyword(token, "char", TokenType::DecChar);
+					case 'l': return checkKeyword(token, "class", TokenType::Class);
+					}
+				}
+				break;
+			case 'd': return checkKeyword(token, "double", TokenType::DecDouble);
+			case 'e': return checkKeyword(token, "else", TokenType::Else);
+			case 'f':
+				if (token.length() > 1) {
+					switch (token[1]) {
+					case 'a': return checkKeyword(token, "false", TokenType::False);
+					case 'l': return checkKeyword(token, "float", TokenType::DecFloat);
+					case 'o': return checkKeyword(token, "for", TokenType::For);
+					}
+				}
+				break;
+			case 'i':
+				if (token.length() > 1) {
+					switch (token[1]) {
+					case 'f': return checkKeyword(token, "if", TokenType::If);
+					case 'n':
+						if (token.length() == 3) return checkKeyword(token, "int", TokenType::DecInt32);
+						else if (token.length() == 4) return checkKeyword(token, "int8", TokenType::DecInt8);
+						else if (token.length() == 5) {
+							switch (token[3]) {
+							case '1': return checkKeyword(token, "int16", TokenType::DecInt16);
+							case '3': return checkKeyword(token, "int32", TokenType::DecInt32);
+							case '6': return checkKeyword(token, "int64", TokenType::DecInt64);
+							}
+						}
+					}
+				}
+				break;
+			case 'r': return checkKeyword(token, "return", TokenType::Return);
+			case 's':
+				if (token.length() > 1) {
+					switch (token[1]) {
+					case 't': return checkKeyword(token, "string", TokenType::DecString);
+					case 'u': return checkKeyword(token, "super", TokenType::Super);
+					}
+				}
+				break;
+			case 't':
+				if (token.length() > 1) {
+					switch (token[1]) {
+					case 'h': return checkKeyword(token, "this", TokenType::This);
+					case 'r': return checkKeyword(token, "true", TokenType::True);
+					}
+				}
+				break;
+			case 'v': return checkKeyword(token, "var", TokenType::Var);
+			case 'w': return checkKeyword(token, "while", TokenType::While);
+			}
+
+			return TokenType::Identifier;
+		}
+
+		Token makeToken(TokenType type) const { return Token(type, std::string_view(m_TokenStart, m_CurrentChar - m_TokenStart), m_Line); }
+		Token errorToken(const char* message) const { return Token(TokenType::Error, message, m_Line); }
+	};
+
+	//! \return A script of about size bytes mixing declarations, loops, comments and strings.
+	std::string generateSource(size_t size) {
+		const char* const lines[] = {
+			"int32 counter = 0; // Counts the iterations of the loop below.\n",
+			"for (int32 i = 0; i < 1000; i = i + 1) { counter = counter + i * 2 - 1; }\n",
+			"\tstring greeting = \"Hello there, this is a string of a reasonable length.\";\n",
+			"    if (counter >= 42 && !false || counter != 7) { double ratio = 3.14159 / 2.0; }\n",
+			"// A longer comment, which the scanner skips whole without making any token of it at all.\n",
+			"var flag = true; char letter = 'x'; int64 total = counter * 100000 + 12345;\n",
+			"while (flag) { flag = false; float half = 0.5; bool done = half <= 1.0; }\n",
+		};
+
+		std::string source;
+		source.reserve(size + 128);
+		for (size_t i = 0; source.size() < size; i++) source += lines[i % (sizeof(lines) / sizeof(lines[0]))];
+		return source;
+	}
+
+	//! Scans a whole source, the scanner is built from it.
+	/*!
+	  \param source Source to scan.
+	  \param [in,out] checksum Mixed with the tokens, so they aren't optimized away.
+	  \return Number of tokens scanned, the EoF included.
+	*/
+	template<typename Scanner>
+	size_t scanAll(std::string_view source, size_t& checksum) {
+		Scanner scanner(source);
+		size_t count = 0;
+		Token token;
+		do {
+			token = scanner.ScanToken();
+			checksum += static_cast<size_t>(token.type) + token.lexeme.size() + token.line;
+			count++;
+		} while (token.type != TokenType::EoF);
+		return count;
+	}
+
+	//! \return If both scanners make the same tokens out of source.
+	bool sameTokens(std::string_view source) {
+		Scanner current(source);
+		PreviousScanner previous(source);
+		Token a, b;
+		do {
+			a = current.ScanToken();
+			b = previous.ScanToken();
+			if (a.type != b.type || a.lexeme != b.lexeme || a.line != b.line) return false;
+		} while (a.type != TokenType::EoF);
+		return true;
+	}
+
+	//! Times a scanner over a source, keeping the best of several runs.
+	/*!
+	  \param source Source to scan.
+	  \param repeats Number of runs.
+	  \param [in,out] checksum Mixed with the tokens.
+	  \return Throughput of the fastest run in MB/s.
+	*/
+	template<typename Scanner>
+	double throughput(std::string_view source, int repeats, size_t& checksum) {
+		double best = 0;
+		for (int repeat = 0; repeat < repeats; repeat++) {
+			auto start = std::chrono::steady_clock::now();
+			scanAll<Scanner>(source, checksum);
+			std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+			best = std::max(best, source.size() / (1024.0 * 1024.0) / time.count());
+		}
+		return best;
+	}
+
+	//! Prints the throughput of both scanners over a source.
+	/*!
+	  \return False if the scanners disagree on the tokens.
+	*/
+	bool benchmark(const std::string& name, std::string_view source, int repeats, size_t& checksum) {
+		if (!sameTokens(source)) {
+			std::cerr << name << ": the scanners make different tokens." << std::endl;
+			return false;
+		}
+
+		size_t tokens = scanAll<Scanner>(source, checksum);
+		double current = throughput<Scanner>(source, repeats, checksum);
+		double previous = throughput<PreviousScanner>(source, repeats, checksum);
+
+		std::cout << name << ": " << source.size() / (1024.0 * 1024.0) << " MB, " << tokens << " tokens" << std::endl;
+		std::cout << "  table and block scans " << std::setw(8) << current << " MB/s" << std::endl;
+		std::cout << "  previous scanner      " << std::setw(8) << previous << " MB/s" << std::endl;
+		return true;
+	}
+}
+
+int main(int argc, char** argv) {
+	int repeats = 5;
+	std::vector<std::string> paths;
+	for (int i = 1; i < argc; i++) {
+		std::string argument = argv[i];
+		if (argument == "--repeats" && i + 1 < argc) repeats = std::atoi(argv[++i]);
+		else paths.push_back(argument);
+	}
+
+	size_t checksum = 0;
+	int result = 0;
+	std::cout << std::fixed << std::setprecision(1);
+
+	if (paths.empty()) {
+		std::string source = generateSource(64 * 1024 * 1024);
+		if (!benchmark("generated", source, repeats, checksum)) result = 1;
+	}
+
+	for (const std::string& path : paths) {
+		MappedFile file(path);
+		if (!file.IsOpen()) {
+			std::cerr << "Could not read \"" << path << "\": " << file.Error() << std::endl;
+			result = 1;
+			continue;
+		}
+		if (!benchmark(path, file.View(), repeats, checksum)) result = 1;
+	}
+
+	std::cout << "Checksum " << checksum << std::endl;
+	return result;
+}
@@ -0,0 +1,267 @@
+#include "stdafx.h"
+#include "Bytecode.h"
+
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+
+#include "Compiler.h"
+#include "Object.h"
+
+//! "ILBC" read as a number in the byte order of the machine writing it.
+static const uint32_t BYTECODE_MAGIC = 'I' | 'L' << 8 | 'B' << 16 | 'C' << 24;
+
+namespace {
+	//! \return The data of a scalar as 64 bits.
+	uint64_t scalarBits(const Value& value) {
+		switch (value.Type()) {
+		case ValueType::Float:
+		{
+			float data = value.Get<ValueType::Float>();
+			uint32_t bits;
+			std::memcpy(&bits, &data, sizeof(bits));
+			return bits;
+		}
+		case ValueType::Double:
+		{
+			double data = value.Get<ValueType::Double>();
+			uint64_t bits;
+			std::memcpy(&bits, &data, sizeof(bits));
+			return bits;
+		}
+		case ValueType::Null: return 0;
+		default: return static_cast<uint64_t>(value.AsValue<int64_t>());
+		}
+	}
+
+	//! \return A scalar of type type made from the bits written by scalarBits().
+	Value scalarValue(ValueType type, uint64_t bits) {
+		switch (type) {
+		case ValueType::Int8: return Value(static_cast<int8_t>(bits));
+		case ValueType::Int16: return Value(static_cast<int16_t>(bits));
+		case ValueType::Int32: return Value(static_cast<int32_t>(bits));
+		case ValueType::Int64: return Value(static_cast<int64_t>(bits));
+		case ValueType::Float:
+		{
+			uint32_t data = static_cast<uint32_t>(bits);
+			float value;
+			std::memcpy(&value, &data, sizeof(value));
+			return Value(value);
+		}
+		case ValueType::Double:
+		{
+			double value;
+			std::memcpy(&value, &bits, sizeof(value));
+			return Value(value);
+		}
+		case ValueType::Char: return Value(static_cast<char>(bits));
+		case ValueType::Bool: return Value(bits != 0);
+		default: return Value();
+		}
+	}
+
+	//! FNV-1a over words of 8 bytes, the bytes after the last whole word one at a time.
+	/*!
+	  A change to the bytes of a single word always changes the result.
+	  \param data Bytes to hash.
+	  \param hash Hash of the bytes before data, to hash a file in several parts.
+	  \return The hash of the bytes before data and of data.
+	*/
+	uint64_t checksum(std::string_view data, uint64_t hash = 14695981039346656037ull) {
+		const uint64_t prime = 1099511628211ull;
+		size_t offset = 0;
+		for (; offset + sizeof(uint64_t) <= data.size(); offset += sizeof(uint64_t)) {
+			uint64_t word;
+			std::memcpy(&word, data.data() + offset, sizeof(word));
+			hash = (hash ^ word) * prime;
+		}
+		for (; offset < data.size(); offset++) {
+			hash = (hash ^ static_cast<uint8_t>(data[offset])) * prime;
+		}
+		return hash;
+	}
+
+	//! \return size rounded up to the next multiple of 8.
+	uint64_t align(uint64_t size) { return (size + 7) & ~uint64_t(7); }
+
+	//! \return If the section of size bytes at offset is inside a file of fileSize bytes.
+	bool inFile(uint64_t offset, uint64_t size, uint64_t fileSize) {
+		return offset <= fileSize && size <= fileSize - offset;
+	}
+}
+
+bool BytecodeFile::Write(const std::string& path, const Chunk& chunk, const Compiler& compiler, std::string& error) {
+	std::string characters;
+	std::vector<ConstantRecord> constants(chunk.m_Constants.size());
+	std::vector<GlobalRecord> globals(compiler.GlobalCount());
+
+	for (size_t index = 0; index < chunk.m_Constants.size(); index++) {
+		const Value& constant = chunk.m_Constants[index];
+		ConstantRecord& record = constants[index];
+		record.type = static_cast<uint8_t>(constant.Type());
+
+		if (StringObject* string = constant.AsString()) {
+			record.length = static_cast<uint32_t>(string->Length());
+			record.data = characters.size();
+			record.hash = string->Hash();
+			characters += string->Chars();
+		} else {
+			record.data = scalarBits(constant);
+		}
+	}
+
+	for (size_t slot = 0; slot < globals.size(); slot++) {
+		const std::string& name = compiler.GlobalName(slot);
+		globals[slot].nameOffset = static_cast<uint32_t>(characters.size());
+		globals[slot].nameLength = static_cast<uint32_t>(name.size());
+		globals[slot].type = static_cast<uint8_t>(compiler.GlobalType(slot));
+		characters += name;
+	}
+
+	if (characters.size() > UINT32_MAX) {
+		error = "Too many characters in strings for a bytecode file.";
+		return false;
+	}
+
+	Header header = {};
+	header.magic = BYTECODE_MAGIC;
+	header.version = BYTECODE_VERSION;
+	header.codeOffset = align(sizeof(Header));
+	header.codeSize = chunk.codeSize();
+	header.linesOffset = align(header.codeOffset + header.codeSize);
+	header.lineRunCount = chunk.m_Lines.size();
+	header.constantsOffset = align(header.linesOffset + header.lineRunCount * sizeof(LineRun));
+	header.constantCount = constants.size();
+	header.globalsOffset = align(header.constantsOffset + constants.size() * sizeof(ConstantRecord));
+	header.globalCount = globals.size();
+	header.charactersOffset = align(header.globalsOffset + globals.size() * sizeof(GlobalRecord));
+	header.charactersSize = characters.size();
+
+	std::string file(header.charactersOffset + header.charactersSize, '\0');
+	std::memcpy(&file[0], &header, sizeof(header));
+	if (header.codeSize) std::memcpy(&file[header.codeOffset], chunk.getStart(), header.codeSize);
+	if (header.lineRunCount) std::memcpy(&file[header.linesOffset], chunk.m_Lines.begin(), header.lineRunCount * sizeof(LineRun));
+	if (!constants.empty()) std::memcpy(&file[header.constantsOffset], constants.data(), constants.size() * sizeof(ConstantRecord));
+	if (!globals.empty()) std::memcpy(&file[header.globalsOffset], globals.data(), globals.size() * sizeof(GlobalRecord));
+	if (!characters.empty()) std::memcpy(&file[header.charactersOffset], characters.data(), characters.size());
+
+	// The checksum field is still 0 in the file, as Load() hashes it.
+	uint64_t sum = checksum(file);
+	std::memcpy(&file[offsetof(Header, checksum)], &sum, sizeof(sum));
+
+	std::ofstream output(path, std::ios::binary | std::ios::trunc);
+	output.write(file.data(), file.size());
+	if (!output) {
+		error = "Could not write \"" + path + "\".";
+		return false;
+	}
+
+	return true;
+}
+
+bool BytecodeFile::IsBytecode(std::string_view data) {
+	uint32_t magic;
+	if (data.size() < sizeof(magic)) return false;
+
+	std::memcpy(&magic, data.data(), sizeof(magic));
+	return magic == BYTECODE_MAGIC;
+}
+
+std::shared_ptr<Chunk> BytecodeFile::Load(std::string_view data, StringTable& strings, std::vector<Global>& globals, std::string& error) {
+	Header header;
+	if (data.size() < sizeof(header) || !IsBytecode(data)) {
+		error = "Not a bytecode file.";
+		return nullptr;
+	}
+
+	std::memcpy(&header, data.data(), sizeof(header));
+	if (header.version != BYTECODE_VERSION) {
+		error = "Bytecode version " + std::to_string(header.version) + " can't be loaded, this build reads version " + std::to_string(BYTECODE_VERSION) + ".";
+		return nullptr;
+	}
+
+	Header unsummed = header;
+	unsummed.checksum = 0;
+	uint64_t sum = checksum(std::string_view(reinterpret_cast<const char*>(&unsummed), sizeof(unsummed)));
+	if (checksum(data.substr(sizeof(header)), sum) != header.checksum) {
+		error = "Corrupted bytecode file, its checksum doesn't match.";
+		return nullptr;
+	}
+
+	const uint64_t size = data.size();
+	if (!inFile(header.codeOffset, header.codeSize, size) ||
+		header.lineRunCount > size / sizeof(LineRun) || !inFile(header.linesOffset, header.lineRunCount * sizeof(LineRun), size) ||
+		header.constantCount > size / sizeof(ConstantRecord) || !inFile(header.constantsOffset, header.constantCount * sizeof(ConstantRecord), size) ||
+		header.globalCount > size / sizeof(GlobalRecord) || !inFile(header.globalsOffset, header.globalCount * sizeof(GlobalRecord), size) ||
+		!inFile(header.charactersOffset, header.charactersSize, size)) {
+		error = "Truncated bytecode file.";
+		return nullptr;
+	}
+
+	std::string_view characters = data.substr(header.charactersOffset, header.charactersSize);
+	auto isType = [](uint8_t type) { return type <= static_cast<uint8_t>(ValueType::Null); };
+
+	auto chunk = std::make_shared<Chunk>();
+	chunk->m_MappedCode = reinterpret_cast<const byte*>(data.data() + header.codeOffset);
+	chunk->m_MappedCodeSize = header.codeSize;
+
+	// The runs are only read through the LineTable, which searches them by offset.
+	const char* runs = data.data() + header.linesOffset;
+	if (reinterpret_cast<uintptr_t>(runs) % alignof(LineRun) != 0) {
+		error = "Misaligned line table in bytecode file.";
+		return nullptr;
+	}
+	chunk->m_Lines.m_MappedRuns = reinterpret_cast<const LineRun*>(runs);
+	chunk->m_Lines.m_MappedRunCount = header.lineRunCount;
+
+	bool hasLines = header.codeSize == 0 ? header.lineRunCount == 0 : header.lineRunCount > 0 && chunk->m_Lines.begin()->start == 0;
+	for (const LineRun* run = chunk->m_Lines.begin(); hasLines && run != chunk->m_Lines.end(); run++) {
+		hasLines = run->start < header.codeSize && (run == chunk->m_Lines.begin() || run->start > (run - 1)->start);
+	}
+	if (!hasLines) {
+		error = "Invalid line table in bytecode file.";
+		return nullptr;
+	}
+
+	chunk->m_Constants.reserve(header.constantCount);
+	for (uint64_t index = 0; index < header.constantCount; index++) {
+		ConstantRecord record;
+		std::memcpy(&record, data.data() + header.constantsOffset + index * sizeof(record), sizeof(record));
+
+		if (!isType(record.type)) {
+			error = "Invalid constant in bytecode file.";
+			return nullptr;
+		}
+
+		ValueType type = static_cast<ValueType>(record.type);
+		if (type == ValueType::String) {
+			if (!inFile(record.data, record.length, characters.size())) {
+				error = "Invalid string constant in bytecode file.";
+				return nullptr;
+			}
+			chunk->m_Constants.emplace_back(strings.InternInPlace(characters.substr(record.data, record.length), static_cast<size_t>(record.hash)));
+		} else {
+			chunk->m_Constants.push_back(scalarValue(type, record.data));
+		}
+	}
+
+	globals.clear();
+	globals.reserve(header.globalCount);
+	for (uint64_t slot = 0; slot < header.globalCount; slot++) {
+		GlobalRecord record;
+		std::memcpy(&record, data.data() + header.globalsOffset + slot * sizeof(record), sizeof(record));
+
+		if (!isType(record.type) || !inFile(record.nameOffset, record.nameLength, characters.size())) {
+			error = "Invalid global in bytecode file.";
+			return nullptr;
+		}
+		globals.push_back({ characters.substr(record.nameOffset, record.nameLength), static_cast<ValueType>(record.type) });
+	}
+
+	if (!chunk->validate(globals.size())) {
+		error = "Invalid code in bytecode file.";
+		return nullptr;
+	}
+
+	return chunk;
+}
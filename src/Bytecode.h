@@ -0,0 +1,103 @@
+//! \file Bytecode.h
+//! \brief Details the file format compiled chunks are saved in.
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Chunk.h"
+
+class Compiler;
+class StringTable;
+
+//! Version of the bytecode format. Files of another version are refused.
+#define BYTECODE_VERSION 7
+
+//! Writes compiled chunks to bytecode files, and loads them back.
+/*!
+  A bytecode file is laid out to be used where it is mapped in memory, loading it doesn't parse
+  anything. It starts with a Header giving the place of every section, each section starting on
+  an 8 byte boundary:
+  - Code: the stack bytecode, run in place.
+  - Lines: the LineRun of each line of code, by offset. Used in place by the LineTable.
+  - Constants: a ConstantRecord each.
+  - Globals: a GlobalRecord each, the globals the code was compiled against, in slot order.
+  - Characters: the characters of the string constants and of the names of the globals. String
+	constants view them in place.
+
+  Numbers are written in the byte order of the machine. The magic number reads backwards on a
+  machine of the other byte order, so its files are refused instead of misread.
+
+  The header holds a checksum of the whole file, so a file damaged on the disk or in transit is
+  refused before anything in it is trusted.
+*/
+class BytecodeFile {
+public:
+	//! A global variable the code of a file uses.
+	struct Global {
+		std::string_view name; //!< Name of the variable, a view of the file.
+		ValueType type; //!< Type of the variable.
+	};
+
+	//! Writes a compiled chunk to a file.
+	/*!
+	  \param path Path of the file to write.
+	  \param chunk Chunk to write, compiled from a single source.
+	  \param compiler Compiler that compiled the chunk, for the globals it uses.
+	  \param [out] error Why the file couldn't be written.
+	  \return True if the file was written.
+	*/
+	static bool Write(const std::string& path, const Chunk& chunk, const Compiler& compiler, std::string& error);
+
+	//! \return If data starts like a bytecode file, of any version.
+	static bool IsBytecode(std::string_view data);
+
+	//! Loads a chunk from the contents of a bytecode file.
+	/*!
+	  The chunk runs its code from data, and its string constants are interned in strings as views
+	  of data, so data has to outlive the chunk and every string it made.
+	  \param data Contents of the file, usually mapped.
+	  \param strings Intern table of the VM that will run the chunk.
+	  \param [out] globals Global variables the chunk uses, by slot.
+	  \param [out] error Why the file couldn't be loaded.
+	  \return The chunk, or nullptr if data isn't a valid bytecode file of this version.
+	*/
+	static std::shared_ptr<Chunk> Load(std::string_view data, StringTable& strings, std::vector<Global>& globals, std::string& error);
+
+private:
+	//! Start of a bytecode file.
+	struct Header {
+		uint32_t magic; //!< BYTECODE_MAGIC.
+		uint32_t version; //!< BYTECODE_VERSION of the writer.
+		uint64_t checksum; //!< checksum() of the file, with this field set to 0.
+		uint64_t codeOffset; //!< Offset of the code.
+		uint64_t codeSize; //!< Bytes of code.
+		uint64_t linesOffset; //!< Offset of the line runs.
+		uint64_t lineRunCount; //!< Number of line runs.
+		uint64_t constantsOffset; //!< Offset of the constants.
+		uint64_t constantCount; //!< Number of constants.
+		uint64_t globalsOffset; //!< Offset of the globals.
+		uint64_t globalCount; //!< Number of globals.
+		uint64_t charactersOffset; //!< Offset of the characters.
+		uint64_t charactersSize; //!< Number of characters.
+	};
+
+	//! A constant of the chunk.
+	struct ConstantRecord {
+		uint8_t type; //!< ValueType of the constant.
+		uint8_t padding[3];
+		uint32_t length; //!< Length of a string.
+		uint64_t data; //!< Bits of a scalar, or offset of the characters of a string in the characters section.
+		uint64_t hash; //!< HashString() of a string, so it is interned without reading it.
+	};
+
+	//! A global variable the code uses.
+	struct GlobalRecord {
+		uint32_t nameOffset; //!< Offset of the name in the characters section.
+		uint32_t nameLength; //!< Length of the name.
+		uint8_t type; //!< ValueType of the variable.
+		uint8_t padding[7];
+	};
+};
@@ -1,15 +1,450 @@
 #include "stdafx.h"
 #include "Chunk.h"
 
+#include <algorithm>
+#include <array>
+
+namespace {
+	//! Shift of the number of variable length operands in INSTRUCTION_LENGTHS.
+	const int VARIABLE_OPERANDS_SHIFT = 6;
+
+	//! \return An entry of INSTRUCTION_LENGTHS.
+	constexpr byte instructionLayout(int fixedBytes, int variableOperands) {
+		return static_cast<byte>(fixedBytes | variableOperands << VARIABLE_OPERANDS_SHIFT);
+	}
+
+	//! Layout of each instruction by opcode: the bytes of the instruction before its operands
+	//! written like constant indices, global slots and constant indices, and how many of those
+	//! follow, shifted by VARIABLE_OPERANDS_SHIFT.
+	const std::array<byte, OPCODE_COUNT> INSTRUCTION_LENGTHS = []() {
+		std::array<byte, OPCODE_COUNT> lengths{};
+		lengths.fill(1);
+		for (OpCode op : { OpCode::IntLiteral, OpCode::FloatLiteral, OpCode::CharLiteral, OpCode::StringLiteral,
+			OpCode::VarAssign, OpCode::VarDeclarAndAssign, OpCode::Var }) {
+			lengths[static_cast<size_t>(op)] = instructionLayout(1, 1);
+		}
+		for (OpCode op : { OpCode::LocalDeclar, OpCode::GetLocal, OpCode::SetLocal, OpCode::I32ToI64, OpCode::I32ToF32,
+			OpCode::I32ToF64, OpCode::I64ToF32, OpCode::I64ToF64, OpCode::F32ToF64, OpCode::Convert, OpCode::PopN }) {
+			lengths[static_cast<size_t>(op)] = 2;
+		}
+		lengths[static_cast<size_t>(OpCode::VarDeclar)] = instructionLayout(2, 1);
+
+		for (size_t op = static_cast<size_t>(OpCode::VarVar); op <= static_cast<size_t>(OpCode::LocalConstantMultiplyI32); op++) {
+			switch (superinstructionLoads(static_cast<OpCode>(op))) {
+			case OpCode::VarVar:
+			case OpCode::VarConstant: lengths[op] = instructionLayout(1, 2); break;
+			case OpCode::LocalConstant: lengths[op] = instructionLayout(2, 1); break;
+			default: lengths[op] = 3; break;
+			}
+		}
+
+		for (size_t op = static_cast<size_t>(OpCode::Jump); op <= static_cast<size_t>(OpCode::JumpIfGreaterI32Long); op++) {
+			lengths[op] = isLongJump(static_cast<OpCode>(op)) ? 3 : 2;
+		}
+		return lengths;
+	}();
+}
+
+void LineTable::Set(size_t offset, int line) {
+	Truncate(offset);
+	if (m_Runs.empty() || m_Runs.back().line != line) {
+		m_Runs.push_back({ static_cast<uint32_t>(offset), static_cast<int32_t>(line) });
+	}
+}
+
+int LineTable::Get(size_t offset) const {
+	// The run holding offset is the last one starting at or before it.
+	auto run = std::upper_bound(begin(), end(), offset, [](size_t offset, const LineRun& run) { return offset < run.start; });
+	return run == begin() ? 0 : (run - 1)->line;
+}
+
+void LineTable::Truncate(size_t size) {
+	while (!m_Runs.empty() && m_Runs.back().start >= size) {
+		m_Runs.pop_back();
+	}
+}
+
 void Chunk::writeByte(byte byte, int line) { 
+	m_Lines.Set(m_Code.size(), line);
 	m_Code.push_back(byte);
-	m_Lines.push_back(line);
-
 }
 
-int Chunk::addConstant(const Value& constant) { 
+size_t Chunk::addConstant(const Value& constant) { 
+	auto iter = m_ConstantIndices.find(constant);
+	if (iter != m_ConstantIndices.end()) return iter->second;
+
 	m_Constants.push_back(constant);
-	return static_cast<int>(m_Constants.size()) - 1;
+	m_ConstantIndices.insert({ constant, m_Constants.size() - 1 });
+	return m_Constants.size() - 1;
+}
+
+void Chunk::writeConstantIndex(size_t index, int line) {
+	while (index >= 0x80) {
+		writeByte(static_cast<byte>(index | 0x80), line);
+		index >>= 7;
+	}
+	writeByte(static_cast<byte>(index), line);
+}
+
+void Chunk::truncate(size_t codeSize, size_t constantCount) {
+	m_Code.resize(codeSize);
+	m_Lines.Truncate(codeSize);
+
+	for (size_t i = constantCount; i < m_Constants.size(); i++) {
+		m_ConstantIndices.erase(m_Constants[i]);
+	}
+	m_Constants.resize(constantCount);
+}
+
+int Chunk::maxStackDepth(std::vector<int>* depths) const {
+	int depth = 0;
+	int maxDepth = 0;
+
+	const byte* code = getStart();
+	const size_t size = codeSize();
+	if (depths) depths->assign(size, -1);
+
+	// Depth of the stack at each target of a jump, -1 until something reaching the target is found.
+	std::vector<size_t> targets;
+	for (size_t offset = 0; offset < size; offset += instructionLength(&code[offset])) {
+		if (isJump(static_cast<OpCode>(code[offset]))) targets.push_back(jumpTarget(code, offset));
+	}
+	std::sort(targets.begin(), targets.end());
+	targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+	std::vector<int> targetDepths(targets.size(), -1);
+
+	// The code is gone through again while a jump going back finds the depth of code skipped
+	// before, like the increment of a for loop.
+	bool skipped = true;
+	while (skipped) {
+		skipped = false;
+		size_t nextTarget = 0;
+		depth = 0;
+
+		// Code right after an unconditional jump only runs if a jump goes to it.
+		bool reachable = true;
+
+		size_t offset = 0;
+		while (offset < size) {
+			while (nextTarget < targets.size() && targets[nextTarget] < offset) nextTarget++;
+			if (nextTarget < targets.size() && targets[nextTarget] == offset) {
+				int& targetDepth = targetDepths[nextTarget];
+				if (!reachable && targetDepth != -1) {
+					depth = targetDepth;
+					reachable = true;
+				} else if (reachable) {
+					if (targetDepth != -1 && targetDepth != depth) return -1;
+					targetDepth = depth;
+				}
+			}
+
+			OpCode op = static_cast<OpCode>(code[offset]);
+			if (!reachable) {
+				offset += instructionLength(&code[offset]);
+				continue;
+			}
+
+			if (depths) (*depths)[offset] = depth;
+
+			int pops = 0;
+			int pushes = 0;
+			size_t length = 1;
+
+			switch (op) {
+			case OpCode::IntLiteral:
+			case OpCode::FloatLiteral:
+			case OpCode::CharLiteral:
+			case OpCode::StringLiteral:
+			{
+				const byte* operand = &code[offset + 1];
+				readConstantIndex(operand);
+				pushes = 1; length = operand - &code[offset]; break;
+			}
+			case OpCode::Var:
+				pushes = 1; length = instructionLength(&code[offset]); break;
+			case OpCode::TrueLiteral:
+			case OpCode::FalseLiteral:
+			case OpCode::Null:
+				pushes = 1; break;
+			case OpCode::VarDeclar: length = instructionLength(&code[offset]); break;
+			case OpCode::VarAssign: pops = 1; pushes = 1; length = instructionLength(&code[offset]); break;
+			case OpCode::VarDeclarAndAssign: pops = 1; length = instructionLength(&code[offset]); break;
+			case OpCode::LocalDeclar: pushes = 1; length = 2; break;
+			case OpCode::GetLocal:
+				if (code[offset + 1] >= depth) return -1;
+				pushes = 1; length = 2; break;
+			case OpCode::SetLocal:
+				// The local is below the value assigned to it.
+				if (code[offset + 1] + 1 >= depth) return -1;
+				pops = 1; pushes = 1; length = 2; break;
+			case OpCode::Not:
+			case OpCode::Negate:
+				pops = 1; pushes = 1; break;
+			case OpCode::I32ToI64:
+			case OpCode::I32ToF32:
+			case OpCode::I32ToF64:
+			case OpCode::I64ToF32:
+			case OpCode::I64ToF64:
+			case OpCode::F32ToF64:
+				// The value converted is below the top of the stack, everything above it stays.
+				pops = code[offset + 1] + 1; pushes = pops; length = 2; break;
+			case OpCode::Convert: pops = 1; pushes = 1; length = 2; break;
+			case OpCode::Pop: pops = 1; break;
+			case OpCode::PopN: pops = code[offset + 1]; length = 2; break;
+			case OpCode::Return: break;
+			case OpCode::Jump:
+			case OpCode::JumpLong:
+			case OpCode::Loop:
+			case OpCode::LoopLong:
+				length = instructionLength(&code[offset]); break;
+			case OpCode::JumpIfFalse:
+			case OpCode::JumpIfFalseLong:
+			case OpCode::JumpIfTrue:
+			case OpCode::JumpIfTrueLong:
+			case OpCode::JumpIfFalseOrPop:
+			case OpCode::JumpIfFalseOrPopLong:
+			case OpCode::JumpIfTrueOrPop:
+			case OpCode::JumpIfTrueOrPopLong:
+				pops = 1; length = instructionLength(&code[offset]); break;
+			default:
+			{
+				if (isJump(op)) {
+					// Fused comparisons pop both of their operands.
+					pops = 2; length = instructionLength(&code[offset]); break;
+				}
+
+				OpCode loads = superinstructionLoads(op);
+				if (loads == OpCode::Return) {
+					// Binary operators.
+					pops = 2; pushes = 1; break;
+				}
+
+				// Both locals are read before anything is pushed.
+				if ((loads == OpCode::LocalLocal || loads == OpCode::LocalConstant) && code[offset + 1] >= depth) return -1;
+				if (loads == OpCode::LocalLocal && code[offset + 2] >= depth) return -1;
+				pushes = op == loads ? 2 : 1;
+				length = instructionLength(&code[offset]);
+				break;
+			}
+			}
+
+			if (depth < pops) return -1;
+
+			depth += pushes - pops;
+			maxDepth = std::max(maxDepth, depth);
+
+			if (isJump(op)) {
+				size_t target = jumpTarget(code, offset);
+				size_t index = std::lower_bound(targets.begin(), targets.end(), target) - targets.begin();
+				int& targetDepth = targetDepths[index];
+
+				// The jumps of && and || only pop their bool when they don't jump.
+				int jumpDepth = keepsBoolOnJump(op) ? depth + 1 : depth;
+				if (targetDepth != -1 && targetDepth != jumpDepth) return -1;
+
+				// Code at a target behind the jump was skipped if nothing had reached it yet.
+				if (targetDepth == -1 && target <= offset) skipped = true;
+				targetDepth = jumpDepth;
+
+				if (isUnconditionalJump(op)) reachable = false;
+			} else if (op == OpCode::Return) {
+				reachable = false;
+			}
+
+			offset += length;
+		}
+	}
+
+	return maxDepth;
+}
+
+bool Chunk::validate(size_t globalCount) const {
+	const byte* code = getStart();
+	const byte* end = code + codeSize();
+	OpCode op = OpCode::Null;
+
+	auto isType = [](byte type) { return type <= static_cast<byte>(ValueType::Null); };
+
+	// Decoded by hand, readConstantIndex() doesn't know where the code ends.
+	auto readIndexBelow = [&code, end](size_t limit, size_t& index) {
+		index = 0;
+		int shift = 0;
+		byte next;
+		do {
+			if (code == end || shift > 56) return false;
+			next = *code++;
+			index |= static_cast<size_t>(next & 0x7f) << shift;
+			shift += 7;
+		} while (next & 0x80);
+
+		return index < limit;
+	};
+	auto isGlobalSlot = [globalCount, &readIndexBelow]() {
+		size_t slot;
+		return readIndexBelow(globalCount, slot);
+	};
+
+	// The VM pushes constants without looking at them, and the instructions after them trust
+	// their types. A literal holds a constant of the types the Compiler gives it: the peephole
+	// optimizer converts the constants of number literals to the type they are used as.
+	auto isConstantOf = [this, &readIndexBelow](auto accepts) {
+		size_t index;
+		return readIndexBelow(m_Constants.size(), index) && accepts(m_Constants[index].Type());
+	};
+	auto isNumber = [](ValueType type) { return IsNumber(type); };
+	auto isLiteral = [](ValueType type) { return IsNumber(type) || type == ValueType::Char || type == ValueType::String; };
+
+	// Jumps are checked once every instruction start is known.
+	std::vector<bool> starts(codeSize());
+	std::vector<size_t> targets;
+
+	while (code < end) {
+		if (*code >= OPCODE_COUNT) return false;
+		starts[code - getStart()] = true;
+		op = static_cast<OpCode>(*code++);
+
+		if (isJump(op)) {
+			size_t operands = isLongJump(op) ? 2 : 1;
+			if (static_cast<size_t>(end - code) < operands) return false;
+
+			// A loop going before the start of the code wraps around to a target past its end.
+			targets.push_back(jumpTarget(getStart(), code - 1 - getStart()));
+			code += operands;
+			continue;
+		}
+
+		switch (op) {
+		case OpCode::IntLiteral:
+		case OpCode::FloatLiteral:
+			if (!isConstantOf(isNumber)) return false;
+			break;
+		case OpCode::CharLiteral:
+			if (!isConstantOf([](ValueType type) { return type == ValueType::Char; })) return false;
+			break;
+		case OpCode::StringLiteral:
+			if (!isConstantOf([](ValueType type) { return type == ValueType::String; })) return false;
+			break;
+		case OpCode::VarDeclar:
+			if (code == end || !isType(*code++) || !isGlobalSlot()) return false;
+			break;
+		case OpCode::VarAssign:
+		case OpCode::VarDeclarAndAssign:
+		case OpCode::Var:
+			if (!isGlobalSlot()) return false;
+			break;
+		case OpCode::LocalDeclar:
+		case OpCode::Convert:
+			if (code == end || !isType(*code)) return false;
+			code++;
+			break;
+		case OpCode::GetLocal:
+		case OpCode::SetLocal:
+		case OpCode::I32ToI64:
+		case OpCode::I32ToF32:
+		case OpCode::I32ToF64:
+		case OpCode::I64ToF32:
+		case OpCode::I64ToF64:
+		case OpCode::F32ToF64:
+		case OpCode::PopN:
+			if (code == end) return false;
+			code++;
+			break;
+		default:
+		{
+			OpCode loads = superinstructionLoads(op);
+			if (loads == OpCode::Return) break;
+
+			if (loads == OpCode::VarVar || loads == OpCode::VarConstant) {
+				if (!isGlobalSlot()) return false;
+			} else {
+				if (code == end) return false;
+				code++;
+			}
+
+			if (loads == OpCode::VarConstant || loads == OpCode::LocalConstant) {
+				// Typed operators are only fused with int32 constants.
+				if (op != loads && !isConstantOf([](ValueType type) { return type == ValueType::Int32; })) return false;
+				if (op == loads && !isConstantOf(isLiteral)) return false;
+			} else if (loads == OpCode::VarVar) {
+				if (!isGlobalSlot()) return false;
+			} else {
+				if (code == end) return false;
+				code++;
+			}
+			break;
+		}
+		}
+	}
+
+	for (size_t target : targets) {
+		if (target >= starts.size() || !starts[target]) return false;
+	}
+
+	// Local slots and the depth of the stack are checked by maxStackDepth() before the code runs.
+	return op == OpCode::Return;
+}
+
+size_t instructionLength(const byte* code) {
+	byte layout = INSTRUCTION_LENGTHS[*code];
+	int variableOperands = layout >> VARIABLE_OPERANDS_SHIFT;
+	if (variableOperands == 0) return layout;
+
+	const byte* operand = code + (layout & ((1 << VARIABLE_OPERANDS_SHIFT) - 1));
+	for (int i = 0; i < variableOperands; i++) readConstantIndex(operand);
+	return operand - code;
+}
+
+ValueType widenedType(OpCode op) {
+	switch (op) {
+	case OpCode::I32ToI64: return ValueType::Int64;
+	case OpCode::I32ToF32:
+	case OpCode::I64ToF32: return ValueType::Float;
+	default: return ValueType::Double;
+	}
+}
+
+OpCode superinstructionLoads(OpCode op) {
+	const int fusedOpCount = static_cast<int>(OpCode::VarConstantEqualI32) - static_cast<int>(OpCode::VarVarEqualI32);
+
+	if (op >= OpCode::VarVar && op <= OpCode::LocalConstant) return op;
+	if (op < OpCode::VarVarEqualI32 || op > OpCode::LocalConstantMultiplyI32) return OpCode::Return;
+
+	int group = (static_cast<int>(op) - static_cast<int>(OpCode::VarVarEqualI32)) / fusedOpCount;
+	return static_cast<OpCode>(static_cast<int>(OpCode::VarVar) + group);
+}
+
+OpCode fusedJumpOpCode(OpCode comparison, bool jumpIf, bool isLong) {
+	// Jumping when a comparison is true is jumping when the opposite comparison is false. Typed
+	// comparisons go equal, not equal, greater, greater equal, less, less equal.
+	static const int OPPOSITES[] = { 1, 0, 5, 4, 3, 2 };
+
+	int offset = static_cast<int>(comparison) - static_cast<int>(OpCode::EqualI32);
+	if (jumpIf) offset = OPPOSITES[offset];
+	return jumpOfWidth(static_cast<OpCode>(static_cast<int>(OpCode::JumpIfNotEqualI32) + offset * 2), isLong);
+}
+
+size_t jumpTarget(const byte* code, size_t offset) {
+	OpCode op = static_cast<OpCode>(code[offset]);
+	size_t end = offset + (isLongJump(op) ? 3 : 2);
+	size_t distance = isLongJump(op) ? code[offset + 1] | code[offset + 2] << 8 : code[offset + 1];
+
+	return op == OpCode::Loop || op == OpCode::LoopLong ? end - distance : end + distance;
+}
+
+bool setJumpTarget(byte* code, size_t offset, size_t target) {
+	OpCode op = static_cast<OpCode>(code[offset]);
+	bool isLong = isLongJump(op);
+	size_t end = offset + (isLong ? 3 : 2);
+
+	bool backward = op == OpCode::Loop || op == OpCode::LoopLong;
+	if (backward ? target > end : target < end) return false;
+
+	size_t distance = backward ? end - target : target - end;
+	if (distance > (isLong ? UINT16_MAX : UINT8_MAX)) return false;
+
+	code[offset + 1] = static_cast<byte>(distance);
+	if (isLong) code[offset + 2] = static_cast<byte>(distance >> 8);
+	return true;
 }
 
 OpCode valueTypeToOpCode(ValueType type) {
@@ -21,3 +456,43 @@ OpCode valueTypeToOpCode(ValueType type) {
 	default: return OpCode::Return;
 	}
 }
+
+OpCode typedOpCode(OpCode op, ValueType type) {
+	if (op < OpCode::Equal || op > OpCode::Divide) return op;
+
+	const int typedOpCount = static_cast<int>(OpCode::EqualI64) - static_cast<int>(OpCode::EqualI32);
+	int group;
+
+	switch (type) {
+	case ValueType::Int32: group = 0; break;
+	case ValueType::Int64: group = 1; break;
+	case ValueType::Float: group = 2; break;
+	case ValueType::Double: group = 3; break;
+	default: return op;
+	}
+
+	int offset = static_cast<int>(op) - static_cast<int>(OpCode::Equal);
+	return static_cast<OpCode>(static_cast<int>(OpCode::EqualI32) + group * typedOpCount + offset);
+}
+
+OpCode wideningOpCode(ValueType from, ValueType to) {
+	switch (from) {
+	case ValueType::Int32:
+		switch (to) {
+		case ValueType::Int64: return OpCode::I32ToI64;
+		case ValueType::Float: return OpCode::I32ToF32;
+		case ValueType::Double: return OpCode::I32ToF64;
+		default: return OpCode::Return;
+		}
+	case ValueType::Int64:
+		switch (to) {
+		case ValueType::Float: return OpCode::I64ToF32;
+		case ValueType::Double: return OpCode::I64ToF64;
+		default: return OpCode::Return;
+		}
+	case ValueType::Float:
+		return to == ValueType::Double ? OpCode::F32ToF64 : OpCode::Return;
+	default:
+		return OpCode::Return;
+	}
+}
@@ -3,6 +3,10 @@
 #pragma once
 
 #include "stdafx.h"
+
+#include <memory>
+#include <unordered_map>
+
 #include "Value.h"
 
 
@@ -14,18 +18,27 @@
 */
 enum class OpCode : byte {
 	//!@{
-	//! Literal values
+	//! Literal values. The operand of the literals with a constant is the index of the constant,
+	//! written with writeConstantIndex().
 	IntLiteral, FloatLiteral,
 	CharLiteral, StringLiteral,
 	TrueLiteral, FalseLiteral,
 	//!@}
 
 	//!@{
-	//! Variables
+	//! Global variables. Their operand is the slot the Compiler gave the variable, written like a
+	//! constant index with Chunk::writeGlobalSlot(). VarDeclar takes the ValueType of the
+	//! variable first.
 	VarDeclar, VarAssign,
 	VarDeclarAndAssign, Var,
 	//!@}
 
+	//!@{
+	//! Local variables. A local lives in a stack slot, the operand of GetLocal and SetLocal is
+	//! the slot. LocalDeclar pushes an uninitialized value of the ValueType given by its operand.
+	LocalDeclar, GetLocal, SetLocal,
+	//!@}
+
 	//!@{
 	//! Binary Operators
 	Equal, NotEqual,
@@ -42,16 +55,284 @@ enum class OpCode : byte {
 	Negate,
 	//!@}
 
+	//!@{
+	//! Binary operators specialized for two operands of the same type, chosen by the Compiler when
+	//! it knows the type of both operands. The VM runs them without checking the types. Each group
+	//! follows the order of the generic binary operators, see typedOpCode().
+	EqualI32, NotEqualI32, GreaterI32, GreaterEqualI32, LessI32, LessEqualI32,
+	AddI32, SubtractI32, MultiplyI32, DivideI32,
+	EqualI64, NotEqualI64, GreaterI64, GreaterEqualI64, LessI64, LessEqualI64,
+	AddI64, SubtractI64, MultiplyI64, DivideI64,
+	EqualF32, NotEqualF32, GreaterF32, GreaterEqualF32, LessF32, LessEqualF32,
+	AddF32, SubtractF32, MultiplyF32, DivideF32,
+	EqualF64, NotEqualF64, GreaterF64, GreaterEqualF64, LessF64, LessEqualF64,
+	AddF64, SubtractF64, MultiplyF64, DivideF64,
+	//!@}
+
+	//!@{
+	//! Widening conversions, used to bring both operands of a typed operator to the same type.
+	//! Their operand is the distance from the top of the stack of the value to convert.
+	I32ToI64, I32ToF32, I32ToF64,
+	I64ToF32, I64ToF64,
+	F32ToF64,
+	//!@}
+
+	//! Converts the value on top of the stack to the ValueType given by its operand.
+	Convert,
+
+	//!@{
+	//! Superinstructions, chosen by Chunk::selectSuperinstructions() for sequences of
+	//! instructions common enough that dispatching each of them is a noticeable cost. Each one does
+	//! the work of the instructions it replaces, and takes their operands in the same order.
+	//! - Loads: two loads, Var, GetLocal or a literal with a constant, pushing both values.
+	//! - Typed operators: one of the loads followed by an int32 operator, pushing the result. Each
+	//!   group follows the order of the typed operators, without the division.
+	VarVar, VarConstant, LocalLocal, LocalConstant,
+	VarVarEqualI32, VarVarNotEqualI32, VarVarGreaterI32, VarVarGreaterEqualI32, VarVarLessI32, VarVarLessEqualI32,
+	VarVarAddI32, VarVarSubtractI32, VarVarMultiplyI32,
+	VarConstantEqualI32, VarConstantNotEqualI32, VarConstantGreaterI32, VarConstantGreaterEqualI32, VarConstantLessI32, VarConstantLessEqualI32,
+	VarConstantAddI32, VarConstantSubtractI32, VarConstantMultiplyI32,
+	LocalLocalEqualI32, LocalLocalNotEqualI32, LocalLocalGreaterI32, LocalLocalGreaterEqualI32, LocalLocalLessI32, LocalLocalLessEqualI32,
+	LocalLocalAddI32, LocalLocalSubtractI32, LocalLocalMultiplyI32,
+	LocalConstantEqualI32, LocalConstantNotEqualI32, LocalConstantGreaterI32, LocalConstantGreaterEqualI32, LocalConstantLessI32, LocalConstantLessEqualI32,
+	LocalConstantAddI32, LocalConstantSubtractI32, LocalConstantMultiplyI32,
+	//!@}
+
+	//!@{
+	//! Jumps. Their operand is the distance of the jump, counted from the end of the instruction:
+	//! a byte for short jumps, two bytes, lowest first, for the long jump following each of them.
+	//! Loop jumps backward, the others forward. JumpIfFalse and JumpIfTrue pop a bool and jump on
+	//! its value. The jumps of && and ||, JumpIfFalseOrPop and JumpIfTrueOrPop, leave the bool on
+	//! the stack when they jump and pop it when they don't.
+	Jump, JumpLong,
+	JumpIfFalse, JumpIfFalseLong,
+	JumpIfTrue, JumpIfTrueLong,
+	JumpIfFalseOrPop, JumpIfFalseOrPopLong,
+	JumpIfTrueOrPop, JumpIfTrueOrPopLong,
+	Loop, LoopLong,
+	//!@}
+
+	//!@{
+	//! An int32 comparison fused with the JumpIfFalse or JumpIfTrue after it by
+	//! Chunk::threadJumps(). They pop both operands and jump if the comparison they're named after
+	//! is true, so a comparison followed by JumpIfFalse becomes the jump of the opposite comparison.
+	//! They follow the order of the typed comparisons they come from, see fusedJumpOpCode().
+	JumpIfNotEqualI32, JumpIfNotEqualI32Long,
+	JumpIfEqualI32, JumpIfEqualI32Long,
+	JumpIfLessEqualI32, JumpIfLessEqualI32Long,
+	JumpIfLessI32, JumpIfLessI32Long,
+	JumpIfGreaterEqualI32, JumpIfGreaterEqualI32Long,
+	JumpIfGreaterI32, JumpIfGreaterI32Long,
+	//!@}
+
 	//!
 	Null,
 
+	//! Discards the value on top of the stack.
+	Pop,
+
+	//! Discards as many values from the top of the stack as its operand says.
+	PopN,
+
 	//! Return
 	Return
 };
 
+//! The number of OpCode values.
+constexpr size_t OPCODE_COUNT = static_cast<size_t>(OpCode::Return) + 1;
+
 //! A Helper function to convert a ValueType into byte code.
 OpCode valueTypeToOpCode(ValueType type);
 
+//! Finds the typed version of a generic binary operator.
+/*!
+  \param op A generic binary operator, from OpCode::Equal to OpCode::Divide.
+  \param type The type of both operands.
+  \return The operator specialized for type, or op itself if there is none.
+*/
+OpCode typedOpCode(OpCode op, ValueType type);
+
+//! Finds the opcode converting a number to a wider type.
+/*!
+  \param from Type of the value to convert.
+  \param to Type to convert the value to.
+  \return The widening opcode, or OpCode::Return if there is none.
+*/
+OpCode wideningOpCode(ValueType from, ValueType to);
+
+//! \return Type a widening opcode, from OpCode::I32ToI64 to OpCode::F32ToF64, converts to.
+ValueType widenedType(OpCode op);
+
+//! Finds the loads a superinstruction starts with.
+/*!
+  \param op Any opcode.
+  \return OpCode::VarVar, OpCode::VarConstant, OpCode::LocalLocal or OpCode::LocalConstant, or
+  OpCode::Return if op isn't a superinstruction.
+*/
+OpCode superinstructionLoads(OpCode op);
+
+//!@{ \name Jumps
+
+//! \return If op is one of the jumps, from OpCode::Jump to OpCode::JumpIfGreaterI32Long.
+inline bool isJump(OpCode op) { return op >= OpCode::Jump && op <= OpCode::JumpIfGreaterI32Long; }
+
+//! \return If a jump has a two byte distance.
+inline bool isLongJump(OpCode op) { return (static_cast<int>(op) - static_cast<int>(OpCode::Jump)) % 2 == 1; }
+
+//! \return The short or long version of a jump.
+inline OpCode jumpOfWidth(OpCode op, bool isLong) {
+	int shortOp = static_cast<int>(op) - (isLongJump(op) ? 1 : 0);
+	return static_cast<OpCode>(shortOp + (isLong ? 1 : 0));
+}
+
+//! \return If a jump always jumps: OpCode::Jump, OpCode::Loop and their long versions.
+inline bool isUnconditionalJump(OpCode op) { return op == OpCode::Jump || op == OpCode::JumpLong || op == OpCode::Loop || op == OpCode::LoopLong; }
+
+//! \return If a jump leaves its bool on the stack when it jumps, like the jumps of && and ||.
+inline bool keepsBoolOnJump(OpCode op) { return op >= OpCode::JumpIfFalseOrPop && op <= OpCode::JumpIfTrueOrPopLong; }
+
+//! Finds the fused comparison and jump replacing an int32 comparison followed by a conditional jump.
+/*!
+  \param comparison A comparison, from OpCode::EqualI32 to OpCode::LessEqualI32.
+  \param jumpIf Value of the comparison the jump after it jumps on.
+  \param isLong If the fused jump has a two byte distance.
+  \return The fused jump.
+*/
+OpCode fusedJumpOpCode(OpCode comparison, bool jumpIf, bool isLong);
+
+//! Finds where a jump goes.
+/*!
+  \param code Start of the code.
+  \param offset Offset of the jump.
+  \return Offset of the instruction the jump goes to.
+*/
+size_t jumpTarget(const byte* code, size_t offset);
+
+//! Writes the distance of a jump to a target.
+/*!
+  \param code Start of the code.
+  \param offset Offset of the jump.
+  \param target Offset the jump has to go to, in the direction of the jump.
+  \return False if the distance doesn't fit the jump, which is left as it is.
+*/
+bool setJumpTarget(byte* code, size_t offset, size_t target);
+//!@}
+
+//! Reads a constant index written by Chunk::writeConstantIndex().
+/*!
+  \param code Pointer to the first byte of the index, moved past its last byte.
+  \return The index.
+*/
+inline size_t readConstantIndex(const byte*& code) {
+	byte next = *code++;
+	if (next < 0x80) return next;
+
+	size_t index = next & 0x7f;
+	int shift = 7;
+	do {
+		next = *code++;
+		index |= static_cast<size_t>(next & 0x7f) << shift;
+		shift += 7;
+	} while (next & 0x80);
+
+	return index;
+}
+
+//! Reads a global slot written by Chunk::writeGlobalSlot().
+/*!
+  \param code Pointer to the first byte of the slot, moved past its last byte.
+  \return The slot.
+*/
+inline size_t readGlobalSlot(const byte*& code) { return readConstantIndex(code); }
+
+//! Finds the length of an instruction of the stack bytecode.
+/*!
+  \param code Pointer to the opcode of the instruction.
+  \return Number of bytes of the instruction, operands included.
+*/
+size_t instructionLength(const byte* code);
+
+//! A three-address instruction of the register bytecode.
+/*!
+  Register instructions reuse the opcodes of the stack bytecode, but instead of popping their
+  operands they name them. Operands are indices in the frame of the RegisterCode, where the
+  registers come first and the constants follow them, so an operand is read the same way whether
+  it is a register or a constant.
+  - Binary operators: a = b op c.
+  - Unary operators: a = op b.
+  - Widening conversions and OpCode::Convert: convert register a in place, to type for Convert.
+  - OpCode::Var: a = global slot b.
+  - OpCode::VarAssign and OpCode::VarDeclarAndAssign: global slot a = b.
+  - OpCode::VarDeclar: declares global slot a, of type type.
+  - OpCode::LocalDeclar: a = an uninitialized value of type type.
+  - OpCode::GetLocal and OpCode::SetLocal: a = b.
+*/
+struct RegisterInstruction {
+	OpCode op; //!< Operation of the instruction.
+	byte type; //!< ValueType operand of OpCode::VarDeclar and OpCode::Convert.
+	uint16_t a; //!< Destination, or the global slot for instructions storing to a variable.
+	uint16_t b; //!< First source operand.
+	uint16_t c; //!< Second source operand.
+};
+
+//! Register bytecode translated from the stack bytecode of a Chunk.
+/*!
+  Each stack slot the stack bytecode would use becomes a register, numbered by its depth in the
+  stack. Literals are never loaded, instructions name the constant directly, and operators write
+  their result straight into a register, so the register code only dispatches on instructions
+  that compute something.
+*/
+struct RegisterCode {
+	std::vector<RegisterInstruction> code; //!< Instructions to run.
+	std::vector<size_t> origins; //!< Offset in the stack bytecode each instruction was translated from, for errors.
+	std::vector<Value> frame; //!< Initial frame: registerCount uninitialized registers, then the constants.
+	size_t registerCount = 0; //!< Number of registers at the start of the frame.
+};
+
+//! Bytes of code on the same line, starting at an offset.
+struct LineRun {
+	uint32_t start; //!< Offset of the first byte of the run.
+	int32_t line; //!< Line of every byte of the run.
+};
+
+//! Lines of the code of a Chunk, stored as runs of bytes on the same line.
+/*!
+  A line of source compiles to many bytes of code, so only the offsets where the line changes are
+  stored, sorted by offset. The line of a byte is found with a binary search over the runs, lines
+  are only looked up to report errors and to disassemble. A table loaded from a bytecode file
+  views the runs where the file is mapped.
+*/
+class LineTable {
+private:
+	std::vector<LineRun> m_Runs; //!< Runs written with Set().
+	const LineRun* m_MappedRuns = nullptr; //!< Runs of a table loaded from a bytecode file, used instead of m_Runs.
+	size_t m_MappedRunCount = 0; //!< Number of runs at m_MappedRuns.
+
+	friend class BytecodeFile;
+
+public:
+	//! Gives a line to the bytes of code from an offset on.
+	/*!
+	  Lines given to bytes after offset are forgotten, so code rewritten from an earlier offset
+	  sets its lines again as it is written.
+	  \param offset Offset of the first byte on the line.
+	  \param line Line of the bytes.
+	*/
+	void Set(size_t offset, int line);
+
+	//! \return Line of the byte of code at offset, or 0 if no line was set before it.
+	int Get(size_t offset) const;
+
+	//! Forgets the lines of the bytes from size on.
+	void Truncate(size_t size);
+
+	//!@{ Runs of the table, by offset.
+	const LineRun* begin() const { return m_MappedRuns ? m_MappedRuns : m_Runs.data(); }
+	const LineRun* end() const { return begin() + size(); }
+	size_t size() const { return m_MappedRuns ? m_MappedRunCount : m_Runs.size(); }
+	//!@}
+};
+
 //! A chunk of byte code.
 /*!
   A Chunk is a class with a resizable array of unsigned 8-bit values that represent bytecode. A
@@ -61,14 +342,28 @@ OpCode valueTypeToOpCode(ValueType type);
 class Chunk {
 private:
 	std::vector<byte> m_Code; //!< Byte representation of code to be interpreted.
-	std::vector<int> m_Lines; //!< Line at which each byte of code occured on.
+	LineTable m_Lines; //!< Line at which each byte of code occured on.
+	const byte* m_MappedCode = nullptr; //!< Code of a chunk loaded from a bytecode file, run where the file is mapped instead of from m_Code.
+	size_t m_MappedCodeSize = 0; //!< Number of bytes at m_MappedCode.
+
+	//! Hashes constants with Value::Hash().
+	struct ConstantHasher {
+		size_t operator()(const Value& value) const { return value.Hash(); }
+	};
+
+	//! Compares constants with Value::Identical().
+	struct ConstantEqual {
+		bool operator()(const Value& lhs, const Value& rhs) const { return lhs.Identical(rhs); }
+	};
+
+	std::unordered_map<Value, size_t, ConstantHasher, ConstantEqual> m_ConstantIndices; //!< Index of each constant in m_Constants.
 
-#ifdef _DEBUG
 	friend class Debugger;
-#endif // _DEBUG
+	friend class BytecodeFile;
 
 public:
 	std::vector<Value> m_Constants; //!< An array of constants.
+	std::unique_ptr<RegisterCode> m_RegisterCode; //!< Register version of the code, nullptr if the chunk only has stack bytecode.
 
 	//! Write byte of code to m_Code.
 	/*!
@@ -82,13 +377,120 @@ public:
 
 	//! Add a constant Value to m_Constants.
 	/*!
+	  An identical constant already in m_Constants is reused instead, see Value::Identical().
 	  \param constant Value to add to m_Constants
 	  \return Index of m_Constants where value was added.
 	*/
-	int addConstant(const Value& constant);
+	size_t addConstant(const Value& constant);
+
+	//! Writes the index of a constant as the operand of an instruction.
+	/*!
+	  The index is written 7 bits at a time, lowest bits first, with the high bit of every byte but
+	  the last one set. The first 128 constants take a single byte.
+	  \param index Index of the constant in m_Constants.
+	  \param line Line on which the code occurred on.
+	*/
+	void writeConstantIndex(size_t index, int line);
+
+	//! Writes the slot of a global variable as the operand of an instruction.
+	/*!
+	  Slots are written like constant indices, the first 128 globals take a single byte.
+	  \param slot Slot the Compiler gave the variable.
+	  \param line Line on which the code occurred on.
+	*/
+	void writeGlobalSlot(size_t slot, int line) { writeConstantIndex(slot, line); }
+
+	//! Points a jump already written at a target.
+	/*!
+	  \param offset Offset of the jump.
+	  \param target Offset the jump has to go to, in the direction of the jump.
+	  \return False if the target is too far for the jump.
+	*/
+	bool patchJump(size_t offset, size_t target) { return setJumpTarget(m_Code.data(), offset, target); }
+
+	//! Removes the code and constants written after a given point.
+	/*!
+	  \param codeSize Number of bytes of code to keep.
+	  \param constantCount Number of constants to keep.
+	*/
+	void truncate(size_t codeSize, size_t constantCount);
+
+	//! Translates the finished stack bytecode into m_RegisterCode.
+	/*!
+	  Implemented in RegisterCode.cpp. The chunk keeps its stack bytecode either way.
+	  \return True if the code was translated, false if it uses an instruction the register
+	  bytecode can't express, or needs a frame or a global slot bigger than an operand can index.
+	*/
+	bool translateToRegisters();
+
+	//! Runs the peephole optimizer over the finished stack bytecode.
+	/*!
+	  Implemented in Peephole.cpp. Short windows of instructions are rewritten into fewer
+	  instructions doing the same thing, such as a double negation, a negated literal, or a store
+	  to a variable followed by a load of it. Rewritten instructions take the line of the first
+	  instruction of their window. A window never reaches past the target of a jump, so every
+	  window runs straight through, and jumps are pointed again at the instructions they went to.
+	  Only code written with writeByte() can be optimized, not code mapped from a file.
+	  \return Number of instructions removed.
+	*/
+	size_t optimize();
+
+	//! Shortens the jumps of the finished stack bytecode.
+	/*!
+	  Implemented in Peephole.cpp, runs after optimize().
+	  - A jump to an unconditional jump goes straight to where the chain of jumps ends, when the
+	    direction of the jump allows it.
+	  - A jump of && or || to a jump on the bool it leaves goes where that jump sends the bool.
+	  - An int32 comparison followed by OpCode::JumpIfFalse or OpCode::JumpIfTrue becomes a single
+	    fused jump.
+	  - Long jumps whose distance fits in a byte become short jumps.
+	  \return Number of instructions removed.
+	*/
+	size_t threadJumps();
+
+	//! Replaces common sequences of stack instructions with superinstructions.
+	/*!
+	  Implemented in Peephole.cpp. Runs after optimize(), over stack bytecode that isn't
+	  translated to registers: the register bytecode refers to offsets of the stack bytecode, and
+	  doesn't know the superinstructions. Superinstructions take the line of the first instruction
+	  they replace, and never replace the target of a jump unless it's their first instruction.
+	  \return Number of instructions removed.
+	*/
+	size_t selectSuperinstructions();
+
+	//! Finds how deep the code grows the stack.
+	/*!
+	  Every instruction pops and pushes a fixed number of values, so the depth of the stack at
+	  each instruction is known before the code runs. Every way of reaching the target of a jump
+	  has to reach it with the same depth, the Compiler only jumps between statements.
+	  \param depths If not nullptr, receives the depth of the stack before each instruction, by
+	  offset. Instructions that never run, and bytes inside instructions, are left at -1.
+	  \return The most values the stack holds while running the code, or -1 if an instruction
+	  would pop more values than the stack holds or use a local slot the stack doesn't have, or if
+	  the depths at the target of a jump differ.
+	*/
+	int maxStackDepth(std::vector<int>* depths = nullptr) const;
+
+	//! Checks that code read from a file can be run.
+	/*!
+	  Every instruction has to be whole, with a known opcode and operands in range, jumps have to
+	  go to the start of an instruction, and the code has to end with a return. The constants of
+	  literals and superinstructions have to be of a type the Compiler gives them. The types of
+	  the other values on the stack aren't checked, typed instructions trust the Compiler that
+	  wrote the file.
+	  \param globalCount Number of global slots the code can use.
+	  \return True if the VM can run the code.
+	*/
+	bool validate(size_t globalCount) const;
+
+	//! \return Line of the byte of code at offset.
+	int getLine(size_t offset) const { return m_Lines.Get(offset); }
+
+	//! \return Number of bytes of code written so far.
+	size_t codeSize() const { return m_MappedCode ? m_MappedCodeSize : m_Code.size(); }
 
 	/*!
 	  \return Pointer to the beginning of the bytecode
 	*/
-	const byte* getStart() { return m_Code.data(); };
+	const byte* getStart() const { return m_MappedCode ? m_MappedCode : m_Code.data(); };
 };
\ No newline at end of file
@@ -0,0 +1,52 @@
+#include "stdafx.h"
+#include "ChunkCache.h"
+
+#include "Object.h"
+
+const ChunkCache::Entry* ChunkCache::Find(std::string_view source, size_t globalsVersion) {
+	if (m_Capacity == 0) {
+		m_Misses++;
+		return nullptr;
+	}
+
+	auto index = m_Index.find(HashString(source));
+	if (index == m_Index.end() || index->second->source != source) {
+		m_Misses++;
+		return nullptr;
+	}
+
+	auto entry = index->second;
+	if (entry->globalsVersion != globalsVersion) {
+		m_Entries.erase(entry);
+		m_Index.erase(index);
+		m_Misses++;
+		return nullptr;
+	}
+
+	m_Entries.splice(m_Entries.begin(), m_Entries, entry);
+	m_Hits++;
+	return &*entry;
+}
+
+void ChunkCache::Insert(Entry entry) {
+	if (m_Capacity == 0) return;
+
+	size_t hash = HashString(entry.source);
+
+	auto index = m_Index.find(hash);
+	if (index != m_Index.end()) {
+		m_Entries.erase(index->second);
+		m_Index.erase(index);
+	}
+
+	m_Entries.push_front(std::move(entry));
+	m_Index.insert({ hash, m_Entries.begin() });
+	evict();
+}
+
+void ChunkCache::evict() {
+	while (m_Entries.size() > m_Capacity) {
+		m_Index.erase(HashString(m_Entries.back().source));
+		m_Entries.pop_back();
+	}
+}
@@ -0,0 +1,89 @@
+//! \file ChunkCache.h
+//! \brief Details the cache of compiled chunks kept by a VM.
+#pragma once
+
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "Chunk.h"
+
+//! The default number of chunks a ChunkCache holds.
+#define CHUNK_CACHE_CAPACITY 64
+
+//! A cache of compiled chunks, indexed by the hash of their source code.
+/*!
+  Embedders tend to interpret the same snippets over and over, the cache lets the VM skip
+  scanning and compiling them again. It holds a bounded number of chunks and evicts the least
+  recently used one when it is full.
+
+  A chunk is only valid for the globals it was compiled against. Each entry remembers the
+  Compiler's globals version, see Compiler::GlobalsVersion(), and is dropped when it changed.
+*/
+class ChunkCache {
+public:
+	//! A compiled chunk and what it was compiled from.
+	struct Entry {
+		std::string source; //!< Source code of the chunk, compared on lookup in case two sources share a hash.
+		std::shared_ptr<Chunk> chunk; //!< The compiled chunk, ready to run.
+		int stackDepth; //!< Chunk::maxStackDepth() of the chunk, so it isn't computed on every run.
+		size_t globalsVersion; //!< Globals version of the Compiler when the chunk was compiled.
+	};
+
+private:
+	std::list<Entry> m_Entries; //!< Cached chunks, the most recently used first.
+	std::unordered_map<size_t, std::list<Entry>::iterator> m_Index; //!< Entries by the hash of their source.
+	size_t m_Capacity; //!< Most entries the cache holds at once. 0 disables the cache.
+	size_t m_Hits = 0; //!< Number of lookups that found a valid chunk.
+	size_t m_Misses = 0; //!< Number of lookups that didn't.
+
+	//! Removes the least recently used entries until there are at most m_Capacity.
+	void evict();
+
+public:
+	//! Creates an empty cache.
+	/*!
+	  \param capacity Most chunks the cache holds at once. 0 disables the cache.
+	*/
+	explicit ChunkCache(size_t capacity = CHUNK_CACHE_CAPACITY) : m_Capacity(capacity) {}
+
+	//! Finds the chunk compiled from a source.
+	/*!
+	  Counts a hit or a miss, and marks the entry found as the most recently used.
+	  \param source Source code to look up.
+	  \param globalsVersion Current globals version of the Compiler. An entry compiled for another one is dropped.
+	  \return The entry, or nullptr if there is no valid chunk for the source.
+	*/
+	const Entry* Find(std::string_view source, size_t globalsVersion);
+
+	//! Adds a compiled chunk, evicting the least recently used one if the cache is full.
+	/*!
+	  \param entry The chunk and what it was compiled from. Replaces an entry with the same hash.
+	*/
+	void Insert(Entry entry);
+
+	//! Removes every chunk. The counters are kept.
+	void Clear() { m_Entries.clear(); m_Index.clear(); }
+
+	//! Changes the number of chunks the cache holds, evicting the extra ones.
+	/*!
+	  \param capacity Most chunks the cache holds at once. 0 disables the cache.
+	*/
+	void SetCapacity(size_t capacity) { m_Capacity = capacity; evict(); }
+
+	//!@{ \name Statistics
+
+	//! \return Number of lookups that found a valid chunk.
+	size_t Hits() const { return m_Hits; }
+	//! \return Number of lookups that didn't find a valid chunk.
+	size_t Misses() const { return m_Misses; }
+	//! \return Number of chunks in the cache.
+	size_t Size() const { return m_Entries.size(); }
+	//! \return Most chunks the cache holds at once.
+	size_t Capacity() const { return m_Capacity; }
+	//! Sets the hit and miss counters back to 0.
+	void ResetStatistics() { m_Hits = 0; m_Misses = 0; }
+	//!@}
+};
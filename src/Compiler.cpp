@@ -1,6 +1,9 @@
 #include "stdafx.h"
 #include "Compiler.h"
 
+#include <charconv>
+#include <climits>
+
 #ifdef DEBUG_PRINT_CODE
 #include "Debug.h"
 #endif // DEBUG_PRINT_CODE
@@ -28,8 +31,8 @@ const std::array<Compiler::ParseRule, Token::NUMBER_OF_TOKENS> Compiler::m_Rules
 	ParseRule(NO_FUNC, &Compiler::binary, ParsePrecedence::Comparison),		//!< Token GreaterEqual
 	ParseRule(NO_FUNC, &Compiler::binary, ParsePrecedence::Comparison),		//!< Token Less
 	ParseRule(NO_FUNC, &Compiler::binary, ParsePrecedence::Comparison),		//!< Token LessEqual
-	ParseRule(&Compiler::binary, NO_FUNC, ParsePrecedence::And),			//!< Token And
-	ParseRule(&Compiler::binary, NO_FUNC, ParsePrecedence::Or),				//!< Token Or
+	ParseRule(NO_FUNC, &Compiler::logical, ParsePrecedence::And),			//!< Token And
+	ParseRule(NO_FUNC, &Compiler::logical, ParsePrecedence::Or),			//!< Token Or
 	ParseRule(&Compiler::variable, NO_FUNC),								//!< Token Identifier
 	ParseRule(&Compiler::character, NO_FUNC),								//!< Token Character
 	ParseRule(&Compiler::string, NO_FUNC),									//!< Token String
@@ -59,34 +62,69 @@ const std::array<Compiler::ParseRule, Token::NUMBER_OF_TOKENS> Compiler::m_Rules
 	ParseRule(),															//!< Token EoF
 };
 
-bool Compiler::Compile(const std::string& source, std::shared_ptr<Chunk> chunk) {
-	m_Scanner = std::make_unique<Scanner>(source);
+bool Compiler::Compile(std::string_view source, std::shared_ptr<Chunk> chunk, StringTable& strings) {
 	m_CompilingChunk = chunk;
+	m_Strings = &strings;
+
+	size_t globalCount = m_GlobalNames.size();
+	m_Locals.clear();
+	m_ScopeDepth = 0;
 
-	m_Parser.StartParser(*m_Scanner);
-	do {
+	if (m_ParallelScan) {
+		m_Tokens = std::make_unique<TokenList>(Scanner::ScanAllTokensParallel(source));
+		m_Parser.StartParser(*m_Tokens);
+	} else {
+		m_Scanner = std::make_unique<Scanner>(source);
+		m_Parser.StartParser(*m_Scanner);
+	}
+	while (CurrentToken().type != TokenType::EoF) {
 		declaration();
-	} while (CurrentToken().type != TokenType::EoF);
+	}
 	endCompiler();
+
+	// The tokens of a parallel scan take memory in proportion to the source.
+	m_Tokens.reset();
+
+	if (m_Parser.hadError) {
+		// The code never runs, so the globals it declared are never defined.
+		if (m_GlobalNames.size() > globalCount) {
+			for (size_t slot = globalCount; slot < m_GlobalNames.size(); slot++) {
+				m_Globals.erase(m_GlobalNames[slot]);
+			}
+			m_GlobalNames.resize(globalCount);
+			m_GlobalsVersion++;
+		}
+	}
+
 	return !m_Parser.hadError;
 }
 
+int Compiler::DeclareGlobal(std::string_view name, ValueType type) {
+	if (m_Globals.find(name) != m_Globals.end() || m_GlobalNames.size() >= INT_MAX) return -1;
+
+	m_GlobalNames.emplace_back(name);
+	Global& global = m_Globals[m_GlobalNames.back()];
+	global.slot = m_GlobalNames.size() - 1;
+	global.type = type;
+	return static_cast<int>(global.slot);
+}
+
 void Compiler::advance() {
 
 	if (CurrentToken().type == TokenType::EoF) return;
 
 	while (true) {
 
-		m_Parser.currentToken++;
+		m_Parser.NextToken();
 
 		if (CurrentToken().type != TokenType::Error) break;
 
-		errorAtCurrent(CurrentToken().lexeme.c_str());
+		errorAtCurrent(std::string(CurrentToken().lexeme));
 	}
 }
 
 bool Compiler::match(TokenType expectedToken) {
-	if ((m_Parser.currentToken)->type == expectedToken) {
+	if (CurrentToken().type == expectedToken) {
 		advance();
 		return true;
 	}
@@ -109,12 +147,17 @@ void Compiler::unary(bool canAssign) {
 	TokenType op = opToken.type;
 
 	// Compile the operand
+	size_t operandStart = m_CompilingChunk->codeSize();
 	parsePrecedence(ParsePrecedence::Unary);
 
 	ValueType rhs = m_Parser.currentExpression;
+	std::optional<ConstantExpression> operand = currentConstant();
 
 	switch (op) {
-	case TokenType::Bang: emitByte(OpCode::Not); break;
+	case TokenType::Bang:
+		emitByte(OpCode::Not);
+		m_Parser.currentExpression = ValueType::Bool;
+		break;
 	case TokenType::Minus:
 		if (!IsNumber(rhs)) {
 			errorAt(opToken, "Incorrect value. Expected number, found " + ValueTypeToString(rhs) + ".");
@@ -123,6 +166,8 @@ void Compiler::unary(bool canAssign) {
 	default:
 		return;	// Unreachable
 	}
+
+	if (operand && operand->codeStart == operandStart) foldUnary(op, *operand);
 }
 
 void Compiler::binary(bool canAssign) {
@@ -131,20 +176,22 @@ void Compiler::binary(bool canAssign) {
 	Token opToken = PreviousToken();
 	TokenType op = opToken.type;
 	ValueType lhs = m_Parser.currentExpression;
+	std::optional<ConstantExpression> lhsConstant = currentConstant();
 
 	// Compile the right operand
 	const ParseRule* rule = getRule(op);
 	parsePrecedence(static_cast<ParsePrecedence>(static_cast<int>(rule->precedence) + 1));
 
 	ValueType rhs = m_Parser.currentExpression;
+	std::optional<ConstantExpression> rhsConstant = currentConstant();
 
 	switch (op) {
 	case TokenType::EqualEqual:
-		emitByte(OpCode::Equal);
+		emitBinaryOp(OpCode::Equal, lhs, rhs);
 		m_Parser.currentExpression = ValueType::Bool;
 		break;
 	case TokenType::BangEqual:
-		emitByte(OpCode::NotEqual);
+		emitBinaryOp(OpCode::NotEqual, lhs, rhs);
 		m_Parser.currentExpression = ValueType::Bool;
 		break;
 	case TokenType::Greater:
@@ -152,7 +199,7 @@ void Compiler::binary(bool canAssign) {
 			errorAt(opToken, "Invalid operands. Expected numbers, found" + ValueTypeToString(lhs) + ", and " + ValueTypeToString(rhs) + ".");
 			break;
 		}
-		emitByte(OpCode::Greater);
+		emitBinaryOp(OpCode::Greater, lhs, rhs);
 		m_Parser.currentExpression = ValueType::Bool;
 		break;
 	case TokenType::GreaterEqual:
@@ -160,7 +207,7 @@ void Compiler::binary(bool canAssign) {
 			errorAt(opToken, "Invalid operands. Expected numbers, found" + ValueTypeToString(lhs) + ", and " + ValueTypeToString(rhs) + ".");
 			break;
 		}
-		emitByte(OpCode::GreaterEqual);
+		emitBinaryOp(OpCode::GreaterEqual, lhs, rhs);
 		m_Parser.currentExpression = ValueType::Bool;
 		break;
 	case TokenType::Less:
@@ -168,7 +215,7 @@ void Compiler::binary(bool canAssign) {
 			errorAt(opToken, "Invalid operands. Expected two numbers, found " + ValueTypeToString(lhs) + ", and " + ValueTypeToString(rhs) + ".");
 			break;
 		}
-		emitByte(OpCode::Less);
+		emitBinaryOp(OpCode::Less, lhs, rhs);
 		m_Parser.currentExpression = ValueType::Bool;
 		break;
 	case TokenType::LessEqual:
@@ -176,7 +223,7 @@ void Compiler::binary(bool canAssign) {
 			errorAt(opToken, "Invalid operands. Expected two numbers, found " + ValueTypeToString(lhs) + ", and " + ValueTypeToString(rhs) + ".");
 			break;
 		}
-		emitByte(OpCode::LessEqual);
+		emitBinaryOp(OpCode::LessEqual, lhs, rhs);
 		m_Parser.currentExpression = ValueType::Bool;
 		break;
 	case TokenType::Minus:
@@ -184,7 +231,7 @@ void Compiler::binary(bool canAssign) {
 			errorAt(opToken, "Invalid operands. Expected two numbers, found " + ValueTypeToString(lhs) + ", and " + ValueTypeToString(rhs) + ".");
 			break;
 		}
-		emitByte(OpCode::Subtract);
+		emitBinaryOp(OpCode::Subtract, lhs, rhs);
 		m_Parser.currentExpression = smallestTypeNeeded(lhs, rhs);
 		break;
 	case TokenType::Plus:
@@ -201,7 +248,7 @@ void Compiler::binary(bool canAssign) {
 			errorAt(opToken, "Invalid operands. Expected two numbers, found " + ValueTypeToString(lhs) + ", and " + ValueTypeToString(rhs) + ".");
 			break;
 		}
-		emitByte(OpCode::Add);
+		emitBinaryOp(OpCode::Add, lhs, rhs);
 		m_Parser.currentExpression = smallestTypeNeeded(lhs, rhs);
 		break;
 	case TokenType::Star:
@@ -209,7 +256,7 @@ void Compiler::binary(bool canAssign) {
 			errorAt(opToken, "Invalid operands. Expected two numbers, found " + ValueTypeToString(lhs) + ", and " + ValueTypeToString(rhs) + ".");
 			break;
 		}
-		emitByte(OpCode::Multiply);
+		emitBinaryOp(OpCode::Multiply, lhs, rhs);
 		m_Parser.currentExpression = smallestTypeNeeded(lhs, rhs);
 		break;
 	case TokenType::Slash:
@@ -217,12 +264,57 @@ void Compiler::binary(bool canAssign) {
 			errorAt(opToken, "Invalid operands. Expected two numbers, found " + ValueTypeToString(lhs) + ", and " + ValueTypeToString(rhs) + ".");
 			break;
 		}
-		emitByte(OpCode::Divide);
+		emitBinaryOp(OpCode::Divide, lhs, rhs);
 		m_Parser.currentExpression = smallestTypeNeeded(lhs, rhs);
 		break;
 	default:
 		return; // Unreachable
 	}
+
+	if (lhsConstant && rhsConstant && rhsConstant->codeStart == lhsConstant->codeEnd) {
+		foldBinary(op, *lhsConstant, *rhsConstant);
+	}
+}
+
+void Compiler::logical(bool canAssign) {
+	if (canAssign) canAssign = canAssign && true;
+	Token opToken = PreviousToken();
+	bool isAnd = opToken.type == TokenType::And;
+	ValueType lhs = m_Parser.currentExpression;
+	std::optional<ConstantExpression> lhsConstant = currentConstant();
+
+	// A constant left operand decides when compiling if the right operand runs. true && x and
+	// false || x are x, false && x and true || x never run x.
+	bool constant = lhs == ValueType::Bool && lhsConstant && lhsConstant->value.IsBoolean();
+	bool skipsRight = constant && lhsConstant->value.AsValue<bool>() != isAnd;
+	if (constant && !skipsRight) {
+		m_CompilingChunk->truncate(lhsConstant->codeStart, lhsConstant->constantCount);
+	}
+
+	// Otherwise the jump skips the right operand, leaving the left one as the result.
+	size_t jump = 0;
+	if (!constant) jump = emitJump(isAnd ? OpCode::JumpIfFalseOrPop : OpCode::JumpIfTrueOrPop);
+	size_t rightStart = m_CompilingChunk->codeSize();
+	size_t rightConstantCount = m_CompilingChunk->m_Constants.size();
+
+	// Compile the right operand
+	const ParseRule* rule = getRule(opToken.type);
+	parsePrecedence(static_cast<ParsePrecedence>(static_cast<int>(rule->precedence) + 1));
+	ValueType rhs = m_Parser.currentExpression;
+
+	if (lhs != ValueType::Bool || rhs != ValueType::Bool) {
+		errorAt(opToken, "Invalid operands. Expected two bools, found " + ValueTypeToString(lhs) + ", and " + ValueTypeToString(rhs) + ".");
+	}
+	m_Parser.currentExpression = ValueType::Bool;
+
+	if (!constant) {
+		patchJump(jump);
+		// The right operand isn't the whole expression, even when it's a constant.
+		m_Parser.lastConstant = std::nullopt;
+	} else if (skipsRight) {
+		m_CompilingChunk->truncate(rightStart, rightConstantCount);
+		m_Parser.lastConstant = lhsConstant;
+	}
 }
 
 void Compiler::grouping(bool canAssign) {
@@ -237,7 +329,7 @@ void Compiler::expression() {
 
 void Compiler::character(bool canAssign) {
 	if (canAssign) canAssign = canAssign && true;
-	std::string lexeme = PreviousToken().lexeme;
+	std::string_view lexeme = PreviousToken().lexeme;
 	char c = lexeme[1];
 	if (lexeme[1] == '\'') c = 0;
 	else if (lexeme[1] == '\\') {
@@ -261,7 +353,11 @@ void Compiler::character(bool canAssign) {
 void Compiler::integer(bool canAssign) {
 	if (canAssign) canAssign = canAssign && true;
 
-	int32_t numValue = std::stoi(PreviousToken().lexeme, nullptr);
+	std::string_view lexeme = PreviousToken().lexeme;
+	int32_t numValue = 0;
+	if (std::from_chars(lexeme.data(), lexeme.data() + lexeme.size(), numValue).ec != std::errc()) {
+		error("Integer literal is too large.");
+	}
 	Value value(FWD(numValue));
 	emitConstant(value);
 	m_Parser.currentExpression = ValueType::Int32;
@@ -270,7 +366,11 @@ void Compiler::integer(bool canAssign) {
 void Compiler::_float(bool canAssign) {
 	if (canAssign) canAssign = canAssign && true;
 
-	float numValue = std::stof(PreviousToken().lexeme);
+	std::string_view lexeme = PreviousToken().lexeme;
+	float numValue = 0.0f;
+	if (std::from_chars(lexeme.data(), lexeme.data() + lexeme.size(), numValue).ec != std::errc()) {
+		error("Float literal is out of range.");
+	}
 	Value value(FWD(numValue));
 	emitConstant(value);
 	m_Parser.currentExpression = ValueType::Float;
@@ -279,9 +379,8 @@ void Compiler::_float(bool canAssign) {
 void Compiler::string(bool canAssign) {
 	if (canAssign) canAssign = canAssign && true;
 
-	auto lexeme = PreviousToken().lexeme;
-	std::string valueString = lexeme.substr(1, lexeme.length() - 2);
-	Value value(FWD(valueString));
+	std::string_view lexeme = PreviousToken().lexeme;
+	Value value = internString(lexeme.substr(1, lexeme.length() - 2));
 	emitConstant(value);
 	m_Parser.currentExpression = ValueType::String;
 }
@@ -291,11 +390,11 @@ void Compiler::literals(bool canAssign) {
 
 	switch (PreviousToken().type) {
 	case TokenType::True:
-		emitByte(OpCode::TrueLiteral);
+		emitConstant(Value(true));
 		m_Parser.currentExpression = ValueType::Bool;
 		break;
 	case TokenType::False:
-		emitByte(OpCode::FalseLiteral);
+		emitConstant(Value(false));
 		m_Parser.currentExpression = ValueType::Bool;
 		break;
 	default:
@@ -332,15 +431,25 @@ void Compiler::varDeclaration() {
 
 	ValueType varType = m_Parser.currentExpression;
 
-	if (m_Variables.find(name.lexeme) != m_Variables.end()) {
-		error("Variable " + name.lexeme + " already declared.");
+	if (m_ScopeDepth > 0) {
+		localDeclaration(varType, name);
+		return;
+	}
+
+	if (m_Globals.find(name.lexeme) != m_Globals.end()) {
+		error("Variable " + std::string(name.lexeme) + " already declared.");
 		return;
 	}
 
-	m_Variables.insert({ name.lexeme, m_Parser.currentExpression });
+	// The key views the copy of the name kept in m_GlobalNames, the source doesn't outlive the compile.
+	m_GlobalNames.emplace_back(name.lexeme);
+	Global& global = m_Globals[m_GlobalNames.back()];
+	global.slot = m_GlobalNames.size() - 1;
+	global.type = varType;
 
 	if (match(TokenType::Equal)) {
-		AssignVar(varType, name);
+		// Variables declared with 'var' take the type of their initializer.
+		global.type = AssignVar(varType, name);
 		emitByte(OpCode::VarDeclarAndAssign);
 	} else {
 		if (varType == ValueType::Null) {
@@ -354,11 +463,44 @@ void Compiler::varDeclaration() {
 
 	m_Parser.currentExpression = ValueType::Invalid;
 
-	Value id(FWD(name.lexeme));
-	emitByte(makeConstant(id));
+	m_CompilingChunk->writeGlobalSlot(global.slot, PreviousToken().line);
+}
+
+void Compiler::localDeclaration(ValueType varType, Token& name) {
+	for (auto local = m_Locals.rbegin(); local != m_Locals.rend() && local->depth == m_ScopeDepth; ++local) {
+		if (local->name == name.lexeme) {
+			error("Variable " + std::string(name.lexeme) + " already declared in this scope.");
+			return;
+		}
+	}
+
+	if (m_Locals.size() >= UINT8_MAX) {
+		error("Too many local variables in scope.");
+		return;
+	}
+
+	size_t slot = m_Locals.size();
+	m_Locals.push_back({ name.lexeme, -1, varType });
+
+	if (match(TokenType::Equal)) {
+		// The initializer is already in the slot of the variable, nothing else has to be written.
+		varType = AssignVar(varType, name);
+	} else {
+		if (varType == ValueType::Null) {
+			errorAtCurrent("Variables declared with 'var' keyword must be assigned at declaration.");
+		}
+		emitBytes(static_cast<uint8_t>(OpCode::LocalDeclar), static_cast<uint8_t>(varType));
+	}
+
+	consume(TokenType::Semicolon, "Expected ';'.");
+
+	m_Parser.currentExpression = ValueType::Invalid;
+
+	m_Locals[slot].depth = m_ScopeDepth;
+	m_Locals[slot].type = varType;
 }
 
-void Compiler::AssignVar(ValueType varType, Token &name) {
+ValueType Compiler::AssignVar(ValueType varType, Token &name) {
 
 	parsePrecedence(ParsePrecedence::Assignment);
 
@@ -377,10 +519,13 @@ void Compiler::AssignVar(ValueType varType, Token &name) {
 		case ValueType::Double:
 			if (!IsNumber(expType)) {
 				errorAt(name, "Cannot assign " + ValueTypeToString(expType) + " to " + ValueTypeToString(varType) + ".");
+				break;
 			}
 			if (varType < expType) {
 				warningAt(name, "Possible loss of data in conversion of " + ValueTypeToString(expType) + " to " + ValueTypeToString(varType) + ".");
 			}
+			// Variables always hold a value of their own type, so typed opcodes can trust them.
+			emitConversion(expType, varType, 0);
 			break;
 		case ValueType::Char:
 			errorAt(name, "Cannot assign " + ValueTypeToString(expType) + " to char.");
@@ -393,34 +538,199 @@ void Compiler::AssignVar(ValueType varType, Token &name) {
 			break;
 		}
 	}
+
+	m_Parser.currentExpression = varType;
+	return varType;
 }
 
 void Compiler::variable(bool canAssign) {
 	Token nameTok = PreviousToken();
-	auto name = nameTok.lexeme;
-	if (m_Variables.find(name) == m_Variables.end()) {
-		errorAtCurrent("Unknown variable '" + name + "'.");
+	std::string_view name = nameTok.lexeme;
+	OpCode getOp = OpCode::Var;
+	OpCode setOp = OpCode::VarAssign;
+	size_t slot = 0;
+
+	int local = resolveLocal(name);
+	if (local >= 0) {
+		getOp = OpCode::GetLocal;
+		setOp = OpCode::SetLocal;
+		slot = static_cast<size_t>(local);
+		m_Parser.currentExpression = m_Locals[local].type;
 	} else {
-		m_Parser.currentExpression = (*m_Variables.find(name)).second;
+		auto global = m_Globals.find(name);
+		if (global == m_Globals.end()) {
+			errorAtCurrent("Unknown variable '" + std::string(name) + "'.");
+		} else {
+			m_Parser.currentExpression = global->second.type;
+			slot = global->second.slot;
+		}
 	}
 
 	if (canAssign && match(TokenType::Equal)) {
 		AssignVar(m_Parser.currentExpression, nameTok);
-		emitByte(OpCode::VarAssign);
+		emitByte(setOp);
 	} else {
-		emitByte(OpCode::Var);
+		emitByte(getOp);
 	}
 
-	Value stringVal(FWD(name));
-	emitByte(makeConstant(stringVal));
+	// Locals are one byte, globals are written like constant indices.
+	if (local >= 0) emitByte(static_cast<uint8_t>(slot));
+	else m_CompilingChunk->writeGlobalSlot(slot, PreviousToken().line);
 }
 
 void Compiler::statement() {
+	if (match(TokenType::If)) {
+		ifStatement();
+	} else if (match(TokenType::While)) {
+		whileStatement();
+	} else if (match(TokenType::For)) {
+		forStatement();
+	} else if (match(TokenType::LeftBrace)) {
+		beginScope();
+		block();
+		endScope();
+	} else {
+		expressionStatement();
+	}
+}
+
+void Compiler::expressionStatement() {
 	expression();
 	consume(TokenType::Semicolon, "Expected ';'.");
+	// The value of an expression statement isn't used.
+	emitByte(OpCode::Pop);
 	m_Parser.currentExpression = ValueType::Invalid;
 }
 
+void Compiler::ifStatement() {
+	consume(TokenType::LeftParen, "Expected '(' after 'if'.");
+	condition("if");
+	consume(TokenType::RightParen, "Expected ')' after condition.");
+
+	size_t thenJump = emitJump(OpCode::JumpIfFalse);
+	scopedBlock("Expected '{' after condition.");
+
+	if (match(TokenType::Else)) {
+		size_t elseJump = emitJump(OpCode::Jump);
+		patchJump(thenJump);
+
+		if (match(TokenType::If)) {
+			ifStatement();
+		} else {
+			scopedBlock("Expected '{' after 'else'.");
+		}
+		patchJump(elseJump);
+	} else {
+		patchJump(thenJump);
+	}
+}
+
+void Compiler::whileStatement() {
+	size_t loopStart = m_CompilingChunk->codeSize();
+	consume(TokenType::LeftParen, "Expected '(' after 'while'.");
+	condition("while");
+	consume(TokenType::RightParen, "Expected ')' after condition.");
+
+	size_t exitJump = emitJump(OpCode::JumpIfFalse);
+	scopedBlock("Expected '{' after condition.");
+	emitLoop(loopStart);
+
+	patchJump(exitJump);
+}
+
+void Compiler::forStatement() {
+	beginScope();
+	consume(TokenType::LeftParen, "Expected '(' after 'for'.");
+	if (match(TokenType::Semicolon)) {
+		// No initializer.
+	} else if (CurrentToken().type >= TokenType::DecInt8 && CurrentToken().type <= TokenType::Var) {
+		varDeclaration();
+	} else {
+		expressionStatement();
+	}
+
+	size_t loopStart = m_CompilingChunk->codeSize();
+	std::optional<size_t> exitJump;
+	if (!match(TokenType::Semicolon)) {
+		condition("for");
+		consume(TokenType::Semicolon, "Expected ';' after loop condition.");
+		exitJump = emitJump(OpCode::JumpIfFalse);
+	}
+
+	// The increment is written before the body, the body jumps back to it and it jumps back to
+	// the condition.
+	if (!match(TokenType::RightParen)) {
+		size_t bodyJump = emitJump(OpCode::Jump);
+		size_t incrementStart = m_CompilingChunk->codeSize();
+		expression();
+		emitByte(OpCode::Pop);
+		m_Parser.currentExpression = ValueType::Invalid;
+		consume(TokenType::RightParen, "Expected ')' after for clauses.");
+
+		emitLoop(loopStart);
+		loopStart = incrementStart;
+		patchJump(bodyJump);
+	}
+
+	scopedBlock("Expected '{' after for clauses.");
+	emitLoop(loopStart);
+
+	if (exitJump) patchJump(*exitJump);
+	endScope();
+}
+
+void Compiler::condition(const std::string& statement) {
+	expression();
+	if (m_Parser.currentExpression != ValueType::Bool) {
+		error("Condition of '" + statement + "' must be a bool, found " + ValueTypeToString(m_Parser.currentExpression) + ".");
+	}
+	m_Parser.currentExpression = ValueType::Invalid;
+}
+
+void Compiler::block() {
+	while (CurrentToken().type != TokenType::RightBrace && CurrentToken().type != TokenType::EoF) {
+		declaration();
+	}
+
+	consume(TokenType::RightBrace, "Expected '}' after block.");
+}
+
+void Compiler::scopedBlock(const std::string& message) {
+	consume(TokenType::LeftBrace, message);
+	beginScope();
+	block();
+	endScope();
+}
+
+void Compiler::endScope() {
+	m_ScopeDepth--;
+
+	size_t count = 0;
+	while (!m_Locals.empty() && m_Locals.back().depth > m_ScopeDepth) {
+		m_Locals.pop_back();
+		count++;
+	}
+
+	if (count == 1) {
+		emitByte(OpCode::Pop);
+	} else if (count > 1) {
+		emitBytes(static_cast<uint8_t>(OpCode::PopN), static_cast<uint8_t>(count));
+	}
+}
+
+int Compiler::resolveLocal(std::string_view name) {
+	for (int slot = static_cast<int>(m_Locals.size()) - 1; slot >= 0; slot--) {
+		if (m_Locals[slot].name == name) {
+			if (m_Locals[slot].depth == -1) {
+				error("Cannot read local variable in its own initializer.");
+			}
+			return slot;
+		}
+	}
+
+	return -1;
+}
+
 void Compiler::parsePrecedence(ParsePrecedence precedence) {
 	advance();
 	ParseFun prefix = getRule(PreviousToken().type)->prefixRule;
@@ -433,7 +743,7 @@ void Compiler::parsePrecedence(ParsePrecedence precedence) {
 
 	(*this.*prefix)(canAssign);
 
-	while (precedence < getRule(CurrentToken().type)->precedence) {
+	while (precedence <= getRule(CurrentToken().type)->precedence) {
 		advance();
 		ParseFun infix = getRule(PreviousToken().type)->infixRule;
 		(*this.*infix)(canAssign);
@@ -442,22 +752,165 @@ void Compiler::parsePrecedence(ParsePrecedence precedence) {
 }
 
 
-uint8_t Compiler::makeConstant(const Value& value) {
-	int constant = m_CompilingChunk->addConstant(value);
+void Compiler::emitBinaryOp(OpCode op, ValueType lhs, ValueType rhs) {
+	if (!IsNumber(lhs) || !IsNumber(rhs)) {
+		emitByte(op);
+		return;
+	}
+
+	ValueType type = smallestTypeNeeded(lhs, rhs);
+	OpCode typedOp = typedOpCode(op, type);
+
+	// Fall back on the generic operator when there is no typed one, or no way to widen an operand.
+	if (typedOp == op ||
+		(lhs != type && wideningOpCode(lhs, type) == OpCode::Return) ||
+		(rhs != type && wideningOpCode(rhs, type) == OpCode::Return)) {
+		emitByte(op);
+		return;
+	}
+
+	if (lhs != type) emitConversion(lhs, type, 1);
+	if (rhs != type) emitConversion(rhs, type, 0);
+	emitByte(typedOp);
+}
+
+void Compiler::emitConversion(ValueType from, ValueType to, uint8_t distance) {
+	if (from == to) return;
+
+	OpCode widening = wideningOpCode(from, to);
+	if (widening != OpCode::Return) {
+		emitBytes(static_cast<uint8_t>(widening), distance);
+	} else if (distance == 0) {
+		emitBytes(static_cast<uint8_t>(OpCode::Convert), static_cast<uint8_t>(to));
+	}
+}
+
+size_t Compiler::emitJump(OpCode op) {
+	emitByte(jumpOfWidth(op, true));
+	emitBytes(0xff, 0xff);
+	return m_CompilingChunk->codeSize() - 3;
+}
 
-	if (constant > UINT8_MAX) {
-		error("Too many constants in one chunk.");
-		return 0;
+void Compiler::patchJump(size_t jump) {
+	if (!m_CompilingChunk->patchJump(jump, m_CompilingChunk->codeSize())) {
+		error("Too much code to jump over.");
 	}
+}
+
+void Compiler::emitLoop(size_t loopStart) {
+	size_t loop = m_CompilingChunk->codeSize();
+	bool isLong = loop + 2 - loopStart > UINT8_MAX;
+
+	emitByte(isLong ? OpCode::LoopLong : OpCode::Loop);
+	emitByte(0);
+	if (isLong) emitByte(0);
 
-	return static_cast<uint8_t>(constant);
+	if (!m_CompilingChunk->patchJump(loop, loopStart)) {
+		error("Loop body too large.");
+	}
+}
+
+void Compiler::emitConstant(const Value& value) {
+	ConstantExpression constant{ value, m_CompilingChunk->codeSize(), 0, m_CompilingChunk->m_Constants.size() };
+
+	if (value.IsBoolean()) {
+		emitByte(value.AsValue<bool>() ? OpCode::TrueLiteral : OpCode::FalseLiteral);
+	} else {
+		emitByte(valueTypeToOpCode(value.Type()));
+		m_CompilingChunk->writeConstantIndex(makeConstant(value), PreviousToken().line);
+	}
+
+	constant.codeEnd = m_CompilingChunk->codeSize();
+	m_Parser.lastConstant = constant;
+}
+
+std::optional<Compiler::ConstantExpression> Compiler::currentConstant() const {
+	if (m_Parser.lastConstant && m_Parser.lastConstant->codeEnd == m_CompilingChunk->codeSize()) {
+		return m_Parser.lastConstant;
+	}
+	return std::nullopt;
+}
+
+void Compiler::foldBinary(TokenType op, const ConstantExpression& lhs, const ConstantExpression& rhs) {
+	const Value& a = lhs.value;
+	const Value& b = rhs.value;
+	bool numbers = a.IsNumber() && b.IsNumber();
+
+	// Type errors have already been reported by binary(), only valid operations are folded.
+	switch (op) {
+	case TokenType::EqualEqual: replaceWithConstant(lhs, Value(a == b)); break;
+	case TokenType::BangEqual: replaceWithConstant(lhs, Value(a != b)); break;
+	case TokenType::Greater: if (numbers) replaceWithConstant(lhs, Value(a > b)); break;
+	case TokenType::GreaterEqual: if (numbers) replaceWithConstant(lhs, Value(a >= b)); break;
+	case TokenType::Less: if (numbers) replaceWithConstant(lhs, Value(a < b)); break;
+	case TokenType::LessEqual: if (numbers) replaceWithConstant(lhs, Value(a <= b)); break;
+	case TokenType::Minus: if (numbers) replaceWithConstant(lhs, a - b); break;
+	case TokenType::Star: if (numbers) replaceWithConstant(lhs, a * b); break;
+	case TokenType::Slash:
+		// Leave integer divisions that fail to the VM, which reports them.
+		if (numbers && !divisionError(a, b)) replaceWithConstant(lhs, a / b);
+		break;
+	case TokenType::Plus:
+		if (a.IsString() && b.IsString()) {
+			replaceWithConstant(lhs, internString(a.AsValue<std::string>() + b.AsValue<std::string>()));
+		} else if (numbers) {
+			replaceWithConstant(lhs, a + b);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void Compiler::foldUnary(TokenType op, const ConstantExpression& operand) {
+	switch (op) {
+	case TokenType::Bang: replaceWithConstant(operand, Value(!operand.value)); break;
+	case TokenType::Minus: if (operand.value.IsNumber()) replaceWithConstant(operand, -operand.value); break;
+	default: break;
+	}
+}
+
+void Compiler::replaceWithConstant(const ConstantExpression& first, const Value& value) {
+	if (!value.IsBoolean() && valueTypeToOpCode(value.Type()) == OpCode::Return) return;
+
+	m_CompilingChunk->truncate(first.codeStart, first.constantCount);
+	emitConstant(value);
 }
 
 void Compiler::endCompiler() {
 	emitReturn();
+
+	// The line table stores offsets in 32 bits.
+	if (m_CompilingChunk->codeSize() > UINT32_MAX) error("Too much code in one chunk.");
+
+	m_RemovedInstructions = 0;
+	if (m_Optimize && !m_Parser.hadError) {
+		m_RemovedInstructions = m_CompilingChunk->optimize();
+		m_RemovedInstructions += m_CompilingChunk->threadJumps();
+	}
+
+	if (m_Target == CompileTarget::Registers && !m_Parser.hadError) {
+		m_CompilingChunk->translateToRegisters();
+	}
+
+	// The register bytecode refers to offsets of the stack bytecode, it is left as it is.
+	m_FusedInstructions = 0;
+	if (m_Superinstructions && !m_Parser.hadError && !m_CompilingChunk->m_RegisterCode) {
+		m_FusedInstructions = m_CompilingChunk->selectSuperinstructions();
+	}
+
 #ifdef DEBUG_PRINT_CODE
 	if (!m_Parser.hadError) {
 		Debugger::DisassembleChunk(m_CompilingChunk.get(), "Code");
+		if (m_RemovedInstructions) {
+			std::cout << "Peephole optimizer removed " << m_RemovedInstructions << " instructions." << std::endl;
+		}
+		if (m_FusedInstructions) {
+			std::cout << "Superinstructions saved " << m_FusedInstructions << " instructions." << std::endl;
+		}
+		if (m_CompilingChunk->m_RegisterCode) {
+			Debugger::DisassembleRegisterCode(m_CompilingChunk.get(), "Register code");
+		}
 	}
 #endif // DEBUG_PRINT_CODE
 
@@ -495,7 +948,25 @@ void Compiler::errorAt(Token token, const std::string& message) {
 	m_Parser.hadError = true;
 }
 
+void Compiler::Parser::StartParser(const TokenList& list) {
+	scanner = nullptr;
+	tokenList = &list;
+	nextListToken = 0;
+	startTokens();
+}
+
 void Compiler::Parser::StartParser(Scanner& scanner) {
-	tokensToBeParsed = scanner.ScanAllTokens();
-	currentToken = tokensToBeParsed.begin();
+	this->scanner = &scanner;
+	tokenList = nullptr;
+	startTokens();
+}
+
+void Compiler::Parser::startTokens() {
+	// The tokens before the first one are placeholders, as if the source started at an EoF.
+	tokens.fill(Token());
+	currentToken = TOKEN_WINDOW;
+	tokens[currentToken % TOKEN_WINDOW] = pull();
+	hadError = false;
+	panicMode = false;
+	lastConstant.reset();
 }
@@ -2,9 +2,13 @@
 //! \brief Details the Compiler and ParseRules of the program.
 #pragma once
 
+#include <algorithm>
 #include <string>
 #include <memory>
 #include <array>
+#include <cassert>
+#include <deque>
+#include <optional>
 #include <unordered_map>
 
 #include "Chunk.h"
@@ -12,6 +16,9 @@
 
 
 
+//! Number of tokens the Compiler keeps: the current token and the ones right before it.
+#define TOKEN_WINDOW 4
+
 //! Precedence of order of operations.
 enum class ParsePrecedence {
 	None,
@@ -24,6 +31,12 @@ enum class ParsePrecedence {
 	Primary,
 };
 
+//! Bytecode the Compiler generates.
+enum class CompileTarget {
+	Stack, //!< Stack bytecode, operators pop their operands and push their result.
+	Registers, //!< Register bytecode, three-address instructions translated from the stack bytecode.
+};
+
 //! Converts text to byte code.
 /*!
   The compiler is takes the source code and hands it off to the Scanner to be tokenized. As
@@ -34,22 +47,58 @@ enum class ParsePrecedence {
 class Compiler {
 private:
 	
+	//! A constant the Compiler just wrote, that can still be folded into the expression using it.
+	struct ConstantExpression {
+		Value value; //!< Value of the constant.
+		size_t codeStart; //!< Offset in the Chunk where the code loading the constant begins.
+		size_t codeEnd; //!< Offset in the Chunk right after the code loading the constant.
+		size_t constantCount; //!< Size of the Chunk's constant array before the constant was added.
+	};
+
 	//! Utility struct to keep track of tokens generated by the Scanner.
+	/*!
+	  Tokens are pulled from the Scanner one at a time as the parser advances, and only the last
+	  TOKEN_WINDOW of them are kept in a ring buffer. The memory used for tokens doesn't depend on
+	  the size of the source. Tokens can also be pulled from a TokenList scanned beforehand.
+	*/
 	struct Parser {
-		std::vector<Token> tokensToBeParsed; //!< A list of all tokens that are currently being parsed.
-		std::vector<Token>::iterator currentToken; //!< An iterator to the current token.
+		Scanner* scanner = nullptr; //!< The Scanner tokens are pulled from, nullptr when they come from tokenList.
+		const TokenList* tokenList = nullptr; //!< The list tokens are pulled from, nullptr when they come from scanner.
+		size_t nextListToken = 0; //!< Index in tokenList of the next token to pull.
+		std::array<Token, TOKEN_WINDOW> tokens; //!< Ring buffer of the last tokens pulled, the current one included.
+		size_t currentToken = 0; //!< Number of tokens pulled before the current one. tokens[currentToken % TOKEN_WINDOW] is the current token.
 		ValueType currentExpression; //!< The type of value of current expression. Used for type-checking.
 		bool hadError = false; //!< If the compiler has found a error.
 		bool panicMode = false; //!< If the compiler is currently sorting out an error.
+		std::optional<ConstantExpression> lastConstant; //!< The last constant written, used for constant folding.
+
+		void StartParser(Scanner& scanner); //!< Pulls the first token from the scanner.
+		void StartParser(const TokenList& list); //!< Pulls the first token from a list ending with an EoF.
+		void startTokens(); //!< Resets the parser and pulls the first token, once its source is set.
+
+		//! Pulls the next token, and makes it the current token.
+		void NextToken() { currentToken++; tokens[currentToken % TOKEN_WINDOW] = pull(); }
 
-		void StartParser(Scanner& scanner); //!< Get all tokens from the scanner.
+		//! \return The next token of the scanner or of the list. The list keeps giving its EoF once it ran out.
+		Token pull() {
+			if (!tokenList) return scanner->ScanToken();
+			return tokenList->At(std::min(nextListToken++, tokenList->Size() - 1));
+		}
+
+		//! \return The token distance tokens before the current one.
+		const Token& TokenAt(size_t distance) const {
+			assert(distance < TOKEN_WINDOW);
+			return tokens[(currentToken - distance) % TOKEN_WINDOW];
+		}
 	};
 
 
 	std::unique_ptr<Scanner> m_Scanner; //!< \brief Scans the text in order to tokenize it.
+	std::unique_ptr<TokenList> m_Tokens; //!< \brief Tokens of the text, while it is compiled from a parallel scan.
 	Parser m_Parser; //!< \brief Contains the current token to parse, and the previous token, as well as info on whether an error has occured.
 
 	std::shared_ptr<Chunk> m_CompilingChunk; //!< \brief A Chunk shared with by the VM that is currently being written to.
+	StringTable* m_Strings = nullptr; //!< \brief The VM's intern table, string constants and identifiers are interned in it.
 
 	//! Function pointer for Parsing functions, which are used for ParseRule
 	typedef void(Compiler::*ParseFun)(bool canAssign);
@@ -74,7 +123,32 @@ private:
 
 	static const std::array<ParseRule, Token::NUMBER_OF_TOKENS> m_Rules; //!< Rules for parsing each individual token.
 
-	std::unordered_map<std::string, ValueType> m_Variables; //!< A hash map containing the Value and their ValueType for type-checking.
+	//! A global variable, resolved by the Compiler to a slot in the VM's array of globals.
+	struct Global {
+		size_t slot; //!< Index of the variable in the VM's array of globals.
+		ValueType type; //!< Type of the variable, for type-checking.
+	};
+
+	std::unordered_map<std::string_view, Global> m_Globals; //!< Global variables declared so far, by name. The names view m_GlobalNames.
+	std::deque<std::string> m_GlobalNames; //!< Names of the globals by slot. A deque, so the views in m_Globals stay valid as it grows.
+	size_t m_GlobalsVersion = 0; //!< Changes whenever globals are removed, see GlobalsVersion().
+
+	//! A local variable, living in a stack slot while the block declaring it runs.
+	struct Local {
+		std::string_view name; //!< Name of the variable, a view of the source being compiled.
+		int depth; //!< Scope depth of the block declaring it, -1 while its initializer is compiled.
+		ValueType type; //!< Type of the variable, for type-checking.
+	};
+
+	std::vector<Local> m_Locals; //!< Locals in scope, in the order of their stack slots.
+	int m_ScopeDepth = 0; //!< Number of blocks around the code being compiled. Variables declared at depth 0 are globals.
+
+	CompileTarget m_Target = CompileTarget::Stack; //!< Bytecode to generate.
+	bool m_Optimize = true; //!< If the peephole optimizer runs over the compiled code, see Chunk::optimize() and Chunk::threadJumps().
+	bool m_Superinstructions = true; //!< If superinstructions are selected in the compiled code, see Chunk::selectSuperinstructions().
+	bool m_ParallelScan = false; //!< If sources are scanned on several threads before they are parsed, see SetParallelScan().
+	size_t m_RemovedInstructions = 0; //!< Instructions the peephole optimizer removed from the last chunk compiled.
+	size_t m_FusedInstructions = 0; //!< Instructions replaced by superinstructions in the last chunk compiled, less the superinstructions.
 
 public:
 
@@ -83,27 +157,96 @@ public:
 
 	//! Compiles text into bytecode.
 	/*!
-	  \param source A text string to be compiled.
+	  \param source A text string to be compiled. Tokens refer to it, so it isn't copied.
 	  \param [out] chunk A chunk that is shared by the VM to write bytecode to.
+	  \param strings Intern table of the VM the chunk will run in.
 	  \return True if source successfuly compiled, false if error occurred.
 	*/
-	bool Compile(const std::string& source, std::shared_ptr<Chunk> chunk);
+	bool Compile(std::string_view source, std::shared_ptr<Chunk> chunk, StringTable& strings);
+
+	//! Sets the bytecode to generate.
+	/*!
+	  With CompileTarget::Registers, the stack bytecode is translated to register bytecode once it
+	  is complete. Code the register bytecode can't express is left as stack bytecode.
+	  \param target Bytecode to generate.
+	*/
+	void SetTarget(CompileTarget target) { m_Target = target; }
+
+	//! \return The bytecode generated.
+	CompileTarget Target() const { return m_Target; }
+
+	//! Turns the peephole optimizer on or off, to compare the code it generates with the code it doesn't.
+	/*!
+	  \param optimize If Chunk::optimize() runs over the compiled code. On by default.
+	*/
+	void SetOptimize(bool optimize) { m_Optimize = optimize; }
+
+	//! \return Number of instructions the peephole optimizer removed from the last chunk compiled.
+	size_t RemovedInstructions() const { return m_RemovedInstructions; }
+
+	//! Turns the selection of superinstructions on or off, to compare the code it generates with the code it doesn't.
+	/*!
+	  \param superinstructions If Chunk::selectSuperinstructions() runs over the compiled code. On by default.
+	*/
+	void SetSuperinstructions(bool superinstructions) { m_Superinstructions = superinstructions; }
+
+	//! \return Number of instructions superinstructions saved in the last chunk compiled.
+	size_t FusedInstructions() const { return m_FusedInstructions; }
+
+	//! Turns the parallel scan of the sources compiled on or off.
+	/*!
+	  When on, Compile() scans the whole source with Scanner::ScanAllTokensParallel() before
+	  parsing it, instead of pulling tokens from a Scanner as it goes. Large sources scan faster,
+	  but every token is kept until the compile ends. Off by default.
+	  \param parallelScan If sources are scanned on several threads.
+	*/
+	void SetParallelScan(bool parallelScan) { m_ParallelScan = parallelScan; }
+
+	//!@{ \name Globals
+
+	//! \return Number of global variables declared so far. The VM needs as many slots.
+	size_t GlobalCount() const { return m_GlobalNames.size(); }
+
+	//! \return Name of the global variable in a slot, for error messages.
+	const std::string& GlobalName(size_t slot) const { return m_GlobalNames[slot]; }
+
+	//! \return Type of the global variable in a slot.
+	ValueType GlobalType(size_t slot) const { return m_Globals.at(m_GlobalNames[slot]).type; }
+
+	//! Declares a global variable of code that wasn't compiled by this Compiler, such as a bytecode file.
+	/*!
+	  \param name Name of the variable.
+	  \param type Type of the variable.
+	  \return The slot of the variable, the next free one, or -1 if the name is taken or there is no slot left.
+	*/
+	int DeclareGlobal(std::string_view name, ValueType type);
+
+	//! A version of the globals code is compiled against.
+	/*!
+	  Code compiled for one version compiles the same for as long as the version doesn't change.
+	  Declaring a global doesn't change it: code that compiled without the global never refers
+	  to it, and a global keeps its slot and type. Removing globals does.
+	  \return The current version.
+	*/
+	size_t GlobalsVersion() const { return m_GlobalsVersion; }
+	//!@}
 
 
 	//!@{ \name Token Getters
 
 	//! Current Token
-	const Token& CurrentToken() const { return *m_Parser.currentToken; }
+	const Token& CurrentToken() const { return m_Parser.TokenAt(0); }
 	//! Previous Token
-	const Token& PreviousToken() const { return *(m_Parser.currentToken - 1); }
+	const Token& PreviousToken() const { return m_Parser.TokenAt(1); }
 
 	//! Gets token from specified location.
 	/*!
 	  Retrieves the token a set distance back from current one being parsed.
 	  \param distance How many tokens before the current one. 0 = current token, 1 = previous token.
+	  Must be less than TOKEN_WINDOW.
 	  \return Token
 	*/
-	const Token& TokenAt(size_t distance) const { return *(m_Parser.currentToken - distance); }
+	const Token& TokenAt(size_t distance) const { return m_Parser.TokenAt(distance); }
 	//!@}
 
 private:
@@ -131,9 +274,6 @@ private:
 	void consume(TokenType expectedToken, const std::string& message);
 	//!@}
 
-	//! Add a token to the parser.
-	void addToken(const Token& token) { m_Parser.tokensToBeParsed.push_back(token); }
-
 	//!@{ \name ParseFun
 	//! A set of functions to be given to ParseRule as its ParseFun members.
 
@@ -141,6 +281,8 @@ private:
 	void unary(bool canAssign);
 	//! Function for parsing binary operators.
 	void binary(bool canAssign);
+	//! Function for parsing && and ||, the right operand only runs if the left one doesn't decide the result.
+	void logical(bool canAssign);
 	//! Function for parsing parentheses.
 	void grouping(bool canAssign);
 	//! Function for parsing a character token.
@@ -167,10 +309,60 @@ private:
 	void declaration();
 	//! Function for variable declaration.
 	void varDeclaration();
+	//! Function for declaring a local variable in the current block.
+	/*!
+	  The initializer is left on the stack, in the slot of the variable.
+	  \param varType Declared type of the variable, or ValueType::Null for 'var'.
+	  \param name Token of the variable name.
+	*/
+	void localDeclaration(ValueType varType, Token& name);
 	//! Function to assign a variable.
-	void AssignVar(ValueType varType, Token &name);
+	/*!
+	  Parses the assigned expression and converts it to the type of the variable.
+	  \param varType Type of the variable, or ValueType::Null for variables declared with 'var'.
+	  \param name Token of the variable name, used for errors.
+	  \return Type of the variable, the type of the expression for variables declared with 'var'.
+	*/
+	ValueType AssignVar(ValueType varType, Token &name);
 	//! Function for parsing statements.
 	void statement();
+	//! Function for parsing an expression whose value isn't used.
+	void expressionStatement();
+	//! Function for parsing an if statement, with an optional else.
+	void ifStatement();
+	//! Function for parsing a while loop.
+	void whileStatement();
+	//! Function for parsing a for loop. Variables declared by its initializer are scoped to the loop.
+	void forStatement();
+	//! Function for parsing the condition of a statement.
+	/*!
+	  Conditions are never converted, they have to be bools.
+	  \param statement Name of the statement, for errors.
+	*/
+	void condition(const std::string& statement);
+	//! Function for parsing the declarations of a block, up to its closing brace.
+	void block();
+	//! Function for parsing a block in a scope of its own, the body of a statement.
+	/*!
+	  \param message Message of the error if the block doesn't start with a brace.
+	*/
+	void scopedBlock(const std::string& message);
+	//!@}
+
+	//!@{ \name Scopes
+
+	//! Enters a block.
+	void beginScope() { m_ScopeDepth++; }
+
+	//! Leaves a block, popping all of its locals at once.
+	void endScope();
+
+	//! Finds a local variable by name.
+	/*!
+	  \param name Name of the variable.
+	  \return Stack slot of the innermost local with that name, or -1 if there is none.
+	*/
+	int resolveLocal(std::string_view name);
 	//!@}
 
 
@@ -213,21 +405,102 @@ private:
 
 	//! Writes a constant value into the current chunk
 	/*!
+	  The constant is remembered in m_Parser.lastConstant, so an operator applied to it can be
+	  folded at compile time.
 	  \param value The value to be written to the Chunk
 	*/
-	void emitConstant(const Value& value) { emitByte(valueTypeToOpCode(value.Type())); emitByte(makeConstant(value)); }
+	void emitConstant(const Value& value);
+
+	//! Gets the constant the current expression consists of.
+	/*!
+	  \return The last constant written, if nothing has been written after it.
+	*/
+	std::optional<ConstantExpression> currentConstant() const;
+
+	//! Folds a binary operator applied to two constants.
+	/*!
+	  Evaluates the operator with the same rules the VM uses, then replaces the code of both
+	  operands and the operator with a single constant. Nothing is folded if the result has no
+	  literal opcode, or if evaluating it would fail (integer division by zero, or overflowing).
+	  \param op Operator token.
+	  \param lhs The left operand.
+	  \param rhs The right operand, written right after the left one.
+	*/
+	void foldBinary(TokenType op, const ConstantExpression& lhs, const ConstantExpression& rhs);
+
+	//! Folds a unary operator applied to a constant.
+	/*!
+	  \param op Operator token.
+	  \param operand The operand.
+	*/
+	void foldUnary(TokenType op, const ConstantExpression& operand);
+
+	//! Replaces the code written since a constant with another constant.
+	/*!
+	  \param first The first constant of the folded expression.
+	  \param value Value of the folded expression.
+	*/
+	void replaceWithConstant(const ConstantExpression& first, const Value& value);
+
+	//! Writes a binary operator, specialized for its operand types when possible.
+	/*!
+	  When both operands are numbers, the operator is replaced by its typed version for
+	  smallestTypeNeeded(lhs, rhs), and the narrower operand is widened first.
+	  \param op The generic operator, from OpCode::Equal to OpCode::Divide.
+	  \param lhs Type of the left operand.
+	  \param rhs Type of the right operand.
+	*/
+	void emitBinaryOp(OpCode op, ValueType lhs, ValueType rhs);
+
+	//! Writes the conversion of a number to another type.
+	/*!
+	  \param from Type of the value to convert.
+	  \param to Type to convert it to.
+	  \param distance Distance of the value from the top of the stack. Only widening conversions
+	  can reach below the top of the stack.
+	*/
+	void emitConversion(ValueType from, ValueType to, uint8_t distance);
+
+	//! Writes a forward jump whose target isn't known yet.
+	/*!
+	  The jump is written long, and pointed at its target with patchJump(). When the peephole
+	  optimizer runs, Chunk::threadJumps() shortens the jumps that don't need two bytes.
+	  \param op The short or long version of the jump.
+	  \return Offset of the jump, for patchJump().
+	*/
+	size_t emitJump(OpCode op);
+
+	//! Points a jump written by emitJump() at the code written next.
+	/*!
+	  \param jump Offset of the jump.
+	*/
+	void patchJump(size_t jump);
+
+	//! Writes a jump back to the start of a loop.
+	/*!
+	  The distance is already known, so the jump is short when it fits.
+	  \param loopStart Offset of the first instruction of the loop.
+	*/
+	void emitLoop(size_t loopStart);
 
 	//! Writes the "Return" opcode into the Chunk.
 	void emitReturn() { emitByte(static_cast<uint8_t>(OpCode::Return)); }
 	
 	//! Adds a value into the compiling Chunk's constants array
 	/*! A utility function to append a \a Value into the current Chunk
-	    and retrieve the location of said value. If the current Chunk has
-		the max amount of constants already, this will trigger an error.
+	    and retrieve the location of said value.
+	  An identical constant already in the Chunk is reused instead.
 	  \param value The value to place into the Chunk.
 	  \return The index of the value in the current Chunk's constant array.
 	*/
-	uint8_t makeConstant(const Value& value);
+	size_t makeConstant(const Value& value) { return m_CompilingChunk->addConstant(value); }
+
+	//! Interns a string and wraps it in a Value.
+	/*!
+	  \param chars Characters of the string.
+	  \return A string Value referring to the interned string.
+	*/
+	Value internString(std::string_view chars) { return Value(m_Strings->Intern(chars)); }
 
 	//! Gets the compiler ready to end.
 	void endCompiler();
@@ -1,14 +1,16 @@
 #include "stdafx.h"
 #include "Debug.h"
 
+#include <algorithm>
 #include <iomanip>
+#include <vector>
 
 #include "Chunk.h"
 
 void Debugger::DisassembleChunk(Chunk* chunk, const char* name) {
 	std::cout << "= " << name << " =" << std::endl;
 
-	for (int i = 0; i < chunk->m_Code.size();) {
+	for (size_t i = 0; i < chunk->codeSize();) {
 		i = DisassembleInstruction(chunk, i);
 	}
 }
@@ -16,57 +18,259 @@ void Debugger::DisassembleChunk(Chunk* chunk, const char* name) {
 int Debugger::DisassembleInstruction(Chunk* chunk, int offset) {
 	std::cout << std::setw(4) << offset << " ";
 
-	if (offset > 0 && chunk->m_Lines[offset - 1] == chunk->m_Lines[offset]) {
+	int line = chunk->getLine(offset);
+	if (offset > 0 && chunk->getLine(offset - 1) == line) {
 		std::cout << "   | ";
 	} else {
-		std::cout << std::setw(4) << chunk->m_Lines[offset] << " ";
+		std::cout << std::setw(4) << line << " ";
 	}
 
-	byte instruction = chunk->m_Code[offset];
-	switch (static_cast<OpCode>(instruction)) {
-	case OpCode::IntLiteral: return ConstantInstruction("OP Int", chunk, offset);
-	case OpCode::FloatLiteral: return ConstantInstruction("OP Float", chunk, offset);
-	case OpCode::CharLiteral: return ConstantInstruction("OP Char", chunk, offset);
-	case OpCode::StringLiteral: return ConstantInstruction("Op String", chunk, offset);
-	case OpCode::TrueLiteral: return SimpleInstruction("OP True", offset);
-	case OpCode::FalseLiteral: return SimpleInstruction("OP False", offset);
-	case OpCode::VarDeclar: return DeclarationInstruction("Var declaration", chunk, offset);
-	case OpCode::VarAssign: return ConstantInstruction("Assign var", chunk, offset);
-	case OpCode::VarDeclarAndAssign: return ConstantInstruction("Var declaration", chunk, offset);
-	case OpCode::Var: return ConstantInstruction("Var", chunk, offset);
-	case OpCode::Equal: return SimpleInstruction("OP Equal", offset);
-	case OpCode::NotEqual: return SimpleInstruction("OP Not Equal", offset);
-	case OpCode::Greater: return SimpleInstruction("OP Greater", offset);
-	case OpCode::GreaterEqual: return SimpleInstruction("OP Greater Equal", offset);
-	case OpCode::Less: return SimpleInstruction("OP Less", offset);
-	case OpCode::LessEqual: return SimpleInstruction("OP Less Equal", offset);
-	case OpCode::Add: return SimpleInstruction("OP Add", offset);
-	case OpCode::Subtract: return SimpleInstruction("OP Subtract", offset);
-	case OpCode::Multiply: return SimpleInstruction("OP Multiply", offset);
-	case OpCode::Divide: return SimpleInstruction("OP Divide", offset);
-	case OpCode::Concatenate: return SimpleInstruction("Op Concatenate", offset);
-	case OpCode::Not: return SimpleInstruction("OP Not", offset);
-	case OpCode::Negate: return SimpleInstruction("OP Negate", offset);
-	case OpCode::Null: return SimpleInstruction("OP Null", offset);
-	case OpCode::Return: return SimpleInstruction("OP Return", offset);
+	byte instruction = chunk->getStart()[offset];
+	OpCode op = static_cast<OpCode>(instruction);
+	switch (op) {
+	case OpCode::IntLiteral:
+	case OpCode::FloatLiteral:
+	case OpCode::CharLiteral:
+	case OpCode::StringLiteral:
+		return ConstantInstruction(OpCodeName(op), chunk, offset);
+	case OpCode::VarDeclar: return DeclarationInstruction(OpCodeName(op), chunk, offset);
+	case OpCode::VarAssign:
+	case OpCode::VarDeclarAndAssign:
+	case OpCode::Var:
+		return GlobalInstruction(OpCodeName(op), chunk, offset);
+	case OpCode::GetLocal:
+	case OpCode::SetLocal:
+	case OpCode::PopN:
+	case OpCode::I32ToI64:
+	case OpCode::I32ToF32:
+	case OpCode::I32ToF64:
+	case OpCode::I64ToF32:
+	case OpCode::I64ToF64:
+	case OpCode::F32ToF64:
+		return ByteInstruction(OpCodeName(op), chunk, offset);
+	case OpCode::Convert:
+	case OpCode::LocalDeclar:
+		return TypeInstruction(OpCodeName(op), chunk, offset);
 	default:
-		std::cout << "Unkown opcode " << instruction << std::endl;
-		return offset + 1;
+		if (op > OpCode::Return) {
+			std::cout << "Unkown opcode " << instruction << std::endl;
+			return offset + 1;
+		}
+		if (superinstructionLoads(op) != OpCode::Return) return Superinstruction(OpCodeName(op), chunk, offset);
+		if (isJump(op)) return JumpInstruction(OpCodeName(op), chunk, offset);
+		return SimpleInstruction(OpCodeName(op), offset);
+	}
+}
+
+void Debugger::DisassembleRegisterCode(Chunk* chunk, const char* name) {
+	std::cout << "= " << name << " =" << std::endl;
+
+	for (size_t i = 0; i < chunk->m_RegisterCode->code.size(); i++) {
+		DisassembleRegisterInstruction(chunk, i);
+	}
+}
+
+void Debugger::DisassembleRegisterInstruction(Chunk* chunk, int index) {
+	const RegisterCode& registers = *chunk->m_RegisterCode;
+	const RegisterInstruction& instruction = registers.code[index];
+
+	// Registers are printed as r0, r1..., constants as their value.
+	auto operand = [&registers](uint16_t operand) {
+		if (operand < registers.registerCount) return "r" + std::to_string(operand);
+		return "| " + registers.frame[operand].ToString() + " |";
+	};
+
+	std::cout << std::setw(4) << index << " ";
+	std::cout << std::setw(4) << chunk->getLine(registers.origins[index]) << " ";
+	std::cout << std::left << std::setw(20) << OpCodeName(instruction.op) << std::right;
+
+	switch (instruction.op) {
+	case OpCode::VarDeclar:
+		std::cout << "global " << instruction.a << " " << ValueTypeToString(static_cast<ValueType>(instruction.type));
+		break;
+	case OpCode::VarAssign:
+	case OpCode::VarDeclarAndAssign:
+		std::cout << "global " << instruction.a << " " << operand(instruction.b);
+		break;
+	case OpCode::Var:
+		std::cout << operand(instruction.a) << " global " << instruction.b;
+		break;
+	case OpCode::GetLocal:
+	case OpCode::SetLocal:
+	case OpCode::Not:
+	case OpCode::Negate:
+		std::cout << operand(instruction.a) << " " << operand(instruction.b);
+		break;
+	case OpCode::LocalDeclar:
+	case OpCode::Convert:
+		std::cout << operand(instruction.a) << " " << ValueTypeToString(static_cast<ValueType>(instruction.type));
+		break;
+	case OpCode::Return:
+		break;
+	default:
+		if (instruction.op >= OpCode::I32ToI64 && instruction.op <= OpCode::F32ToF64) {
+			std::cout << operand(instruction.a);
+		} else {
+			std::cout << operand(instruction.a) << " " << operand(instruction.b) << " " << operand(instruction.c);
+		}
+		break;
+	}
+
+	std::cout << std::endl;
+}
+
+const char* Debugger::OpCodeName(OpCode op) {
+	switch (op) {
+	case OpCode::IntLiteral: return "OP Int";
+	case OpCode::FloatLiteral: return "OP Float";
+	case OpCode::CharLiteral: return "OP Char";
+	case OpCode::StringLiteral: return "Op String";
+	case OpCode::TrueLiteral: return "OP True";
+	case OpCode::FalseLiteral: return "OP False";
+	case OpCode::VarDeclar: return "Var declaration";
+	case OpCode::VarAssign: return "Assign var";
+	case OpCode::VarDeclarAndAssign: return "Var declaration";
+	case OpCode::Var: return "Var";
+	case OpCode::LocalDeclar: return "Local declaration";
+	case OpCode::GetLocal: return "Get local";
+	case OpCode::SetLocal: return "Set local";
+	case OpCode::Equal: return "OP Equal";
+	case OpCode::NotEqual: return "OP Not Equal";
+	case OpCode::Greater: return "OP Greater";
+	case OpCode::GreaterEqual: return "OP Greater Equal";
+	case OpCode::Less: return "OP Less";
+	case OpCode::LessEqual: return "OP Less Equal";
+	case OpCode::Add: return "OP Add";
+	case OpCode::Subtract: return "OP Subtract";
+	case OpCode::Multiply: return "OP Multiply";
+	case OpCode::Divide: return "OP Divide";
+	case OpCode::Concatenate: return "Op Concatenate";
+	case OpCode::Not: return "OP Not";
+	case OpCode::Negate: return "OP Negate";
+#define TYPED_OPS(suffix, name) \
+	case OpCode::Equal##suffix: return "OP Equal " name; \
+	case OpCode::NotEqual##suffix: return "OP Not Equal " name; \
+	case OpCode::Greater##suffix: return "OP Greater " name; \
+	case OpCode::GreaterEqual##suffix: return "OP Greater Equal " name; \
+	case OpCode::Less##suffix: return "OP Less " name; \
+	case OpCode::LessEqual##suffix: return "OP Less Equal " name; \
+	case OpCode::Add##suffix: return "OP Add " name; \
+	case OpCode::Subtract##suffix: return "OP Subtract " name; \
+	case OpCode::Multiply##suffix: return "OP Multiply " name; \
+	case OpCode::Divide##suffix: return "OP Divide " name;
+	TYPED_OPS(I32, "int32")
+	TYPED_OPS(I64, "int64")
+	TYPED_OPS(F32, "float")
+	TYPED_OPS(F64, "double")
+#undef TYPED_OPS
+	case OpCode::I32ToI64: return "OP I32 to I64";
+	case OpCode::I32ToF32: return "OP I32 to F32";
+	case OpCode::I32ToF64: return "OP I32 to F64";
+	case OpCode::I64ToF32: return "OP I64 to F32";
+	case OpCode::I64ToF64: return "OP I64 to F64";
+	case OpCode::F32ToF64: return "OP F32 to F64";
+	case OpCode::Convert: return "OP Convert";
+#define FUSED_OPS(loads, name) \
+	case OpCode::loads: return name; \
+	case OpCode::loads##EqualI32: return name " Equal int32"; \
+	case OpCode::loads##NotEqualI32: return name " Not Equal int32"; \
+	case OpCode::loads##GreaterI32: return name " Greater int32"; \
+	case OpCode::loads##GreaterEqualI32: return name " Greater Equal int32"; \
+	case OpCode::loads##LessI32: return name " Less int32"; \
+	case OpCode::loads##LessEqualI32: return name " Less Equal int32"; \
+	case OpCode::loads##AddI32: return name " Add int32"; \
+	case OpCode::loads##SubtractI32: return name " Subtract int32"; \
+	case OpCode::loads##MultiplyI32: return name " Multiply int32";
+	FUSED_OPS(VarVar, "Var Var")
+	FUSED_OPS(VarConstant, "Var Constant")
+	FUSED_OPS(LocalLocal, "Local Local")
+	FUSED_OPS(LocalConstant, "Local Constant")
+#undef FUSED_OPS
+	case OpCode::Jump: return "OP Jump";
+	case OpCode::JumpLong: return "OP Jump long";
+	case OpCode::JumpIfFalse: return "OP Jump if false";
+	case OpCode::JumpIfFalseLong: return "OP Jump if false long";
+	case OpCode::JumpIfTrue: return "OP Jump if true";
+	case OpCode::JumpIfTrueLong: return "OP Jump if true long";
+	case OpCode::JumpIfFalseOrPop: return "OP Jump if false or pop";
+	case OpCode::JumpIfFalseOrPopLong: return "OP Jump if false or pop long";
+	case OpCode::JumpIfTrueOrPop: return "OP Jump if true or pop";
+	case OpCode::JumpIfTrueOrPopLong: return "OP Jump if true or pop long";
+	case OpCode::Loop: return "OP Loop";
+	case OpCode::LoopLong: return "OP Loop long";
+#define FUSED_JUMP(op, name) \
+	case OpCode::op: return "OP Jump if " name " int32"; \
+	case OpCode::op##Long: return "OP Jump if " name " int32 long";
+	FUSED_JUMP(JumpIfNotEqualI32, "Not Equal")
+	FUSED_JUMP(JumpIfEqualI32, "Equal")
+	FUSED_JUMP(JumpIfLessEqualI32, "Less Equal")
+	FUSED_JUMP(JumpIfLessI32, "Less")
+	FUSED_JUMP(JumpIfGreaterEqualI32, "Greater Equal")
+	FUSED_JUMP(JumpIfGreaterI32, "Greater")
+#undef FUSED_JUMP
+	case OpCode::Null: return "OP Null";
+	case OpCode::Pop: return "OP Pop";
+	case OpCode::PopN: return "OP Pop N";
+	case OpCode::Return: return "OP Return";
+	default: return "Unknown opcode";
 	}
 }
 
 int Debugger::DeclarationInstruction(const std::string& name, Chunk* chunk, int offset) {
-	ValueType type = static_cast<ValueType>(chunk->m_Code[offset + 1]);
+	ValueType type = static_cast<ValueType>(chunk->getStart()[offset + 1]);
 	std::cout << name << " type:  " << ValueTypeToString(type) << std::endl;
 	std::cout << std::setw(8) << " ";
-	ConstantInstruction("Var name: ", chunk, offset + 1);
-	return offset + 3;
+	return GlobalInstruction("Var slot: ", chunk, offset + 1);
 }
 
 int Debugger::ConstantInstruction(const std::string& name, Chunk* chunk, int offset) {
-	byte constant = chunk->m_Code[offset + 1];
-	std::cout << std::left << std::setw(16) << name << std::right << (int)constant;
+	const byte* operand = &chunk->getStart()[offset + 1];
+	size_t constant = readConstantIndex(operand);
+	std::cout << std::left << std::setw(16) << name << std::right << constant;
 	std::cout << " | " << chunk->m_Constants[constant].ToString() << " |" << std::endl;
+	return static_cast<int>(operand - chunk->getStart());
+}
+
+int Debugger::GlobalInstruction(const std::string& name, Chunk* chunk, int offset) {
+	const byte* operand = &chunk->getStart()[offset + 1];
+	std::cout << std::left << std::setw(16) << name << std::right << readGlobalSlot(operand) << std::endl;
+	return static_cast<int>(operand - chunk->getStart());
+}
+
+int Debugger::ByteInstruction(const std::string& name, Chunk* chunk, int offset) {
+	std::cout << std::left << std::setw(16) << name << std::right << (int)chunk->getStart()[offset + 1] << std::endl;
+	return offset + 2;
+}
+
+int Debugger::Superinstruction(const std::string& name, Chunk* chunk, int offset) {
+	const byte* code = chunk->getStart();
+	OpCode loads = superinstructionLoads(static_cast<OpCode>(code[offset]));
+
+	// Global slots and constant indices are written like constant indices, local slots are bytes.
+	bool globals = loads == OpCode::VarVar || loads == OpCode::VarConstant;
+	const byte* operand = &code[offset + 1];
+	size_t first = globals ? readGlobalSlot(operand) : *operand++;
+
+	// Names of superinstructions are longer than the column of the other instructions.
+	std::cout << std::left << std::setw(16) << name + " " << std::right << first;
+	if (loads == OpCode::VarConstant || loads == OpCode::LocalConstant) {
+		size_t constant = readConstantIndex(operand);
+		std::cout << " " << constant << " | " << chunk->m_Constants[constant].ToString() << " |" << std::endl;
+		return static_cast<int>(operand - code);
+	}
+
+	std::cout << " " << (globals ? readGlobalSlot(operand) : *operand++) << std::endl;
+	return static_cast<int>(operand - code);
+}
+
+int Debugger::JumpInstruction(const std::string& name, Chunk* chunk, int offset) {
+	std::cout << std::left << std::setw(16) << name + " " << std::right << offset << " -> " << jumpTarget(chunk->getStart(), offset) << std::endl;
+	return static_cast<int>(offset + instructionLength(&chunk->getStart()[offset]));
+}
+
+int Debugger::TypeInstruction(const std::string& name, Chunk* chunk, int offset) {
+	ValueType type = static_cast<ValueType>(chunk->getStart()[offset + 1]);
+	std::cout << std::left << std::setw(16) << name << std::right << ValueTypeToString(type) << std::endl;
 	return offset + 2;
 }
 
@@ -74,3 +278,43 @@ int Debugger::SimpleInstruction(const std::string& name, int offset) {
 	std::cout << name << std::endl;
 	return offset + 1;
 }
+
+void OpCodeStatistics::Count(const Chunk& chunk) {
+	const byte* code = chunk.getStart();
+	uint32_t window = 0;
+	size_t length = 0;
+
+	for (size_t offset = 0; offset < chunk.codeSize(); offset += instructionLength(&code[offset])) {
+		window = (window << 8 | code[offset]) & 0xffffff;
+		length++;
+		m_Instructions++;
+
+		if (length >= 2) m_Pairs[window & 0xffff]++;
+		if (length >= 3) m_Triples[window]++;
+	}
+}
+
+void OpCodeStatistics::Print(size_t top) const {
+	auto print = [this, top](const std::unordered_map<uint32_t, size_t>& counts, int length, const char* name) {
+		std::vector<std::pair<uint32_t, size_t>> sorted(counts.begin(), counts.end());
+		std::sort(sorted.begin(), sorted.end(), [](const auto& lhs, const auto& rhs) {
+			return lhs.second != rhs.second ? lhs.second > rhs.second : lhs.first < rhs.first;
+		});
+		if (sorted.size() > top) sorted.resize(top);
+
+		std::cout << "= " << name << " =" << std::endl;
+		for (const auto& sequence : sorted) {
+			std::cout << std::setw(10) << sequence.second << " " << std::fixed << std::setprecision(2) << std::setw(6);
+			std::cout << 100.0 * sequence.second / m_Instructions << "%  ";
+			for (int i = length - 1; i >= 0; i--) {
+				std::cout << Debugger::OpCodeName(static_cast<OpCode>(sequence.first >> (8 * i) & 0xff));
+				if (i) std::cout << ", ";
+			}
+			std::cout << std::endl;
+		}
+	};
+
+	std::cout << m_Instructions << " instructions." << std::endl;
+	print(m_Pairs, 2, "Pairs");
+	print(m_Triples, 3, "Triples");
+}
@@ -4,6 +4,7 @@
 #pragma once
 
 #include <cassert>
+#include <unordered_map>
 
 #include "Chunk.h"
 
@@ -25,6 +26,23 @@ public:
 	*/
 	static int DisassembleInstruction(Chunk* chunk, int i);
 
+	//! Prints the register bytecode of a chunk in human readable instructions.
+	/*!
+	  \param chunk Chunk whose m_RegisterCode is disassembled.
+	  \param name Name of the chunk.
+	*/
+	static void DisassembleRegisterCode(Chunk* chunk, const char* name);
+
+	//! Prints a register instruction and its operands.
+	/*!
+	  \param chunk Chunk containing the instruction in its m_RegisterCode.
+	  \param index Index of the instruction.
+	*/
+	static void DisassembleRegisterInstruction(Chunk* chunk, int index);
+
+	//! \return Human readable name of an opcode (e.g. "OP Add").
+	static const char* OpCodeName(OpCode op);
+
 	//! Disassembles Declaration instructions and prints out human readable information.
 	/*!
 	  \param name The name of the Op Code (e.g. "Var declaration").
@@ -43,6 +61,51 @@ public:
 	*/
 	static int ConstantInstruction(const std::string& name, Chunk* chunk, int offset);
 
+	//! Disassembles instructions with a global slot operand and prints the slot.
+	/*!
+	  \param name The name of the Op Code (e.g. "OP Var").
+	  \param chunk Chunk containing the instruction.
+	  \param offset Index of bytearray for the instruction.
+	  \return Index of bytearray the next instruction is in (skips over operands).
+	*/
+	static int GlobalInstruction(const std::string& name, Chunk* chunk, int offset);
+
+	//! Disassembles instructions with a single byte operand and prints the operand.
+	/*!
+	  \param name The name of the Op Code (e.g. "OP int32 to int64").
+	  \param chunk Chunk containing the instruction.
+	  \param offset Index of bytearray for the instruction.
+	  \return Index of bytearray the next instruction is in (skips over operands).
+	*/
+	static int ByteInstruction(const std::string& name, Chunk* chunk, int offset);
+
+	//! Disassembles instructions with a ValueType operand and prints the type.
+	/*!
+	  \param name The name of the Op Code (e.g. "OP Convert").
+	  \param chunk Chunk containing the instruction.
+	  \param offset Index of bytearray for the instruction.
+	  \return Index of bytearray the next instruction is in (skips over operands).
+	*/
+	static int TypeInstruction(const std::string& name, Chunk* chunk, int offset);
+
+	//! Disassembles superinstructions and prints the operands of the loads they start with.
+	/*!
+	  \param name The name of the Op Code (e.g. "Var Var Add int32").
+	  \param chunk Chunk containing the instruction.
+	  \param offset Index of bytearray for the instruction.
+	  \return Index of bytearray the next instruction is in (skips over operands).
+	*/
+	static int Superinstruction(const std::string& name, Chunk* chunk, int offset);
+
+	//! Disassembles jumps and prints the offset they go to.
+	/*!
+	  \param name The name of the Op Code (e.g. "OP Jump").
+	  \param chunk Chunk containing the instruction.
+	  \param offset Index of bytearray for the instruction.
+	  \return Index of bytearray the next instruction is in (skips over operands).
+	*/
+	static int JumpInstruction(const std::string& name, Chunk* chunk, int offset);
+
 	//! Disassembles simpler instructions (without operands) into a human readable format.
 	/*!
 	  \param name The name of the Op Code (e.g. "OP Add").
@@ -50,4 +113,29 @@ public:
 	  \return Index of bytearray the next instruction is in.
 	*/
 	static int SimpleInstruction(const std::string& name, int offset);
+};
+
+//! Counts the sequences of opcodes found in compiled code, to choose superinstructions from.
+/*!
+  Every pair and triple of instructions following each other is counted, over all the chunks
+  given to Count(). The counts are static: an instruction counts once however many times it runs.
+*/
+class OpCodeStatistics {
+private:
+	size_t m_Instructions = 0; //!< Number of instructions counted.
+	std::unordered_map<uint32_t, size_t> m_Pairs; //!< Count of each pair of opcodes, packed one byte each with the first opcode highest.
+	std::unordered_map<uint32_t, size_t> m_Triples; //!< Count of each triple of opcodes, packed like m_Pairs.
+
+public:
+	//! Counts the sequences of opcodes of a chunk.
+	/*!
+	  \param chunk A chunk of stack bytecode.
+	*/
+	void Count(const Chunk& chunk);
+
+	//! Prints the most frequent pairs and triples, with their share of all instructions.
+	/*!
+	  \param top Number of pairs and of triples to print.
+	*/
+	void Print(size_t top) const;
 };
\ No newline at end of file
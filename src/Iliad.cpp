@@ -3,9 +3,19 @@
 
 #include "stdafx.h"
 #include "VM.h"
+#include "Bytecode.h"
+#include "Debug.h"
+#include "MappedFile.h"
 
 #include <string>
 
+//!@{ Exit codes, following the BSD sysexits.h convention.
+#define EXIT_USAGE 64 //!< The command line was wrong.
+#define EXIT_COMPILE_ERROR 65 //!< The script didn't compile.
+#define EXIT_RUNTIME_ERROR 70 //!< The script stopped on a runtime error.
+#define EXIT_IO_ERROR 74 //!< The script couldn't be read.
+//!@}
+
 //! Interpreter virtual machine for the repl
 VM vm;
 
@@ -25,18 +35,148 @@ static void repl() {
 	}
 }
 
+//! Compiles and runs a whole script file, or runs a bytecode file.
+/*!
+  The file is mapped in memory and the Compiler scans it in place, it is never copied. A bytecode
+  file written by compileFile() is run in place instead.
+  \param path Path of the script.
+  \return Exit code of the process.
+*/
+static int runFile(const std::string& path) {
+	auto file = std::make_shared<MappedFile>(path);
+	if (!file->IsOpen()) {
+		std::cerr << "Could not read \"" << path << "\": " << file->Error() << std::endl;
+		return EXIT_IO_ERROR;
+	}
+
+	InterpretResults result = BytecodeFile::IsBytecode(file->View()) ? vm.InterpretBytecode(file) : vm.Interpret(file->View(), false);
+	switch (result) {
+	case InterpretResults::CompileError: return EXIT_COMPILE_ERROR;
+	case InterpretResults::RuntimeError: return EXIT_RUNTIME_ERROR;
+	default: return 0;
+	}
+}
+
+//! Compiles a script file to a bytecode file, see BytecodeFile.
+/*!
+  \param path Path of the script.
+  \param output Path of the bytecode file to write.
+  \param optimize If the peephole optimizer runs over the code written.
+  \param superinstructions If superinstructions are selected in the code written.
+  \param parallelScan If the script is scanned on several threads.
+  \return Exit code of the process.
+*/
+static int compileFile(const std::string& path, const std::string& output, bool optimize, bool superinstructions, bool parallelScan) {
+	MappedFile file(path);
+	if (!file.IsOpen()) {
+		std::cerr << "Could not read \"" << path << "\": " << file.Error() << std::endl;
+		return EXIT_IO_ERROR;
+	}
+
+	StringTable strings;
+	Compiler compiler;
+	compiler.SetOptimize(optimize);
+	compiler.SetSuperinstructions(superinstructions);
+	compiler.SetParallelScan(parallelScan);
+	auto chunk = std::make_shared<Chunk>();
+	if (!compiler.Compile(file.View(), chunk, strings)) return EXIT_COMPILE_ERROR;
+
+	std::string error;
+	if (!BytecodeFile::Write(output, *chunk, compiler, error)) {
+		std::cerr << error << std::endl;
+		return EXIT_IO_ERROR;
+	}
+
+	return 0;
+}
+
+//! Counts the sequences of opcodes the scripts compile to, see OpCodeStatistics.
+/*!
+  The code is counted as superinstructions are selected from, after the peephole optimizer.
+  \param paths Paths of the scripts.
+  \param count Number of paths.
+  \param optimize If the peephole optimizer runs over the code counted.
+  \return Exit code of the process.
+*/
+static int countOpCodes(char** paths, int count, bool optimize) {
+	OpCodeStatistics statistics;
+	int result = 0;
+
+	for (int i = 0; i < count; i++) {
+		MappedFile file(paths[i]);
+		if (!file.IsOpen()) {
+			std::cerr << "Could not read \"" << paths[i] << "\": " << file.Error() << std::endl;
+			return EXIT_IO_ERROR;
+		}
+
+		// Each script is compiled on its own, with its own globals.
+		StringTable strings;
+		Compiler compiler;
+		compiler.SetOptimize(optimize);
+		compiler.SetSuperinstructions(false);
+		auto chunk = std::make_shared<Chunk>();
+		if (!compiler.Compile(file.View(), chunk, strings)) {
+			result = EXIT_COMPILE_ERROR;
+			continue;
+		}
+
+		statistics.Count(*chunk);
+	}
+
+	statistics.Print(20);
+	return result;
+}
+
 //! Entry point of the program.
 int main(int argc, char** argv) {
-	std::cout << "Illiad programming language 0.1" << std::endl;
+	bool optimize = true;
+	bool superinstructions = true;
+	bool parallelScan = false;
+
+	// "--registers" runs the register bytecode instead of the stack bytecode, "--no-peephole"
+	// turns the peephole optimizer off and "--no-superinstructions" the superinstructions.
+	// "--parallel-scan" scans scripts on several threads before compiling them, which keeps
+	// every token of the script in memory.
+	while (argc > 1) {
+		std::string option = argv[1];
+		if (option == "--registers") {
+			vm.SetTarget(CompileTarget::Registers);
+		} else if (option == "--no-peephole") {
+			vm.SetOptimize(false);
+			optimize = false;
+		} else if (option == "--no-superinstructions") {
+			vm.SetSuperinstructions(false);
+			superinstructions = false;
+		} else if (option == "--parallel-scan") {
+			vm.SetParallelScan(true);
+			parallelScan = true;
+		} else {
+			break;
+		}
+		argv++;
+		argc--;
+	}
+
+	// "--compile" writes the bytecode of a script to a file instead of running it.
+	if (argc == 4 && std::string(argv[1]) == "--compile") {
+		return compileFile(argv[2], argv[3], optimize, superinstructions, parallelScan);
+	}
+
+	// "--opcode-stats" counts the opcode pairs and triples of scripts instead of running them.
+	if (argc > 2 && std::string(argv[1]) == "--opcode-stats") {
+		return countOpCodes(argv + 2, argc - 2, optimize);
+	}
 
 	if (argc == 1) {
+		std::cout << "Illiad programming language 0.1" << std::endl;
 		repl();
 	} else if (argc == 2) {
-		// TODO: Run file
-		std::string filename = argv[1];
+		return runFile(argv[1]);
 	} else {
-		std::cerr << "Usage: Illiad [path]" << std::endl;
-		exit(1);
+		std::cerr << "Usage: Illiad [--registers] [--no-peephole] [--no-superinstructions] [--parallel-scan] [path]" << std::endl;
+		std::cerr << "       Illiad [--no-peephole] [--no-superinstructions] [--parallel-scan] --compile path output" << std::endl;
+		std::cerr << "       Illiad [--no-peephole] --opcode-stats path..." << std::endl;
+		return EXIT_USAGE;
 	}
 	
 	return 0;
@@ -0,0 +1,111 @@
+#include "stdafx.h"
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& path) {
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		m_Error = "Could not open file.";
+		return;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size)) {
+		m_Error = "Could not read the size of the file.";
+		CloseHandle(file);
+		return;
+	}
+
+	m_Size = static_cast<size_t>(size.QuadPart);
+	if (m_Size == 0) {
+		// Empty files can't be mapped, and there is nothing to map.
+		CloseHandle(file);
+		m_Open = true;
+		return;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (mapping == nullptr) {
+		m_Error = "Could not map file.";
+		return;
+	}
+
+	// The view keeps the mapping alive.
+	m_Data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	CloseHandle(mapping);
+	if (m_Data == nullptr) {
+		m_Error = "Could not map file.";
+		return;
+	}
+
+	m_Open = true;
+}
+
+MappedFile::~MappedFile() {
+	if (m_Data) UnmapViewOfFile(m_Data);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& path) {
+	int file = open(path.c_str(), O_RDONLY);
+	if (file < 0) {
+		m_Error = std::strerror(errno);
+		return;
+	}
+
+	struct stat status;
+	if (fstat(file, &status) != 0) {
+		m_Error = std::strerror(errno);
+		close(file);
+		return;
+	}
+
+	if (!S_ISREG(status.st_mode)) {
+		m_Error = "Not a regular file.";
+		close(file);
+		return;
+	}
+
+	m_Size = static_cast<size_t>(status.st_size);
+	if (m_Size == 0) {
+		// Empty files can't be mapped, and there is nothing to map.
+		close(file);
+		m_Open = true;
+		return;
+	}
+
+	// The mapping keeps the file alive, the descriptor isn't needed past this point.
+	void* data = mmap(nullptr, m_Size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+	if (data == MAP_FAILED) {
+		m_Error = std::strerror(errno);
+		return;
+	}
+
+	// The source is scanned from the start to the end once.
+	madvise(data, m_Size, MADV_SEQUENTIAL);
+
+	m_Data = static_cast<const char*>(data);
+	m_Open = true;
+}
+
+MappedFile::~MappedFile() {
+	if (m_Data) munmap(const_cast<char*>(m_Data), m_Size);
+}
+
+#endif
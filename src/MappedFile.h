@@ -0,0 +1,42 @@
+//! \file MappedFile.h
+//! \brief Details the read-only view of a file mapped in memory.
+#pragma once
+
+#include <string>
+#include <string_view>
+
+//! A file mapped read-only in memory.
+/*!
+  The contents of the file are never copied: View() refers to the pages the operating system
+  maps, and they are only read from the disk as they are used. The view is valid as long as
+  the MappedFile is alive.
+*/
+class MappedFile {
+private:
+	const char* m_Data = nullptr; //!< First byte of the mapping, nullptr for an empty or unopened file.
+	size_t m_Size = 0; //!< Size of the file in bytes.
+	bool m_Open = false; //!< If the file could be opened and mapped.
+	std::string m_Error; //!< Why the file couldn't be opened.
+
+public:
+	//! Maps the file at path.
+	/*!
+	  \param path Path of the file to map. On failure IsOpen() is false and Error() tells why.
+	*/
+	explicit MappedFile(const std::string& path);
+
+	//! Unmaps the file.
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	//! \return If the file was mapped.
+	bool IsOpen() const { return m_Open; }
+
+	//! \return Why the file couldn't be mapped.
+	const std::string& Error() const { return m_Error; }
+
+	//! \return The contents of the file.
+	std::string_view View() const { return std::string_view(m_Data, m_Size); }
+};
@@ -0,0 +1,129 @@
+#include "stdafx.h"
+#include "Object.h"
+
+#include <vector>
+
+size_t HashString(std::string_view chars) {
+	uint64_t hash = 14695981039346656037ull;
+
+	for (char c : chars) {
+		hash ^= static_cast<uint8_t>(c);
+		hash *= 1099511628211ull;
+	}
+
+	return static_cast<size_t>(hash);
+}
+
+//! Ropes shorter than this are copied into a flat string right away.
+static const size_t MIN_ROPE_LENGTH = 64;
+
+StringObject::StringObject(StringObject* left, StringObject* right)
+	: m_RefCount(0), m_Hash(0), m_Table(nullptr), m_Length(left->Length() + right->Length()), m_External(nullptr), m_Left(left), m_Right(right) {
+	m_Left->Retain();
+	m_Right->Retain();
+}
+
+StringObject* StringObject::Create(std::string chars) {
+	size_t hash = HashString(chars);
+	return new StringObject(std::move(chars), hash);
+}
+
+StringObject* StringObject::Concatenate(StringObject* left, StringObject* right) {
+	if (right->Length() == 0) return left;
+	if (left->Length() == 0) return right;
+
+	if (left->Length() + right->Length() < MIN_ROPE_LENGTH && left->isFlat() && right->isFlat()) {
+		std::string chars;
+		chars.reserve(left->Length() + right->Length());
+		chars += left->Chars();
+		chars += right->Chars();
+		return Create(std::move(chars));
+	}
+
+	return new StringObject(left, right);
+}
+
+void StringObject::flatten() const {
+	std::string chars;
+	chars.reserve(m_Length);
+
+	// Walk the rope in order without recursing, ropes built in a loop are as deep as the loop is long.
+	std::vector<const StringObject*> pending = { m_Right, m_Left };
+	while (!pending.empty()) {
+		const StringObject* string = pending.back();
+		pending.pop_back();
+
+		if (string->isFlat()) {
+			chars += string->Chars();
+		} else {
+			pending.push_back(string->m_Right);
+			pending.push_back(string->m_Left);
+		}
+	}
+
+	m_Chars = std::move(chars);
+	m_Hash = HashString(m_Chars);
+
+	StringObject* left = m_Left;
+	StringObject* right = m_Right;
+	m_Left = nullptr;
+	m_Right = nullptr;
+	left->Release();
+	right->Release();
+}
+
+void StringObject::destroy(StringObject* string) {
+	// Releasing the halves of a rope could cascade down the whole rope, so it's done with a worklist.
+	std::vector<StringObject*> pending = { string };
+	while (!pending.empty()) {
+		StringObject* dead = pending.back();
+		pending.pop_back();
+
+		if (!dead->isFlat()) {
+			if (--dead->m_Left->m_RefCount == 0) pending.push_back(dead->m_Left);
+			if (--dead->m_Right->m_RefCount == 0) pending.push_back(dead->m_Right);
+		}
+
+		if (dead->m_Table) dead->m_Table->remove(dead);
+		delete dead;
+	}
+}
+
+bool StringObject::Equals(const StringObject* other) const {
+	if (this == other) return true;
+
+	// Only one string with the same characters can be interned in a table.
+	if (m_Table && m_Table == other->m_Table) return false;
+
+	if (m_Length != other->m_Length) return false;
+
+	return Hash() == other->Hash() && Chars() == other->Chars();
+}
+
+StringTable::~StringTable() {
+	for (auto& entry : m_Strings) {
+		entry.second->m_Table = nullptr;
+	}
+}
+
+StringObject* StringTable::Intern(std::string_view chars) {
+	size_t hash = HashString(chars);
+
+	auto iter = m_Strings.find(Key{ chars, hash });
+	if (iter != m_Strings.end()) return iter->second;
+
+	StringObject* string = new StringObject(std::string(chars), hash);
+	string->m_Table = this;
+	m_Strings.insert({ Key{ string->Chars(), hash }, string });
+	return string;
+}
+
+StringObject* StringTable::InternInPlace(std::string_view chars, size_t hash) {
+	auto iter = m_Strings.find(Key{ chars, hash });
+	if (iter != m_Strings.end()) return iter->second;
+
+	StringObject* string = new StringObject(chars, hash);
+	string->m_Table = this;
+	m_Strings.insert({ Key{ chars, hash }, string });
+	return string;
+}
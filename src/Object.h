@@ -0,0 +1,174 @@
+//! \file Object.h
+//! \brief Details the heap allocated objects a Value can refer to.
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+class StringTable;
+
+//! Hashes a string with FNV-1a.
+/*!
+  \param chars Characters to hash.
+  \return Hash of the characters.
+*/
+size_t HashString(std::string_view chars);
+
+//! An immutable, reference counted string.
+/*!
+  Scalars are stored inline in a Value, strings are the only data that live on the heap. A
+  Value only holds a pointer to a StringObject, so copying a string Value is a reference count
+  increment instead of a copy of its characters. The object deletes itself once the last Value
+  referring to it releases it.
+
+  The hash of the characters is computed once and cached. Strings made through a StringTable
+  are interned: there is only ever one interned object with the same characters in a table, so
+  two interned strings are equal exactly when they are the same object.
+
+  Concatenating strings doesn't copy them. Concatenate() makes a rope node that refers to both
+  halves, and the characters are only gathered into one buffer, once, when they are observed
+  through Chars(), Hash() or Equals(). A loop that keeps appending to a string is therefore
+  linear in the length of what is appended.
+
+  A string can also view characters it doesn't own, such as the string constants of a bytecode
+  file used where the file is mapped. Whoever makes such a string keeps its characters alive.
+*/
+class StringObject {
+private:
+	size_t m_RefCount; //!< Number of Values currently referring to this string.
+	mutable size_t m_Hash; //!< Cached hash of m_Chars, only valid once the string is flat.
+	StringTable* m_Table; //!< Table the string is interned in, or nullptr if it isn't interned.
+	const size_t m_Length; //!< Length of the string in characters.
+	mutable std::string m_Chars; //!< Characters of the string, only valid once the string is flat and if it owns them.
+	const char* m_External; //!< Characters of a string that doesn't own them, nullptr for the other strings.
+	mutable StringObject* m_Left; //!< First half of a rope, nullptr once the string is flat.
+	mutable StringObject* m_Right; //!< Second half of a rope, nullptr once the string is flat.
+
+	friend class StringTable;
+
+	//! Only Create(), Concatenate() and StringTable can make new strings, so every StringObject lives on the heap.
+	StringObject(std::string chars, size_t hash) : m_RefCount(0), m_Hash(hash), m_Table(nullptr), m_Length(chars.size()),
+		m_Chars(std::move(chars)), m_External(nullptr), m_Left(nullptr), m_Right(nullptr) {}
+
+	//! Creates a string viewing characters it doesn't own.
+	StringObject(std::string_view chars, size_t hash) : m_RefCount(0), m_Hash(hash), m_Table(nullptr), m_Length(chars.size()),
+		m_External(chars.data()), m_Left(nullptr), m_Right(nullptr) {}
+
+	//! Creates a rope node, retaining both halves.
+	StringObject(StringObject* left, StringObject* right);
+
+	//! \return If the characters are gathered in m_Chars.
+	bool isFlat() const { return m_Left == nullptr; }
+
+	//! Gathers the characters of a rope into m_Chars and releases its halves.
+	void flatten() const;
+
+	//! Deletes a string whose reference count reached zero, and every rope node only it referred to.
+	static void destroy(StringObject* string);
+
+public:
+	StringObject(const StringObject&) = delete;
+	StringObject& operator=(const StringObject&) = delete;
+
+	//! Allocates a new string object that isn't interned.
+	/*!
+	  \param chars Characters of the new string.
+	  \return A string object with a reference count of zero. The caller is expected to Retain() it.
+	*/
+	static StringObject* Create(std::string chars);
+
+	//! Joins two strings without copying their characters.
+	/*!
+	  \param left First half of the new string.
+	  \param right Second half of the new string.
+	  \return A string object with a reference count of zero. The caller is expected to Retain() it.
+	*/
+	static StringObject* Concatenate(StringObject* left, StringObject* right);
+
+	//! Adds a reference to the string.
+	void Retain() { m_RefCount++; }
+
+	//! Removes a reference to the string, deleting it if it was the last one.
+	void Release() { if (--m_RefCount == 0) destroy(this); }
+
+	//! \return Characters of the string. Flattens a rope.
+	std::string_view Chars() const {
+		if (m_External) return std::string_view(m_External, m_Length);
+		if (!isFlat()) flatten();
+		return m_Chars;
+	}
+
+	//! \return Length of the string in characters.
+	size_t Length() const { return m_Length; }
+
+	//! \return Cached hash of the string. Flattens a rope.
+	size_t Hash() const { if (!isFlat()) flatten(); return m_Hash; }
+
+	//! \return If the string is held by a StringTable.
+	bool IsInterned() const { return m_Table != nullptr; }
+
+	//! Compares the characters of two strings.
+	/*!
+	  Interned strings from the same table are compared by address, other strings compare
+	  their lengths and hashes before falling back to their characters.
+	*/
+	bool Equals(const StringObject* other) const;
+};
+
+//! A table of interned strings.
+/*!
+  The table doesn't own the strings, it only indexes them. A string removes itself from the
+  table once its last reference is released, and a table that is destroyed first detaches the
+  strings it still holds.
+*/
+class StringTable {
+private:
+	//! A string and its precomputed hash, used as a key of m_Strings.
+	struct Key {
+		std::string_view chars;
+		size_t hash;
+
+		bool operator==(const Key& key) const { return hash == key.hash && chars == key.chars; }
+	};
+
+	//! Uses the precomputed hash of a Key.
+	struct KeyHasher {
+		size_t operator()(const Key& key) const { return key.hash; }
+	};
+
+	std::unordered_map<Key, StringObject*, KeyHasher> m_Strings; //!< Interned strings, indexed by their characters.
+
+	friend class StringObject;
+
+	//! Removes a string that is about to be deleted.
+	void remove(StringObject* string) { m_Strings.erase(Key{ string->Chars(), string->Hash() }); }
+
+public:
+	StringTable() = default;
+	StringTable(const StringTable&) = delete;
+	StringTable& operator=(const StringTable&) = delete;
+
+	//! Detaches every string still alive from the table.
+	~StringTable();
+
+	//! Finds the interned string with the given characters, creating it if needed.
+	/*!
+	  \param chars Characters of the string.
+	  \return The interned string. The caller is expected to Retain() it.
+	*/
+	StringObject* Intern(std::string_view chars);
+
+	//! Finds the interned string with the given characters, creating one that views them if needed.
+	/*!
+	  Unlike Intern(), a new string doesn't copy the characters, the caller keeps them alive as
+	  long as the string is.
+	  \param chars Characters of the string.
+	  \param hash HashString() of the characters.
+	  \return The interned string. The caller is expected to Retain() it.
+	*/
+	StringObject* InternInPlace(std::string_view chars, size_t hash);
+
+	//! \return Number of strings currently interned.
+	size_t Count() const { return m_Strings.size(); }
+};
@@ -0,0 +1,588 @@
+#include "stdafx.h"
+#include "Chunk.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace {
+	//! Number of instructions kept right before the current one a window can reach back to.
+	const size_t PEEPHOLE_WINDOW = 8;
+
+	//! Most unconditional jumps Chunk::threadJumps() follows from a jump, chains of jumps can loop.
+	const int MAX_THREADED_JUMPS = 8;
+
+	//! Looks up the lines of the code a pass reads, in the table the code had before the pass.
+	class LineReader {
+	private:
+		const LineTable m_Lines; //!< Lines of the code before the pass.
+		const LineRun* m_Run; //!< Run of the last offset looked up.
+
+	public:
+		explicit LineReader(LineTable&& lines) : m_Lines(std::move(lines)), m_Run(m_Lines.begin()) {}
+
+		//! \return Line of the byte at offset. Offsets have to be looked up in order.
+		int operator()(size_t offset) {
+			while (m_Run + 1 != m_Lines.end() && (m_Run + 1)->start <= offset) m_Run++;
+			return m_Run->line;
+		}
+	};
+
+	//! \return The targets of the jumps of code, in the order of the jumps.
+	std::vector<size_t> jumpTargets(const byte* code, size_t size) {
+		std::vector<size_t> targets;
+		for (size_t offset = 0; offset < size; offset += instructionLength(&code[offset])) {
+			if (isJump(static_cast<OpCode>(code[offset]))) targets.push_back(jumpTarget(code, offset));
+		}
+		return targets;
+	}
+
+	//! \return If op jumps on the value of a bool, from OpCode::JumpIfFalse to OpCode::JumpIfTrueOrPopLong.
+	bool isBoolJump(OpCode op) { return op >= OpCode::JumpIfFalse && op <= OpCode::JumpIfTrueOrPopLong; }
+
+	//! \return The value of the bool a jump on a bool jumps on.
+	bool jumpsIf(OpCode op) {
+		op = jumpOfWidth(op, false);
+		return op == OpCode::JumpIfTrue || op == OpCode::JumpIfTrueOrPop;
+	}
+
+	//! Keeps jumps going to the same instructions while a pass compacts the code in place.
+	/*!
+	  The targets of the jumps are found before the code changes. As the pass writes the code
+	  again, it tells where the targets and the jumps end up, then Patch() writes the distance of
+	  every jump again. Code is only ever removed, so no distance grows past what its jump holds.
+	*/
+	class JumpRelocation {
+	private:
+		//! A jump written by the pass.
+		struct Jump {
+			size_t offset; //!< Offset of the jump in the code written.
+			size_t target; //!< Offset of its target in the code read.
+		};
+
+		std::vector<size_t> m_Targets; //!< Offsets of the targets in the code read, sorted.
+		std::vector<size_t> m_Written; //!< Offset each target was written to.
+		std::vector<Jump> m_Jumps; //!< Jumps written so far.
+		size_t m_NextTarget = 0; //!< First target that hasn't been read yet.
+
+	public:
+		//! Finds the targets of the jumps of code.
+		JumpRelocation(const byte* code, size_t size) : JumpRelocation(jumpTargets(code, size)) {}
+
+		//! Relocates jumps going to given targets, for a pass that changes where jumps go.
+		explicit JumpRelocation(std::vector<size_t> targets) : m_Targets(std::move(targets)) {
+			std::sort(m_Targets.begin(), m_Targets.end());
+			m_Targets.erase(std::unique(m_Targets.begin(), m_Targets.end()), m_Targets.end());
+			m_Written.resize(m_Targets.size());
+		}
+
+		//! \return If the code has any jump.
+		bool HasJumps() const { return !m_Targets.empty(); }
+
+		//! \return If the instruction at offset in the code read is the target of a jump.
+		bool IsTarget(size_t offset) const { return std::binary_search(m_Targets.begin(), m_Targets.end(), offset); }
+
+		//! Records where the instruction at read is written. Instructions have to be read in order.
+		/*!
+		  \return If the instruction is the target of a jump.
+		*/
+		bool Reached(size_t read, size_t write) {
+			while (m_NextTarget < m_Targets.size() && m_Targets[m_NextTarget] < read) m_NextTarget++;
+			if (m_NextTarget == m_Targets.size() || m_Targets[m_NextTarget] != read) return false;
+
+			m_Written[m_NextTarget] = write;
+			return true;
+		}
+
+		//! Records a jump written at offset, going to target in the code read.
+		void AddJump(size_t offset, size_t target) { m_Jumps.push_back({ offset, target }); }
+
+		//! Points every jump at where its target was written.
+		void Patch(byte* code) const {
+			for (const Jump& jump : m_Jumps) {
+				size_t index = std::lower_bound(m_Targets.begin(), m_Targets.end(), jump.target) - m_Targets.begin();
+				bool patched = setJumpTarget(code, jump.offset, m_Written[index]);
+				assert(patched);
+				(void)patched;
+			}
+		}
+	};
+
+
+	//! \return If the instruction always leaves a bool on top of the stack.
+	bool pushesBool(OpCode op) {
+		const int typedOpCount = static_cast<int>(OpCode::EqualI64) - static_cast<int>(OpCode::EqualI32);
+		const int typedComparisonCount = static_cast<int>(OpCode::AddI32) - static_cast<int>(OpCode::EqualI32);
+
+		if (op >= OpCode::EqualI32 && op <= OpCode::DivideF64) {
+			return (static_cast<int>(op) - static_cast<int>(OpCode::EqualI32)) % typedOpCount < typedComparisonCount;
+		}
+
+		return op == OpCode::TrueLiteral || op == OpCode::FalseLiteral || op == OpCode::Not ||
+			(op >= OpCode::Equal && op <= OpCode::LessEqual);
+	}
+}
+
+size_t Chunk::optimize() {
+	// Instructions are compacted towards the start of the code as they are read, and each one is
+	// matched against the instructions kept right before it as soon as it is kept. A rewritten
+	// window is never longer than the instructions it replaces, so the code is rewritten in place.
+	byte* code = m_Code.data();
+	size_t size = m_Code.size();
+	size_t read = 0;
+	size_t write = 0;
+
+	// The lines are set again as the code is written.
+	LineReader originalLine(std::move(m_Lines));
+	m_Lines = LineTable();
+
+	// Offsets of the last instructions kept, by number of instructions kept. A window reaching
+	// further back than the ring remembers is left as it is.
+	size_t starts[PEEPHOLE_WINDOW];
+	size_t kept = 0;
+	size_t known = 0;
+	size_t instructionCount = 0;
+
+	auto start = [&](size_t back) { return starts[(kept - 1 - back) % PEEPHOLE_WINDOW]; };
+	auto op = [&](size_t back) { return static_cast<OpCode>(code[start(back)]); };
+	auto operand = [&](size_t back) { return code[start(back) + 1]; };
+
+	auto keep = [&](size_t offset) {
+		starts[kept++ % PEEPHOLE_WINDOW] = offset;
+		if (known < PEEPHOLE_WINDOW) known++;
+	};
+
+	// Removes the last count instructions.
+	auto drop = [&](size_t count) {
+		write = start(count - 1);
+		kept -= count;
+		known -= count;
+	};
+
+	// Replaces the last count instructions with a single instruction, on the line of the first one.
+	auto replace = [&](size_t count, OpCode newOp, std::initializer_list<byte> operands) {
+		int line = m_Lines.Get(start(count - 1));
+		drop(count);
+
+		keep(write);
+		m_Lines.Set(write, line);
+		code[write++] = static_cast<byte>(newOp);
+		for (byte value : operands) {
+			code[write++] = value;
+		}
+	};
+
+	// Constant of the literal back instructions before the last one.
+	auto literal = [&](size_t back) -> const Value& {
+		const byte* index = &code[start(back) + 1];
+		return m_Constants[readConstantIndex(index)];
+	};
+
+	// Global slot of the variable instruction back instructions before the last one.
+	auto slot = [&](size_t back) {
+		const byte* operand = &code[start(back) + 1];
+		return readGlobalSlot(operand);
+	};
+
+	// Replaces the opcode of the instruction before the last one, and removes the last one. The
+	// operands stay as they are, whatever their length.
+	auto retype = [&](OpCode newOp) {
+		code[start(1)] = static_cast<byte>(newOp);
+		drop(1);
+	};
+
+	// Replaces a literal and the instruction after it with a literal of another constant.
+	auto replaceConstant = [&](const Value& constant) {
+		// The constant is only added once the rewrite is certain, a constant left unused would
+		// still be written to bytecode files.
+		auto existing = m_ConstantIndices.find(constant);
+		size_t index = existing != m_ConstantIndices.end() ? existing->second : m_Constants.size();
+
+		// The index of the new constant is written like writeConstantIndex() does.
+		byte operands[sizeof(size_t) * 8 / 7 + 1];
+		size_t length = 0;
+		size_t rest = index;
+		for (; rest >= 0x80; rest >>= 7) operands[length++] = static_cast<byte>(rest | 0x80);
+		operands[length++] = static_cast<byte>(rest);
+
+		// Only when it fits in place of both instructions.
+		if (1 + length > write - start(1)) return false;
+		addConstant(constant);
+
+		OpCode literalOp = op(1);
+		int line = m_Lines.Get(start(1));
+		drop(2);
+		keep(write);
+		m_Lines.Set(write, line);
+		code[write++] = static_cast<byte>(literalOp);
+		for (size_t i = 0; i < length; i++) {
+			code[write++] = operands[i];
+		}
+		return true;
+	};
+
+	// Rewrites the window ending with the last instruction kept, returns false if nothing matched.
+	auto rewrite = [&]() {
+		size_t count = known;
+		if (count < 2) return false;
+
+		switch (op(0)) {
+		case OpCode::Not:
+			// The operand of Not is turned to a bool, so a double negation only removes a conversion
+			// the value doesn't need.
+			if (count >= 3 && op(1) == OpCode::Not && pushesBool(op(2))) {
+				drop(2);
+				return true;
+			}
+			break;
+		case OpCode::Negate:
+			if (op(1) == OpCode::Negate) {
+				// The Compiler only negates numbers.
+				drop(2);
+				return true;
+			}
+			if (op(1) == OpCode::IntLiteral || op(1) == OpCode::FloatLiteral) {
+				return replaceConstant(-literal(1));
+			}
+			break;
+		case OpCode::I32ToI64:
+		case OpCode::I32ToF32:
+		case OpCode::I32ToF64:
+		case OpCode::I64ToF32:
+		case OpCode::I64ToF64:
+		case OpCode::F32ToF64:
+		case OpCode::Convert:
+			// Literals are converted once here instead of every time the code runs, the literal
+			// opcode pushes its constant whatever its type.
+			if ((op(1) == OpCode::IntLiteral || op(1) == OpCode::FloatLiteral) && (op(0) == OpCode::Convert || operand(0) == 0)) {
+				ValueType type = op(0) == OpCode::Convert ? static_cast<ValueType>(operand(0)) : widenedType(op(0));
+				if (!IsNumber(type)) break;
+
+				Value converted(type);
+				converted.Assign(literal(1));
+				return replaceConstant(converted);
+			}
+			break;
+		case OpCode::Pop:
+			// The value assigned isn't used, it can be popped by the assignment.
+			if (op(1) == OpCode::VarAssign) {
+				retype(OpCode::VarDeclarAndAssign);
+				return true;
+			}
+			if (op(1) == OpCode::Pop) {
+				replace(2, OpCode::PopN, { 2 });
+				return true;
+			}
+			if (op(1) == OpCode::PopN && operand(1) < UINT8_MAX) {
+				replace(2, OpCode::PopN, { static_cast<byte>(operand(1) + 1) });
+				return true;
+			}
+			break;
+		case OpCode::PopN:
+			if (op(1) == OpCode::Pop && operand(0) < UINT8_MAX) {
+				replace(2, OpCode::PopN, { static_cast<byte>(operand(0) + 1) });
+				return true;
+			}
+			if (op(1) == OpCode::PopN && operand(0) + operand(1) <= UINT8_MAX) {
+				replace(2, OpCode::PopN, { static_cast<byte>(operand(0) + operand(1)) });
+				return true;
+			}
+			break;
+		case OpCode::Var:
+			// The value loaded was just stored, it can be left on the stack by the store instead.
+			if (op(1) == OpCode::VarDeclarAndAssign && slot(1) == slot(0)) {
+				retype(OpCode::VarAssign);
+				return true;
+			}
+			break;
+		case OpCode::GetLocal:
+			if (count >= 3 && op(1) == OpCode::Pop && op(2) == OpCode::SetLocal && operand(2) == operand(0)) {
+				drop(2);
+				return true;
+			}
+			break;
+		default:
+			break;
+		}
+
+		return false;
+	};
+
+	JumpRelocation jumps(code, size);
+
+	while (read < size) {
+		size_t length = instructionLength(&code[read]);
+
+		// Code jumping to an instruction didn't run the instructions before it, windows never reach
+		// back past it.
+		if (jumps.Reached(read, write)) known = 0;
+		if (isJump(static_cast<OpCode>(code[read]))) jumps.AddJump(write, jumpTarget(code, read));
+
+		keep(write);
+		m_Lines.Set(write, originalLine(read));
+		if (write != read) {
+			for (size_t i = 0; i < length; i++) {
+				code[write + i] = code[read + i];
+			}
+		}
+		write += length;
+		read += length;
+		instructionCount++;
+
+		while (rewrite()) {}
+	}
+
+	m_Code.resize(write);
+	m_Lines.Truncate(write);
+	jumps.Patch(code);
+
+	return instructionCount - kept;
+}
+
+size_t Chunk::threadJumps() {
+	byte* code = m_Code.data();
+	size_t size = m_Code.size();
+
+	// A jump threaded to its new target, and the jump it becomes.
+	struct ThreadedJump {
+		OpCode op;
+		size_t target;
+	};
+
+	// The jumps in order. The code is compacted in place, so the chains of jumps are followed
+	// before anything is overwritten.
+	std::vector<ThreadedJump> threaded;
+	for (size_t offset = 0; offset < size; offset += instructionLength(&code[offset])) {
+		OpCode op = static_cast<OpCode>(code[offset]);
+		if (!isJump(op)) continue;
+
+		size_t target = jumpTarget(code, offset);
+		for (int hops = 0; hops < MAX_THREADED_JUMPS; hops++) {
+			OpCode next = static_cast<OpCode>(code[target]);
+			OpCode threadedOp = op;
+			size_t nextTarget;
+
+			if (isUnconditionalJump(next)) {
+				nextTarget = jumpTarget(code, target);
+			} else if (keepsBoolOnJump(op) && isBoolJump(next)) {
+				// The bool left by a jump of && or || is known at its target, so the jump on it there
+				// is already decided. Once that jump pops the bool, the jump becomes one that pops it.
+				bool value = jumpsIf(op);
+				bool taken = jumpsIf(next) == value;
+				nextTarget = taken ? jumpTarget(code, target) : target + instructionLength(&code[target]);
+				if (!taken || !keepsBoolOnJump(next)) threadedOp = value ? OpCode::JumpIfTrue : OpCode::JumpIfFalse;
+			} else {
+				break;
+			}
+
+			// Only unconditional jumps can turn into loops, the others only jump forward.
+			if (nextTarget <= offset && !isUnconditionalJump(op)) break;
+			op = threadedOp;
+			target = nextTarget;
+		}
+		threaded.push_back({ op, target });
+	}
+	if (threaded.empty()) return 0;
+
+	std::vector<size_t> targets;
+	for (const ThreadedJump& jump : threaded) targets.push_back(jump.target);
+	JumpRelocation jumps(std::move(targets));
+
+	// Distances only shrink as the code is compacted, so a jump whose distance already fits in a
+	// byte is written short.
+	auto isLong = [](size_t end, size_t target) {
+		return (target < end ? end - target : target - end) > UINT8_MAX;
+	};
+
+	size_t read = 0;
+	size_t write = 0;
+	size_t removed = 0;
+	size_t nextJump = 0;
+
+	// Lines are set again as the code is written, like optimize() does.
+	LineReader originalLine(std::move(m_Lines));
+	m_Lines = LineTable();
+
+	while (read < size) {
+		OpCode op = static_cast<OpCode>(code[read]);
+		size_t length = instructionLength(&code[read]);
+		jumps.Reached(read, write);
+		m_Lines.Set(write, originalLine(read));
+
+		// A comparison followed by a jump popping a bool, when nothing jumps to the jump.
+		size_t jump = read + length;
+		if (op >= OpCode::EqualI32 && op <= OpCode::LessEqualI32 && jump < size && isJump(static_cast<OpCode>(code[jump])) &&
+			!jumps.IsTarget(jump)) {
+			const ThreadedJump& threadedJump = threaded[nextJump];
+			OpCode jumpOp = jumpOfWidth(threadedJump.op, false);
+
+			if (jumpOp == OpCode::JumpIfFalse || jumpOp == OpCode::JumpIfTrue) {
+				size_t end = jump + instructionLength(&code[jump]);
+				code[write] = static_cast<byte>(fusedJumpOpCode(op, jumpOp == OpCode::JumpIfTrue, isLong(end, threadedJump.target)));
+				jumps.AddJump(write, threadedJump.target);
+				write += instructionLength(&code[write]);
+				read = end;
+				nextJump++;
+				removed++;
+				continue;
+			}
+		}
+
+		if (isJump(op)) {
+			size_t end = read + length;
+			const ThreadedJump& threadedJump = threaded[nextJump++];
+
+			op = threadedJump.op;
+			if (isUnconditionalJump(op)) op = threadedJump.target < end ? OpCode::Loop : OpCode::Jump;
+			code[write] = static_cast<byte>(jumpOfWidth(op, isLong(end, threadedJump.target)));
+			jumps.AddJump(write, threadedJump.target);
+			write += instructionLength(&code[write]);
+			read = end;
+			continue;
+		}
+
+		if (write != read) {
+			for (size_t i = 0; i < length; i++) {
+				code[write + i] = code[read + i];
+			}
+		}
+		write += length;
+		read += length;
+	}
+
+	m_Code.resize(write);
+	m_Lines.Truncate(write);
+	jumps.Patch(code);
+
+	return removed;
+}
+
+size_t Chunk::selectSuperinstructions() {
+	// Like optimize(), the code is compacted in place, superinstructions are never longer than the
+	// instructions they replace. Instructions are matched with the ones after them, so a pair of
+	// loads is left alone when its second load starts a longer superinstruction.
+	byte* code = m_Code.data();
+	size_t size = m_Code.size();
+	size_t read = 0;
+	size_t write = 0;
+
+	// Lines are set again as the code is written, like optimize() does.
+	LineReader originalLine(std::move(m_Lines));
+	m_Lines = LineTable();
+	size_t removed = 0;
+
+	auto isConstant = [&](size_t offset) {
+		OpCode op = static_cast<OpCode>(code[offset]);
+		return op >= OpCode::IntLiteral && op <= OpCode::StringLiteral;
+	};
+
+	// Superinstructions load both values before pushing anything, so a local can only be fused
+	// with a load before it when the load before it doesn't push the slot of the local.
+	std::vector<int> depths;
+	maxStackDepth(&depths);
+
+	// The superinstruction loading the values of two instructions, or OpCode::Return if there is none.
+	auto loads = [&](size_t first, size_t second) {
+		OpCode op = static_cast<OpCode>(code[first]);
+		if (op == OpCode::Var) {
+			if (static_cast<OpCode>(code[second]) == OpCode::Var) return OpCode::VarVar;
+			if (isConstant(second)) return OpCode::VarConstant;
+		} else if (op == OpCode::GetLocal) {
+			if (static_cast<OpCode>(code[second]) == OpCode::GetLocal && code[second + 1] < depths[first]) return OpCode::LocalLocal;
+			if (isConstant(second)) return OpCode::LocalConstant;
+		}
+		return OpCode::Return;
+	};
+
+	// The superinstruction for three instructions, or OpCode::Return if there is none.
+	auto fused = [&](size_t first, size_t second, size_t third) {
+		const int fusedOpCount = static_cast<int>(OpCode::VarConstantEqualI32) - static_cast<int>(OpCode::VarVarEqualI32);
+
+		OpCode pair = loads(first, second);
+		OpCode op = static_cast<OpCode>(code[third]);
+		if (pair == OpCode::Return || op < OpCode::EqualI32 || op > OpCode::MultiplyI32) return OpCode::Return;
+
+		// Typed operators trust their operands, only int32 constants are fused with them.
+		if (isConstant(second)) {
+			const byte* index = &code[second + 1];
+			if (m_Constants[readConstantIndex(index)].Type() != ValueType::Int32) return OpCode::Return;
+		}
+
+		int group = static_cast<int>(pair) - static_cast<int>(OpCode::VarVar);
+		int offset = static_cast<int>(op) - static_cast<int>(OpCode::EqualI32);
+		return static_cast<OpCode>(static_cast<int>(OpCode::VarVarEqualI32) + group * fusedOpCount + offset);
+	};
+
+	// A jump can't land inside a superinstruction, only its first instruction can be a target.
+	JumpRelocation jumps(code, size);
+	auto pair = [&](size_t first, size_t second) {
+		OpCode op = loads(first, second);
+		return op != OpCode::Return && jumps.IsTarget(second) ? OpCode::Return : op;
+	};
+	auto triple = [&](size_t first, size_t second, size_t third) {
+		OpCode op = fused(first, second, third);
+		return op != OpCode::Return && (jumps.IsTarget(second) || jumps.IsTarget(third)) ? OpCode::Return : op;
+	};
+
+	while (read < size) {
+		// Offsets of the next instructions, and of the end of the last one.
+		size_t next[5];
+		size_t count = 0;
+		for (size_t offset = read; count < 4 && offset < size; offset += instructionLength(&code[offset])) {
+			next[count++] = offset;
+		}
+		next[count] = count ? next[count - 1] + instructionLength(&code[next[count - 1]]) : read;
+
+		jumps.Reached(read, write);
+
+		OpCode superinstruction = OpCode::Return;
+		size_t replaced = 1;
+		if (count >= 3 && (superinstruction = triple(next[0], next[1], next[2])) != OpCode::Return) {
+			replaced = 3;
+		} else if (count >= 2 && (superinstruction = pair(next[0], next[1])) != OpCode::Return &&
+			!(count >= 4 && triple(next[1], next[2], next[3]) != OpCode::Return)) {
+			replaced = 2;
+		} else {
+			superinstruction = OpCode::Return;
+		}
+
+		if (superinstruction == OpCode::Return) {
+			size_t length = next[1] - next[0];
+			if (isJump(static_cast<OpCode>(code[read]))) jumps.AddJump(write, jumpTarget(code, read));
+			m_Lines.Set(write, originalLine(read));
+			if (write != read) {
+				for (size_t i = 0; i < length; i++) {
+					code[write + i] = code[read + i];
+				}
+			}
+			write += length;
+			read += length;
+			continue;
+		}
+
+		// The operands of the loads, read before they are overwritten. Each is a local slot, a
+		// global slot or a constant index, the last two written like constant indices.
+		byte operands[2 * (sizeof(size_t) * 8 / 7 + 1)];
+		size_t length = 0;
+		for (size_t offset = next[0] + 1; offset < next[1]; offset++) {
+			operands[length++] = code[offset];
+		}
+		for (size_t offset = next[1] + 1; offset < next[2]; offset++) {
+			operands[length++] = code[offset];
+		}
+
+		m_Lines.Set(write, originalLine(next[0]));
+		code[write++] = static_cast<byte>(superinstruction);
+		for (size_t i = 0; i < length; i++) {
+			code[write++] = operands[i];
+		}
+
+		read = next[replaced];
+		removed += replaced - 1;
+	}
+
+	m_Code.resize(write);
+	m_Lines.Truncate(write);
+	jumps.Patch(code);
+
+	return removed;
+}
@@ -0,0 +1,218 @@
+#include "stdafx.h"
+#include "Chunk.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace {
+	//! Where the value of a stack slot lives while the stack bytecode is translated.
+	struct Operand {
+		bool isConstant; //!< If index is an index in the constants instead of a register.
+		size_t index; //!< Register or constant holding the value.
+	};
+
+	//! A register instruction whose operands aren't placed in the frame yet.
+	struct PendingInstruction {
+		OpCode op;
+		byte type;
+		Operand a, b, c;
+		size_t origin;
+	};
+}
+
+bool Chunk::translateToRegisters() {
+	std::vector<Value> constants = m_Constants;
+	std::vector<PendingInstruction> pending;
+	std::vector<Operand> stack;
+	size_t registerCount = 0;
+
+	auto constant = [&constants](Value value) {
+		constants.push_back(std::move(value));
+		return Operand{ true, constants.size() - 1 };
+	};
+
+	// The result of an instruction goes in the register of the stack slot it would be pushed to.
+	auto destination = [&]() {
+		registerCount = std::max(registerCount, stack.size() + 1);
+		return Operand{ false, stack.size() };
+	};
+
+	auto pop = [&stack]() {
+		Operand operand = stack.back();
+		stack.pop_back();
+		return operand;
+	};
+
+	const Operand none{ false, 0 };
+
+	const byte* code = getStart();
+	size_t offset = 0;
+
+	// Global slots aren't in the frame, they are kept as they are like register numbers.
+	size_t globalCount = 0;
+	auto slot = [&]() {
+		const byte* operand = &code[offset];
+		size_t index = readGlobalSlot(operand);
+		offset = operand - code;
+		globalCount = std::max(globalCount, index + 1);
+		return Operand{ false, index };
+	};
+
+	while (offset < codeSize()) {
+		size_t origin = offset;
+		OpCode op = static_cast<OpCode>(code[offset++]);
+
+		switch (op) {
+		case OpCode::IntLiteral:
+		case OpCode::FloatLiteral:
+		case OpCode::CharLiteral:
+		case OpCode::StringLiteral:
+		{
+			const byte* operand = &code[offset];
+			stack.push_back(Operand{ true, readConstantIndex(operand) });
+			offset = operand - code;
+			break;
+		}
+		case OpCode::TrueLiteral: stack.push_back(constant(Value(true))); break;
+		case OpCode::FalseLiteral: stack.push_back(constant(Value(false))); break;
+		case OpCode::Null: stack.push_back(constant(Value())); break;
+		case OpCode::VarDeclar:
+		{
+			byte type = code[offset++];
+			pending.push_back({ op, type, slot(), none, none, origin });
+			break;
+		}
+		case OpCode::VarAssign:
+		case OpCode::VarDeclarAndAssign:
+		{
+			if (stack.empty()) return false;
+			pending.push_back({ op, 0, slot(), stack.back(), none, origin });
+			// The assigned value stays where it is as the result of an assignment expression.
+			if (op == OpCode::VarDeclarAndAssign) stack.pop_back();
+			break;
+		}
+		case OpCode::Pop:
+			if (stack.empty()) return false;
+			stack.pop_back();
+			break;
+		case OpCode::PopN:
+		{
+			byte count = code[offset++];
+			if (stack.size() < count) return false;
+			stack.resize(stack.size() - count);
+			break;
+		}
+		case OpCode::LocalDeclar:
+		{
+			byte type = code[offset++];
+			Operand result = destination();
+			pending.push_back({ op, type, result, none, none, origin });
+			stack.push_back(result);
+			break;
+		}
+		case OpCode::GetLocal:
+		{
+			// The local is copied, so the copy isn't changed by a later assignment to the local.
+			byte local = code[offset++];
+			if (local >= stack.size()) return false;
+			Operand result = destination();
+			pending.push_back({ op, 0, result, stack[local], none, origin });
+			stack.push_back(result);
+			break;
+		}
+		case OpCode::SetLocal:
+		{
+			byte local = code[offset++];
+			if (stack.empty() || local >= stack.size()) return false;
+			// A local initialized with a constant only gets its register once it is assigned.
+			Operand slotRegister{ false, local };
+			registerCount = std::max(registerCount, static_cast<size_t>(local) + 1);
+			pending.push_back({ op, 0, slotRegister, stack.back(), none, origin });
+			stack[local] = slotRegister;
+			break;
+		}
+		case OpCode::Var:
+		{
+			Operand global = slot();
+			Operand result = destination();
+			pending.push_back({ op, 0, result, global, none, origin });
+			stack.push_back(result);
+			break;
+		}
+		case OpCode::Not:
+		case OpCode::Negate:
+		{
+			if (stack.empty()) return false;
+			Operand operand = pop();
+			Operand result = destination();
+			pending.push_back({ op, 0, result, operand, none, origin });
+			stack.push_back(result);
+			break;
+		}
+		case OpCode::I32ToI64:
+		case OpCode::I32ToF32:
+		case OpCode::I32ToF64:
+		case OpCode::I64ToF32:
+		case OpCode::I64ToF64:
+		case OpCode::F32ToF64:
+		case OpCode::Convert:
+		{
+			byte operand = code[offset++];
+			size_t distance = op == OpCode::Convert ? 0 : operand;
+			if (distance >= stack.size()) return false;
+
+			Operand& target = stack[stack.size() - 1 - distance];
+			ValueType type = op == OpCode::Convert ? static_cast<ValueType>(operand) : widenedType(op);
+
+			if (target.isConstant) {
+				// Constants are converted once here instead of every time the code runs.
+				Value converted(type);
+				converted.Assign(constants[target.index]);
+				target = constant(std::move(converted));
+			} else {
+				pending.push_back({ op, static_cast<byte>(type), target, none, none, origin });
+			}
+			break;
+		}
+		case OpCode::Return:
+			pending.push_back({ op, 0, none, none, none, origin });
+			break;
+		default:
+			if ((op >= OpCode::Equal && op <= OpCode::Concatenate) || (op >= OpCode::EqualI32 && op <= OpCode::DivideF64)) {
+				if (stack.size() < 2) return false;
+				Operand rhs = pop();
+				Operand lhs = pop();
+				Operand result = destination();
+				pending.push_back({ op, 0, result, lhs, rhs, origin });
+				stack.push_back(result);
+				break;
+			}
+
+			return false;
+		}
+	}
+
+	if (registerCount + constants.size() > std::numeric_limits<uint16_t>::max()) return false;
+	if (globalCount > std::numeric_limits<uint16_t>::max() + size_t(1)) return false;
+
+	auto place = [registerCount](const Operand& operand) {
+		return static_cast<uint16_t>(operand.isConstant ? registerCount + operand.index : operand.index);
+	};
+
+	auto registers = std::make_unique<RegisterCode>();
+	registers->registerCount = registerCount;
+	registers->frame.resize(registerCount);
+	for (Value& value : constants) {
+		registers->frame.push_back(std::move(value));
+	}
+
+	registers->code.reserve(pending.size());
+	registers->origins.reserve(pending.size());
+	for (const PendingInstruction& instruction : pending) {
+		registers->code.push_back({ instruction.op, instruction.type, place(instruction.a), place(instruction.b), place(instruction.c) });
+		registers->origins.push_back(instruction.origin);
+	}
+
+	m_RegisterCode = std::move(registers);
+	return true;
+}
@@ -1,32 +1,218 @@
 #include "stdafx.h"
 #include "Scanner.h"
 
-Scanner::Scanner(const std::string& source) : m_Source(source) {
+#include <cassert>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <thread>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SCANNER_SSE2
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace {
+	//! A keyword and the type of token it is scanned as.
+	struct Keyword {
+		std::string_view text;
+		TokenType type = TokenType::Identifier;
+	};
+
+	constexpr Keyword KEYWORDS[] = {
+		{ "bool", TokenType::DecBool }, { "char", TokenType::DecChar }, { "class", TokenType::Class },
+		{ "double", TokenType::DecDouble }, { "else", TokenType::Else }, { "false", TokenType::False },
+		{ "float", TokenType::DecFloat }, { "for", TokenType::For }, { "if", TokenType::If },
+		{ "int", TokenType::DecInt32 }, { "int8", TokenType::DecInt8 }, { "int16", TokenType::DecInt16 },
+		{ "int32", TokenType::DecInt32 }, { "int64", TokenType::DecInt64 }, { "return", TokenType::Return },
+		{ "string", TokenType::DecString }, { "super", TokenType::Super }, { "this", TokenType::This },
+		{ "true", TokenType::True }, { "var", TokenType::Var }, { "while", TokenType::While },
+	};
+
+	constexpr size_t KEYWORD_TABLE_SIZE = 64;
+
+	//! \return Slot of word in the keyword table. Only needs to tell the keywords apart.
+	constexpr size_t keywordHash(std::string_view word) {
+		return (static_cast<uint8_t>(word.front()) + 3 * static_cast<uint8_t>(word.back()) + word.size()) % KEYWORD_TABLE_SIZE;
+	}
+
+	constexpr std::array<Keyword, KEYWORD_TABLE_SIZE> makeKeywordTable() {
+		std::array<Keyword, KEYWORD_TABLE_SIZE> table{};
+		for (const Keyword& keyword : KEYWORDS) {
+			table[keywordHash(keyword.text)] = keyword;
+		}
+		return table;
+	}
+
+	constexpr std::array<Keyword, KEYWORD_TABLE_SIZE> KEYWORD_TABLE = makeKeywordTable();
+
+	//! \return If every keyword got its own slot in KEYWORD_TABLE.
+	constexpr bool keywordHashIsPerfect() {
+		for (const Keyword& keyword : KEYWORDS) {
+			if (KEYWORD_TABLE[keywordHash(keyword.text)].text != keyword.text) return false;
+		}
+		return true;
+	}
+
+	static_assert(keywordHashIsPerfect(), "Two keywords share a slot, change keywordHash().");
+
+#if defined(__AVX2__) || defined(SCANNER_SSE2)
+	//!@{ Operations on a block of characters, tested all at once.
+#ifdef __AVX2__
+	using Block = __m256i;
+	constexpr ptrdiff_t BLOCK_SIZE = 32;
+	constexpr uint32_t FULL_MASK = 0xFFFFFFFF;
+	inline Block loadBlock(const char* chars) { return _mm256_loadu_si256(reinterpret_cast<const Block*>(chars)); }
+	inline Block splat(char c) { return _mm256_set1_epi8(c); }
+	inline Block equal(Block block, char c) { return _mm256_cmpeq_epi8(block, splat(c)); }
+	inline Block greater(Block lhs, Block rhs) { return _mm256_cmpgt_epi8(lhs, rhs); }
+	inline Block both(Block lhs, Block rhs) { return _mm256_and_si256(lhs, rhs); }
+	inline Block either(Block lhs, Block rhs) { return _mm256_or_si256(lhs, rhs); }
+	inline uint32_t bitMask(Block block) { return static_cast<uint32_t>(_mm256_movemask_epi8(block)); }
+#else
+	using Block = __m128i;
+	constexpr ptrdiff_t BLOCK_SIZE = 16;
+	constexpr uint32_t FULL_MASK = 0xFFFF;
+	inline Block loadBlock(const char* chars) { return _mm_loadu_si128(reinterpret_cast<const Block*>(chars)); }
+	inline Block splat(char c) { return _mm_set1_epi8(c); }
+	inline Block equal(Block block, char c) { return _mm_cmpeq_epi8(block, splat(c)); }
+	inline Block greater(Block lhs, Block rhs) { return _mm_cmpgt_epi8(lhs, rhs); }
+	inline Block both(Block lhs, Block rhs) { return _mm_and_si128(lhs, rhs); }
+	inline Block either(Block lhs, Block rhs) { return _mm_or_si128(lhs, rhs); }
+	inline uint32_t bitMask(Block block) { return static_cast<uint32_t>(_mm_movemask_epi8(block)); }
+#endif
+
+	//! Compares as signed bytes, so characters above 127 are never in an ASCII range.
+	inline Block inRange(Block block, char low, char high) {
+		return both(greater(block, splat(low - 1)), greater(splat(high + 1), block));
+	}
+	//!@}
+
+	//! Number of characters of a run tested one at a time before testing blocks.
+	constexpr ptrdiff_t SHORT_RUN = 8;
+
+	//! \return Index of the lowest bit set in mask, which can't be 0.
+	inline int lowestBit(uint32_t mask) {
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward(&index, mask);
+		return static_cast<int>(index);
+#else
+		return __builtin_ctz(mask);
+#endif
+	}
+#endif
+
+	//! Finds the first character that ends a run.
+	/*!
+	  Most runs are short, so the first few characters are tested one at a time. Past them, whole
+	  blocks of characters are tested at once while there is a block left, and the rest is tested
+	  one character at a time.
+	  \param current First character of the run.
+	  \param end End of the source.
+	  \param blockStops Given a Block, returns a mask of the characters that end the run.
+	  \param stops Returns if a character ends the run.
+	  \return The first character ending the run, or end.
+	*/
+	template<typename BlockStops, typename Stops>
+	inline const char* findRunEnd(const char* current, const char* end, BlockStops blockStops, Stops stops) {
+#if defined(__AVX2__) || defined(SCANNER_SSE2)
+		for (const char* probeEnd = current + std::min<ptrdiff_t>(end - current, SHORT_RUN); current != probeEnd; current++) {
+			if (stops(*current)) return current;
+		}
+
+		while (end - current >= BLOCK_SIZE) {
+			uint32_t mask = blockStops(loadBlock(current));
+			if (mask) return current + lowestBit(mask);
+			current += BLOCK_SIZE;
+		}
+#else
+		(void)blockStops;
+#endif
+		while (current != end && !stops(*current)) current++;
+		return current;
+	}
+
+#if defined(__AVX2__) || defined(SCANNER_SSE2)
+#define BLOCK_STOPS(block, mask) [](Block block) { return mask; }
+#else
+#define BLOCK_STOPS(block, mask) nullptr
+#endif
+}
+
+const std::array<uint8_t, 256> Scanner::m_CharacterClasses = [] {
+	std::array<uint8_t, 256> classes{};
+	for (int c = '0'; c <= '9'; c++) classes[c] |= Digit;
+	for (int c = 'a'; c <= 'z'; c++) classes[c] |= Alpha;
+	for (int c = 'A'; c <= 'Z'; c++) classes[c] |= Alpha;
+	classes['_'] |= Alpha;
+	classes[' '] |= Blank;
+	classes['\t'] |= Blank;
+	classes['\r'] |= Blank;
+	return classes;
+}();
+
+void TokenList::Add(const Token& token) {
+	m_Types.push_back(token.type);
+	m_Lines.push_back(token.line);
+	m_Lengths.push_back(static_cast<uint32_t>(token.lexeme.size()));
+
+	if (token.type == TokenType::Error) {
+		m_Offsets.push_back(static_cast<uint32_t>(m_Errors.size()));
+		m_Errors.push_back(token.lexeme);
+	} else {
+		assert(token.lexeme.data() >= m_Source.data() && token.lexeme.data() <= m_Source.data() + m_Source.size());
+		m_Offsets.push_back(static_cast<uint32_t>(token.lexeme.data() - m_Source.data()));
+	}
+}
+
+void TokenList::Append(const TokenList& tokens, size_t first, int lineOffset) {
+	assert(tokens.m_Source.data() == m_Source.data());
+
+	for (size_t index = first; index < tokens.Size(); index++) {
+		m_Types.push_back(tokens.m_Types[index]);
+		m_Lines.push_back(tokens.m_Lines[index] + lineOffset);
+		m_Lengths.push_back(tokens.m_Lengths[index]);
+
+		if (tokens.m_Types[index] == TokenType::Error) {
+			m_Offsets.push_back(static_cast<uint32_t>(m_Errors.size()));
+			m_Errors.push_back(tokens.m_Errors[tokens.m_Offsets[index]]);
+		} else {
+			m_Offsets.push_back(tokens.m_Offsets[index]);
+		}
+	}
+}
+
+Scanner::Scanner(std::string_view source) : m_Source(source) {
+	assert(source.size() <= std::numeric_limits<uint32_t>::max());
 	m_Line = 1;
-	m_CurrentChar = m_Source.begin();
+	m_TokenStart = m_Source.data();
+	m_CurrentChar = m_Source.data();
 }
 
 Token Scanner::ScanToken() {
 	// Whitespace is ignored by the compiler
 	skipWhitespace();
 
-	// Reset the current token
-	m_CurrentToken.str(std::string());
+	// The new token starts here
+	m_TokenStart = m_CurrentChar;
 	
 	// Check if at the end of the file.
-	if (isAtEnd()) {
-		m_CurrentToken << "\0";
-		return makeToken(TokenType::EoF);
-	}
+	if (isAtEnd()) return makeToken(TokenType::EoF);
 
 	// Feed the next character into the scanner
 	char c = advance();
-	m_CurrentToken << c;
 
 	// If the character is a number, return either a float or int
-	if (isdigit(c)) return number();
+	if (isDigit(c)) return number();
 	// If the character is a letter, find out if the token is a keyword or return an "Identifier"
-	if (isalpha(c)) return identifier();
+	if (isAlpha(c)) return identifier();
 
 	switch (c) {
 	case '(': return makeToken(TokenType::LeftParen);
@@ -53,18 +239,102 @@ Token Scanner::ScanToken() {
 	return errorToken("Unexpected character.");
 }
 
-std::vector<Token> Scanner::ScanAllTokens() {
-	std::vector<Token> tokens;
+TokenList Scanner::ScanAllTokens() {
+	TokenList tokens(m_Source);
 	
-	while (!isAtEnd()) {
-		Token token = ScanToken();
-		tokens.push_back(token);
+	Token token;
+	do {
+		token = ScanToken();
+		tokens.Add(token);
+	} while (token.type != TokenType::EoF);
+
+	return tokens;
+}
+
+TokenList Scanner::ScanAllTokensParallel(std::string_view source, unsigned threadCount) {
+	if (threadCount == 0) threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+	size_t pieceCount = std::min<size_t>(threadCount, source.size() / PARALLEL_SCAN_MIN_PIECE);
+	if (pieceCount <= 1) return Scanner(source).ScanAllTokens();
+
+	// Cut the source at the start of the line after an even split.
+	const char* begin = source.data();
+	const char* end = source.data() + source.size();
+	std::vector<const char*> bounds = { begin };
+	for (size_t piece = 1; piece < pieceCount; piece++) {
+		const char* target = std::max(begin + source.size() / pieceCount * piece, bounds.back());
+		const char* lineBreak = static_cast<const char*>(std::memchr(target, '\n', end - target));
+		if (lineBreak == nullptr || lineBreak + 1 == end) break;
+		bounds.push_back(lineBreak + 1);
+	}
+	bounds.push_back(end);
+
+	std::vector<Piece> pieces(bounds.size() - 1, Piece(source));
+	auto scan = [&](size_t piece) {
+		Scanner scanner(source);
+		scanner.m_CurrentChar = bounds[piece];
+		scanner.scanPiece(pieces[piece], bounds[piece + 1]);
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t piece = 1; piece < pieces.size(); piece++) {
+		threads.emplace_back(scan, piece);
+	}
+	scan(0);
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+
+	// The first piece starts at the start of the source, its tokens are always right.
+	TokenList tokens(source);
+	tokens.Append(pieces[0].tokens, 0, 0);
+
+	Scanner scanner(source);
+	scanner.m_CurrentChar = pieces[0].exit;
+	scanner.m_Line = pieces[0].exitLine;
+
+	size_t piece = 1;
+	while (tokens.Size() == 0 || tokens.Type(tokens.Size() - 1) != TokenType::EoF) {
+		while (piece + 1 < pieces.size() && scanner.m_CurrentChar >= bounds[piece + 1]) piece++;
+
+		// Tokens only depend on where they start, once a piece has a token starting where the
+		// scanner is, the rest of the piece is what the scanner would find, lines aside.
+		const std::vector<uint32_t>& starts = pieces[piece].starts;
+		uint32_t offset = static_cast<uint32_t>(scanner.m_CurrentChar - begin);
+		auto start = std::lower_bound(starts.begin(), starts.end(), offset);
+
+		if (start != starts.end() && *start == offset) {
+			size_t first = start - starts.begin();
+			int lineOffset = scanner.m_Line - pieces[piece].startLines[first];
+			tokens.Append(pieces[piece].tokens, first, lineOffset);
+			scanner.m_CurrentChar = pieces[piece].exit;
+			scanner.m_Line = pieces[piece].exitLine + lineOffset;
+		} else {
+			tokens.Add(scanner.ScanToken());
+			scanner.skipWhitespace();
+		}
 	}
 
-	tokens.push_back(ScanToken());
 	return tokens;
 }
 
+void Scanner::scanPiece(Piece& piece, const char* end) {
+	while (true) {
+		skipWhitespace();
+		// The last piece goes on to the EoF token.
+		if (m_CurrentChar >= end && end != sourceEnd()) break;
+
+		piece.starts.push_back(static_cast<uint32_t>(m_CurrentChar - m_Source.data()));
+		piece.startLines.push_back(m_Line);
+		Token token = ScanToken();
+		piece.tokens.Add(token);
+		if (token.type == TokenType::EoF) break;
+	}
+
+	piece.exit = m_CurrentChar;
+	piece.exitLine = m_Line;
+}
+
 void Scanner::skipWhitespace() {
 	while (true) {
 		char c = peek();
@@ -72,7 +342,9 @@ void Scanner::skipWhitespace() {
 		case ' ':
 		case '\r':
 		case '\t':
-			advance();
+			m_CurrentChar = findRunEnd(m_CurrentChar, sourceEnd(),
+				BLOCK_STOPS(block, ~bitMask(either(either(equal(block, ' '), equal(block, '\t')), equal(block, '\r'))) & FULL_MASK),
+				[this](char c) { return !isBlank(c); });
 			break;
 
 		case '\n':
@@ -84,7 +356,9 @@ void Scanner::skipWhitespace() {
 			// Comments begin with a "//" and end with a linebreak.
 			// Comments aren't technically whitespace, but the scanner should treat them the same way.
 			if (peekNext() == '/') {
-				while (peek() != '\n' && !isAtEnd()) advance();
+				m_CurrentChar = findRunEnd(m_CurrentChar, sourceEnd(),
+					BLOCK_STOPS(block, bitMask(equal(block, '\n'))),
+					[](char c) { return c == '\n'; });
 			} else {
 				return;
 			}
@@ -102,14 +376,15 @@ bool Scanner::match(char expected) {
 	if (expected != *m_CurrentChar) return false;
 
 	m_CurrentChar++;
-	m_CurrentToken << *m_CurrentChar;
 	return true;
 }
 
 Token Scanner::character() {
 	// Handle escape/control character
+	if (isAtEnd()) return errorToken("Unterminated char literal.");
+
 	if (peek() == '\\') {
-		m_CurrentToken << advance();
+		advance();
 		switch (peek()) {
 		case '\\':
 		case 'n':
@@ -117,26 +392,30 @@ Token Scanner::character() {
 		case '0':
 		case '\'':
 		case '\"':
-			m_CurrentToken << advance(); break;
+			advance(); break;
 		default: return errorToken("Invalid escape character.");
 		}
-	} else m_CurrentToken << advance();
+	} else advance();
 
 	if (isAtEnd() || peek() != '\'') return errorToken("Unterminated char literal.");
 
-	m_CurrentToken << advance();
+	advance();
 	return makeToken(TokenType::Character);
 }
 
 Token Scanner::string() {
-	while (peek() != '"' && !isAtEnd()) {
-		if (peek() == '\n') m_Line++;
-		m_CurrentToken << advance();
+	while (true) {
+		m_CurrentChar = findRunEnd(m_CurrentChar, sourceEnd(),
+			BLOCK_STOPS(block, bitMask(either(equal(block, '"'), equal(block, '\n')))),
+			[](char c) { return c == '"' || c == '\n'; });
+		if (peek() != '\n') break;
+		m_Line++;
+		advance();
 	}
 
 	if (isAtEnd()) return errorToken("Unterminated string.");
 
-	m_CurrentToken << advance();
+	advance();
 	return makeToken(TokenType::String);
 }
 
@@ -145,16 +424,16 @@ Token Scanner::number() {
 
 	// While the next character is a number, add it to the token.
 	while (isDigit(peek())) {
-		m_CurrentToken << advance();
+		advance();
 	}
 
 	// If theres's a decimal, consume and make the type a float
 	if (peek() == '.') {
 		type = TokenType::Float;
-		m_CurrentToken << advance();
+		advance();
 
 		// Continue eating more numbers
-		while (isdigit(peek())) m_CurrentToken << advance();
+		while (isDigit(peek())) advance();
 	}
 
 	return makeToken(type);
@@ -162,84 +441,27 @@ Token Scanner::number() {
 
 Token Scanner::identifier() {
 	// Identifiers are to be made with Alphanumerical values or a "_"
-	while (isAlpha(peek()) || isDigit(peek()))
-		m_CurrentToken << advance();
+	m_CurrentChar = findRunEnd(m_CurrentChar, sourceEnd(),
+		BLOCK_STOPS(block, ~bitMask(either(either(inRange(either(block, splat(0x20)), 'a', 'z'), inRange(block, '0', '9')), equal(block, '_'))) & FULL_MASK),
+		[this](char c) { return !isAlpha(c) && !isDigit(c); });
 
 	return makeToken(identifierType());
 }
 
-TokenType Scanner::identifierType() {
-	const std::string token = m_CurrentToken.str();
-	
-	switch (token[0]) {
-	case 'b': return checkKeyword(token, "bool", TokenType::DecBool);
-	case 'c': 
-		if (token.length() > 1) {
-			switch (token[1]) {
-			case 'h': return checkKeyword(token, "char", TokenType::DecChar);
-			case 'l': return checkKeyword(token, "class", TokenType::Class);
-			}
-		}
-		break;
-	case 'd': return checkKeyword(token, "double", TokenType::DecDouble);
-	case 'e': return checkKeyword(token, "else", TokenType::Else);
-	case 'f':
-		if (token.length() > 1) {
-			switch (token[1]) {
-			case 'a': return checkKeyword(token, "false", TokenType::False);
-			case 'l': return checkKeyword(token, "float", TokenType::DecFloat);
-			case 'o': return checkKeyword(token, "for", TokenType::For);
-			}
-		}
-		break;
-	case 'i': 
-		if (token.length() > 1) {
-			switch (token[1]) {
-			case 'f': return checkKeyword(token, "if", TokenType::If);
-			case 'n':
-				if (token.length() == 3) return checkKeyword(token, "int", TokenType::DecInt32);
-				else if (token.length() == 4) return checkKeyword(token, "int8", TokenType::DecInt8);
-				else if (token.length() == 5) {
-					switch (token[3]) {
-					case '1': return checkKeyword(token, "int16", TokenType::DecInt16);
-					case '3': return checkKeyword(token, "int32", TokenType::DecInt32);
-					case '6': return checkKeyword(token, "int64", TokenType::DecInt64);
-					}
-				}
-			}
-		}
-		break;
-	case 'r': return checkKeyword(token, "return", TokenType::Return);
-	case 's':
-		if (token.length() > 1) {
-			switch (token[1]) {
-			case 't': return checkKeyword(token, "string", TokenType::DecString);
-			case 'u': return checkKeyword(token, "super", TokenType::Super);
-			}
-		}
-		break;
-	case 't':
-		if (token.length() > 1) {
-			switch (token[1]) {
-			case 'h': return checkKeyword(token, "this", TokenType::This);
-			case 'r': return checkKeyword(token, "true", TokenType::True);
-			}
-		}
-		break;
-	case 'v': return checkKeyword(token, "var", TokenType::Var);
-	case 'w': return checkKeyword(token, "while", TokenType::While);
-	}
+TokenType Scanner::identifierType() const {
+	const std::string_view token(m_TokenStart, m_CurrentChar - m_TokenStart);
 
-	// If none of the keywords match, return Identifier
-	return TokenType::Identifier;
+	// Only the keyword in the slot of the token can match it.
+	const Keyword& keyword = KEYWORD_TABLE[keywordHash(token)];
+	return keyword.text == token ? keyword.type : TokenType::Identifier;
 }
 
-Token Scanner::makeToken(TokenType type) {
-	Token token(type, m_CurrentToken.str(), m_Line);
+Token Scanner::makeToken(TokenType type) const {
+	Token token(type, std::string_view(m_TokenStart, m_CurrentChar - m_TokenStart), m_Line);
 	return token;
 }
 
-Token Scanner::errorToken(const std::string& message) {
+Token Scanner::errorToken(const char* message) const {
 	Token token(TokenType::Error, message, m_Line);
 	return token;
 }
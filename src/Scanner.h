@@ -2,8 +2,16 @@
 //! \brief Details the tokens and tokenizer of the program.
 #pragma once
 
+#include <array>
 #include <string>
-#include <sstream>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+#ifndef PARALLEL_SCAN_MIN_PIECE
+//! Sources smaller than this are never scanned in parallel, a piece is at least this long.
+#define PARALLEL_SCAN_MIN_PIECE (1 << 20)
+#endif
 
 
 //! An enumeration of all the different types of token to be scanned from the source code
@@ -67,39 +75,99 @@ enum class TokenType {
 
 
 //! A struct representing a token giving by the compiler
-
+/*!
+  Tokens don't own their lexeme, it is a view of the source code they were scanned from, so
+  the source has to outlive them. Error tokens view a static message instead.
+*/
 struct Token {
 	TokenType type; //!< The type of token found
-	std::string lexeme; //!< The string that produced the token.
+	std::string_view lexeme; //!< The string that produced the token.
 	int line; //!< The line the token was found on.
 
-	Token() : type(TokenType::EoF), lexeme(""), line(0) {}
+	Token() : type(TokenType::EoF), lexeme(), line(0) {}
 
 	//! Full constructor
-	Token(TokenType type, const std::string& lexeme, int line) : type(type), lexeme(lexeme), line(line) {}
+	Token(TokenType type, std::string_view lexeme, int line) : type(type), lexeme(lexeme), line(line) {}
 
 	//! The total amount of token types that can be scanned.
 	static const int NUMBER_OF_TOKENS = static_cast<int>(TokenType::EoF) + 1;
 };
 
+//! Every token of a source, stored as parallel arrays.
+/*!
+  Instead of an array of Tokens, the types, offsets in the source, lengths and lines of the
+  tokens are kept in their own arrays. Code that only looks at the types of the tokens walks a
+  dense array of bytes, and no lexeme is copied: Lexeme() is a view of the source.
+  Error tokens don't come from the source, their offset is an index in the error messages.
+*/
+class TokenList {
+	std::string_view m_Source; //!< Source the tokens were scanned from.
+	std::vector<TokenType> m_Types; //!< Type of each token.
+	std::vector<uint32_t> m_Offsets; //!< Offset of the lexeme of each token in m_Source, or index in m_Errors for error tokens.
+	std::vector<uint32_t> m_Lengths; //!< Length of the lexeme of each token.
+	std::vector<int> m_Lines; //!< Line of each token.
+	std::vector<std::string_view> m_Errors; //!< Messages of the error tokens.
+
+public:
+	//! Creates an empty list of the tokens of source.
+	explicit TokenList(std::string_view source) : m_Source(source) {}
+
+	//! Appends a token scanned from the source of the list.
+	void Add(const Token& token);
+
+	//! Appends tokens of another list of the same source.
+	/*!
+	  \param tokens List to copy tokens from.
+	  \param first Index in tokens of the first token to append, every token after it is appended too.
+	  \param lineOffset Added to the lines of the appended tokens.
+	*/
+	void Append(const TokenList& tokens, size_t first, int lineOffset);
+
+	//! \return Number of tokens in the list.
+	size_t Size() const { return m_Types.size(); }
+
+	//!@{ \name Getters
+	//! Gets a member of the token at index.
+	TokenType Type(size_t index) const { return m_Types[index]; }
+	int Line(size_t index) const { return m_Lines[index]; }
+	std::string_view Lexeme(size_t index) const {
+		return m_Types[index] == TokenType::Error ? m_Errors[m_Offsets[index]] : m_Source.substr(m_Offsets[index], m_Lengths[index]);
+	}
+	//!@}
+
+	//! \return The token at index.
+	Token At(size_t index) const { return Token(Type(index), Lexeme(index), Line(index)); }
+};
+
 //! A class to scan through the source code and tokenize it.
 /*!
   The scanner class is initilized with a string containing the code to be tokenize. After initilization,
   ScanToken can be called to recieve each token in order of occurance, one at a time. When the scanner reaches
   the end of the file, ScanToken will continue to produce an EoF token each time it's called.
+
+  The source isn't copied, and tokens refer to it, so it has to outlive the scanner and its tokens.
 */
 
 class Scanner {
-	const std::string m_Source; //!< A string containing the source code to be tokenized.
+	//! Flags of m_CharacterClasses.
+	enum CharacterClass : uint8_t {
+		Digit = 1 << 0, //!< '0' to '9'.
+		Alpha = 1 << 1, //!< Letters and underscore, the characters an identifier can start with.
+		Blank = 1 << 2, //!< Whitespace that isn't a line break.
+	};
+
+	static const std::array<uint8_t, 256> m_CharacterClasses; //!< CharacterClass flags of every character.
+
+	std::string_view m_Source; //!< The source code to be tokenized.
 	int m_Line; //!< The current line of the source code the Scanner is tokenizing.
-	std::string::const_iterator m_CurrentChar; //!< The current character being looked at by the Scanner.
-	std::stringstream m_CurrentToken; //!< A stringstream to store each character of the current token as the Scanner reconizes it.
+	const char* m_TokenStart; //!< The first character of the current token.
+	const char* m_CurrentChar; //!< The current character being looked at by the Scanner.
 
 public:
 	Scanner() = delete;
 
 	//! Initilizes the scanner with the source code provided.
-	Scanner(const std::string& source);
+	Scanner(std::string_view source);
 	
 	//! Retrieve the next token.
 	/*!
@@ -111,11 +179,42 @@ public:
 	//! Retrieve all tokens.
 	/*!
 	  Run throught the source until it reaches the End of File, and token the entire thing.
-	  \return A list of every token in the source file.
+	  \return A list of every token in the source file, the final EoF included.
 	*/
-	std::vector<Token> ScanAllTokens();
+	TokenList ScanAllTokens();
+
+	//! Tokenize a whole source on several threads.
+	/*!
+	  The source is cut into pieces at the start of lines, and every piece is scanned on its own
+	  thread. A piece can start in the middle of a token, such as a string going over several
+	  lines, so the pieces are stitched back together by a scanner going through the source in
+	  order: it takes the tokens of a piece from the first one starting where the scanner is,
+	  and scans tokens itself until it finds one.
+	  \param source The source code to be tokenized. Tokens refer to it, so it has to outlive them.
+	  \param threadCount Number of threads to scan with, 0 for one per hardware thread.
+	  \return The same list as ScanAllTokens() on a new Scanner of source.
+	*/
+	static TokenList ScanAllTokensParallel(std::string_view source, unsigned threadCount = 0);
 
 private:
+	//! Tokens scanned by one thread of ScanAllTokensParallel().
+	struct Piece {
+		TokenList tokens; //!< Tokens starting in the piece, their lines counted from the start of the piece.
+		std::vector<uint32_t> starts; //!< Offset in the source of each token, error tokens included.
+		std::vector<int> startLines; //!< Line at the start of each token. A token has the line it ends on.
+		const char* exit = nullptr; //!< Where the first token after the piece starts.
+		int exitLine = 0; //!< Line at exit, counted from the start of the piece.
+
+		explicit Piece(std::string_view source) : tokens(source) {}
+	};
+
+	//! Scans the tokens starting before end.
+	/*!
+	  \param [out] piece Gets the tokens and where the scanner stopped.
+	  \param end End of the piece. The last token can go past it.
+	*/
+	void scanPiece(Piece& piece, const char* end);
+
 	//! Move the Scanner forward by one character
 	/*!
 	  \return The next character of the sequence.
@@ -128,7 +227,10 @@ private:
 	/*!
 	  \return Returns true if the Scanner has scanned the entire file, else
 	*/
-	bool isAtEnd() const { return m_CurrentChar == m_Source.end(); }
+	bool isAtEnd() const { return m_CurrentChar == sourceEnd(); }
+
+	//! \return A pointer one past the last character of the source.
+	const char* sourceEnd() const { return m_Source.data() + m_Source.size(); }
 
 	//!@{ \name CheckFunctions
 
@@ -150,7 +252,7 @@ private:
 	/*!
 	  \return The char two ahead of the Scanner from the source code, without it being added into the current token.
 	*/
-	char peekNext() const { return *(m_CurrentChar + 1); }
+	char peekNext() const { return isAtEnd() || m_CurrentChar + 1 == sourceEnd() ? '\0' : *(m_CurrentChar + 1); }
 	//!@}
 
 	//!@{ \name Literals
@@ -181,19 +283,11 @@ private:
 	//!@{ \name Identifiers
 
 	//! Checks if the current token matches with an keyword.
-	/*!
+	/*! The keywords are stored in a table indexed by a perfect hash of their first and last
+		characters and length, so only one keyword is ever compared with the token.
 	  \return The TokenType of a keyword if the current token matches one, or the Identifier TokenType
 	*/
-	TokenType identifierType();
-
-	//! Checks the current token against a specific keywork.
-	/*! A helper function to identifierType(), this function checks a token against a provided keyword and returns the appropriate TokenType
-	  \param token Token currently being scanned.
-	  \param keyword Keyword to match against the current token
-	  \param type The TokenType of keyword
-	  \return The TokenType provided if the token and keyword match, else TokenType::Identifier
-	*/
-	TokenType checkKeyword(const std::string& token, const std::string& keyword, TokenType type) const { return token.compare(keyword) == 0 ? type : TokenType::Identifier; }
+	TokenType identifierType() const;
 	//!@}
 
 	//!@{ \name UtilityFunctions
@@ -203,18 +297,21 @@ private:
 	  \param c Character to check.
 	  \return Returns true if c is a digit, else false.
 	*/
-	inline bool isDigit(char c) const { return c >= '0' && c <= '9'; }
+	inline bool isDigit(char c) const { return m_CharacterClasses[static_cast<uint8_t>(c)] & Digit; }
 
 	//! Check if the character is a alphabet or underscore character
 	/*!
 	  \param c Character to check.
 	  \return Returns true if c is a alphabet or underscore character, else false.
 	*/
-	inline bool isAlpha(char c) const {
-		return (c >= 'a' && c <= 'z') ||
-			(c >= 'A' && c <= 'Z') ||
-			c == '_';
-	}
+	inline bool isAlpha(char c) const { return m_CharacterClasses[static_cast<uint8_t>(c)] & Alpha; }
+
+	//! Check if the character is whitespace other than a line break
+	/*!
+	  \param c Character to check.
+	  \return Returns true if c is a space, tab or carriage return, else false.
+	*/
+	inline bool isBlank(char c) const { return m_CharacterClasses[static_cast<uint8_t>(c)] & Blank; }
 	//!@}
 
 	//!@{ \name Tokens
@@ -222,16 +319,16 @@ private:
 	//! Creates a token of a given type
 	/*! 
 	  \param type The TokenType of the return Token.
-	  \return A Token with the type provided, the lexeme taken from m_CurrentToken, and line number taken from m_Line.
+	  \return A Token with the type provided, the lexeme from m_TokenStart to m_CurrentChar, and line number taken from m_Line.
 	*/
-	Token makeToken(TokenType type);
+	Token makeToken(TokenType type) const;
 
 	//! Creates an error token with a supplied message.
 	/*!
-	 \param message Message to attach to the error.
+	 \param message Message to attach to the error. Must be a string literal, the token only views it.
 	 \return A Token with TokenType::Error, the current line, and the message in place of a lexeme.
 	*/
-	Token errorToken(const std::string& message);
+	Token errorToken(const char* message) const;
 	//!@}
 };
 
@@ -4,141 +4,604 @@
 #include <cstdarg>
 #include <iomanip>
 
+#include "Bytecode.h"
 #include "Compiler.h"
 #include "Debug.h"
 
-VM::VM() {
-	m_Stack.reserve(STACK_MAX);
+VM::VM(size_t stackSize) : m_StackSize(stackSize), m_Stack(std::allocator<Value>().allocate(stackSize)), m_StackTop(m_Stack) {
 }
 
-InterpretResults VM::Interpret(const std::string& source) {
-	static Compiler compiler;
-	m_Chunk = std::make_shared<Chunk>();
+VM::~VM() {
+	resetStack();
+	std::allocator<Value>().deallocate(m_Stack, m_StackSize);
+}
+
+InterpretResults VM::Interpret(std::string_view source, bool cache) {
+	int depth;
+
+	if (const ChunkCache::Entry* cached = cache ? m_Cache.Find(source, m_Compiler.GlobalsVersion()) : nullptr) {
+		m_Chunk = cached->chunk;
+		depth = cached->stackDepth;
+	} else {
+		size_t globalCount = m_Compiler.GlobalCount();
+		m_Chunk = std::make_shared<Chunk>();
+
+		if (!m_Compiler.Compile(source, m_Chunk, m_Strings)) {
+			return InterpretResults::CompileError;
+		}
+
+		depth = m_Chunk->maxStackDepth();
+
+		if (cache && m_Compiler.GlobalCount() == globalCount) {
+			m_Cache.Insert({ std::string(source), m_Chunk, depth, m_Compiler.GlobalsVersion() });
+		}
+	}
+
+	return execute(depth);
+}
 
-	if (!compiler.Compile(source, m_Chunk)) {
+InterpretResults VM::InterpretBytecode(std::shared_ptr<MappedFile> file) {
+	if (m_Compiler.GlobalCount() != 0) {
+		std::cerr << "Bytecode can only be loaded before any global is declared." << std::endl;
 		return InterpretResults::CompileError;
 	}
 
+	// Kept first, the strings interned while loading view the file.
+	m_Files.push_back(file);
+
+	std::vector<BytecodeFile::Global> globals;
+	std::string error;
+	std::shared_ptr<Chunk> chunk = BytecodeFile::Load(file->View(), m_Strings, globals, error);
+	if (!chunk) {
+		std::cerr << error << std::endl;
+		return InterpretResults::CompileError;
+	}
+
+	for (const BytecodeFile::Global& global : globals) {
+		if (m_Compiler.DeclareGlobal(global.name, global.type) < 0) {
+			std::cerr << "Global " << global.name << " declared twice in bytecode file." << std::endl;
+			return InterpretResults::CompileError;
+		}
+	}
+
+	if (m_Compiler.Target() == CompileTarget::Registers) chunk->translateToRegisters();
+
+	m_Chunk = chunk;
+	return execute(m_Chunk->maxStackDepth());
+}
+
+InterpretResults VM::execute(int depth) {
+	// Globals declared by the new code get a slot, the values of the previous ones are kept.
+	m_Globals.resize(m_Compiler.GlobalCount());
+
 	m_IP = m_Chunk->getStart();
 
-	return run();
+	// Checking the depth once here lets the stack be pushed and popped without any check. The
+	// register bytecode doesn't use the stack.
+	if (!m_Chunk->m_RegisterCode) {
+		if (depth < 0) {
+			runtimeError("Stack underflow.");
+			return InterpretResults::RuntimeError;
+		}
+		if (static_cast<size_t>(depth) > m_StackSize) {
+			runtimeError("Stack overflow: the code needs %d values, the stack only holds %zu.", depth, m_StackSize);
+			return InterpretResults::RuntimeError;
+		}
+	}
+
+#ifdef ILIAD_VM_STATISTICS
+	// Only the copies made while running are counted, not those made by the Compiler.
+	size_t copies = valueCopyCount;
+	InterpretResults result = m_Chunk->m_RegisterCode ? runRegisters() : run();
+	m_Statistics.copies += valueCopyCount - copies;
+	return result;
+#else
+	return m_Chunk->m_RegisterCode ? runRegisters() : run();
+#endif
 }
 
 InterpretResults VM::run() {
+	// Writes the result over the lhs operand and drops the rhs, values are never copied.
 #define BINARY_OP(op) do { \
-		Value b = pop(); \
-		Value a = pop(); \
-		Value val(a op b); \
-		push(val); \
+		Value& a = peek(1); \
+		a = Value(a op peek(0)); \
+		drop(); \
 	} while(false)
 
-	while (true) {
+	// Typed operators trust the Compiler about the type of their operands, and write their
+	// result in place without checking the types.
+#define TYPED_BINARY_OP(type, op) do { \
+		Value& a = peek(1); \
+		a.Set<type>(static_cast<NativeType<type>>(a.Get<type>() op peek(0).Get<type>())); \
+		drop(); \
+	} while(false)
+
+	// Integer divisions are checked first, a failing one would crash the process.
+#define TYPED_DIVIDE_OP(type) do { \
+		if (const char* error = divisionError(peek(1).Get<type>(), peek(0).Get<type>())) { \
+			runtimeError("%s", error); \
+			return InterpretResults::RuntimeError; \
+		} \
+		TYPED_BINARY_OP(type, /); \
+	} while(false)
+
+#define TYPED_COMPARISON_OP(type, op) do { \
+		Value& a = peek(1); \
+		a.Set<ValueType::Bool>(a.Get<type>() op peek(0).Get<type>()); \
+		drop(); \
+	} while(false)
+
+#define TYPED_OPS(suffix, type) \
+	TARGET(Equal##suffix) TYPED_COMPARISON_OP(type, ==); DISPATCH(); \
+	TARGET(NotEqual##suffix) TYPED_COMPARISON_OP(type, !=); DISPATCH(); \
+	TARGET(Greater##suffix) TYPED_COMPARISON_OP(type, >); DISPATCH(); \
+	TARGET(GreaterEqual##suffix) TYPED_COMPARISON_OP(type, >=); DISPATCH(); \
+	TARGET(Less##suffix) TYPED_COMPARISON_OP(type, <); DISPATCH(); \
+	TARGET(LessEqual##suffix) TYPED_COMPARISON_OP(type, <=); DISPATCH(); \
+	TARGET(Add##suffix) TYPED_BINARY_OP(type, +); DISPATCH(); \
+	TARGET(Subtract##suffix) TYPED_BINARY_OP(type, -); DISPATCH(); \
+	TARGET(Multiply##suffix) TYPED_BINARY_OP(type, *); DISPATCH(); \
+	TARGET(Divide##suffix) TYPED_DIVIDE_OP(type); DISPATCH();
+
+#define WIDEN(from, to) do { \
+		Value& val = peek(ReadByte()); \
+		val.Set<to>(static_cast<NativeType<to>>(val.Get<from>())); \
+	} while(false)
+
+	// Loads of the superinstructions, with the same checks as Var and GetLocal.
+#define LOAD_GLOBAL(value) \
+	const Value& value = m_Globals[ReadGlobalSlot()]; \
+	if (!value.IsInitilized()) { \
+		runtimeError("Identifier '%s' unitiliazed.", m_Compiler.GlobalName(&value - m_Globals.data()).c_str()); \
+		return InterpretResults::RuntimeError; \
+	}
+
+#define LOAD_LOCAL(value) \
+	const Value& value = m_Stack[ReadByte()]; \
+	if (!value.IsInitilized()) { \
+		runtimeError("Local variable unitiliazed."); \
+		return InterpretResults::RuntimeError; \
+	}
+
+#define LOAD_CONSTANT(value) const Value& value = ReadConstant();
+
+	// Both values are loaded before anything is pushed. Chunk::selectSuperinstructions() never
+	// fuses a load of the slot the first load pushes to.
+#define FUSED_COMPARISON_OP(loads, name, loadA, loadB, op) \
+	TARGET(loads##name##I32) { \
+		loadA(a) loadB(b) \
+		push(Value(a.Get<ValueType::Int32>() op b.Get<ValueType::Int32>())); \
+		DISPATCH(); \
+	}
+
+#define FUSED_BINARY_OP(loads, name, loadA, loadB, op) \
+	TARGET(loads##name##I32) { \
+		loadA(a) loadB(b) \
+		push(Value(static_cast<int32_t>(a.Get<ValueType::Int32>() op b.Get<ValueType::Int32>()))); \
+		DISPATCH(); \
+	}
+
+#define FUSED_OPS(loads, loadA, loadB) \
+	TARGET(loads) { \
+		loadA(a) loadB(b) \
+		push(a); \
+		push(b); \
+		DISPATCH(); \
+	} \
+	FUSED_COMPARISON_OP(loads, Equal, loadA, loadB, ==) \
+	FUSED_COMPARISON_OP(loads, NotEqual, loadA, loadB, !=) \
+	FUSED_COMPARISON_OP(loads, Greater, loadA, loadB, >) \
+	FUSED_COMPARISON_OP(loads, GreaterEqual, loadA, loadB, >=) \
+	FUSED_COMPARISON_OP(loads, Less, loadA, loadB, <) \
+	FUSED_COMPARISON_OP(loads, LessEqual, loadA, loadB, <=) \
+	FUSED_BINARY_OP(loads, Add, loadA, loadB, +) \
+	FUSED_BINARY_OP(loads, Subtract, loadA, loadB, -) \
+	FUSED_BINARY_OP(loads, Multiply, loadA, loadB, *)
+
+	// The distance is always read, so the code goes on after it when the jump isn't taken.
+#define JUMP_IF(condition, distance) do { \
+		size_t length = distance; \
+		if (condition) m_IP += length; \
+	} while(false)
+
+	// Jumps on the bool on top of the stack, the jumps of && and || keep it when they jump.
+#define BOOL_JUMP(name, value, keep) \
+	TARGET(name) { \
+		bool jump = peek(0).Get<ValueType::Bool>() == value; \
+		if (!(keep && jump)) drop(); \
+		JUMP_IF(jump, ReadByte()); \
+		DISPATCH(); \
+	} \
+	TARGET(name##Long) { \
+		bool jump = peek(0).Get<ValueType::Bool>() == value; \
+		if (!(keep && jump)) drop(); \
+		JUMP_IF(jump, ReadShort()); \
+		DISPATCH(); \
+	}
+
+	// The comparison is read before its operands are popped, the jump is taken when it's false.
+#define FUSED_JUMP(name, op) \
+	TARGET(name) { \
+		bool jump = !(peek(1).Get<ValueType::Int32>() op peek(0).Get<ValueType::Int32>()); \
+		drop(); drop(); \
+		JUMP_IF(jump, ReadByte()); \
+		DISPATCH(); \
+	} \
+	TARGET(name##Long) { \
+		bool jump = !(peek(1).Get<ValueType::Int32>() op peek(0).Get<ValueType::Int32>()); \
+		drop(); drop(); \
+		JUMP_IF(jump, ReadShort()); \
+		DISPATCH(); \
+	}
+
 #ifdef DEBUG_TRACE_EXCEPTION
-		std::cout << "        ";
-		for (size_t slot = 0; slot < m_StackTop; slot++) {
-			std::cout << "[ " << m_Stack[slot].ToString() << " ]";
-		}
-		std::cout << std::endl;
-		Debugger::DisassembleInstruction(m_Chunk.get(), static_cast<int>(m_IP - m_Chunk->getStart()));
+#define TRACE() traceInstruction()
+#else
+#define TRACE() ((void)0)
 #endif
-		OpCode instruction;
-		switch (instruction = static_cast<OpCode>(ReadByte())) {
-		case OpCode::IntLiteral:
-		case OpCode::FloatLiteral:
-		case OpCode::StringLiteral:
-		case OpCode::CharLiteral:
-		{
-			Value constant = ReadConstant();
-			push(constant); 
-			break;
+
+#ifdef ILIAD_VM_STATISTICS
+#define COUNT_DISPATCH() m_Statistics.stackDispatches++
+#else
+#define COUNT_DISPATCH() ((void)0)
+#endif
+
+#ifdef COMPUTED_GOTO
+	// Every handler jumps straight to the handler of the next instruction, through the address
+	// of its label. The table follows the order of OpCode.
+#define TYPED_LABELS(suffix) \
+	&&op_Equal##suffix, &&op_NotEqual##suffix, &&op_Greater##suffix, &&op_GreaterEqual##suffix, \
+	&&op_Less##suffix, &&op_LessEqual##suffix, \
+	&&op_Add##suffix, &&op_Subtract##suffix, &&op_Multiply##suffix, &&op_Divide##suffix,
+
+#define FUSED_LABELS(loads) \
+	&&op_##loads##EqualI32, &&op_##loads##NotEqualI32, &&op_##loads##GreaterI32, &&op_##loads##GreaterEqualI32, \
+	&&op_##loads##LessI32, &&op_##loads##LessEqualI32, \
+	&&op_##loads##AddI32, &&op_##loads##SubtractI32, &&op_##loads##MultiplyI32,
+
+	static void* const dispatchTable[] = {
+		&&op_IntLiteral, &&op_FloatLiteral,
+		&&op_CharLiteral, &&op_StringLiteral,
+		&&op_TrueLiteral, &&op_FalseLiteral,
+		&&op_VarDeclar, &&op_VarAssign,
+		&&op_VarDeclarAndAssign, &&op_Var,
+		&&op_LocalDeclar, &&op_GetLocal, &&op_SetLocal,
+		&&op_Equal, &&op_NotEqual,
+		&&op_Greater, &&op_GreaterEqual,
+		&&op_Less, &&op_LessEqual,
+		&&op_Add, &&op_Subtract,
+		&&op_Multiply, &&op_Divide,
+		&&op_Concatenate,
+		&&op_Not,
+		&&op_Negate,
+		TYPED_LABELS(I32)
+		TYPED_LABELS(I64)
+		TYPED_LABELS(F32)
+		TYPED_LABELS(F64)
+		&&op_I32ToI64, &&op_I32ToF32, &&op_I32ToF64,
+		&&op_I64ToF32, &&op_I64ToF64,
+		&&op_F32ToF64,
+		&&op_Convert,
+		&&op_VarVar, &&op_VarConstant, &&op_LocalLocal, &&op_LocalConstant,
+		FUSED_LABELS(VarVar)
+		FUSED_LABELS(VarConstant)
+		FUSED_LABELS(LocalLocal)
+		FUSED_LABELS(LocalConstant)
+		&&op_Jump, &&op_JumpLong,
+		&&op_JumpIfFalse, &&op_JumpIfFalseLong,
+		&&op_JumpIfTrue, &&op_JumpIfTrueLong,
+		&&op_JumpIfFalseOrPop, &&op_JumpIfFalseOrPopLong,
+		&&op_JumpIfTrueOrPop, &&op_JumpIfTrueOrPopLong,
+		&&op_Loop, &&op_LoopLong,
+		&&op_JumpIfNotEqualI32, &&op_JumpIfNotEqualI32Long,
+		&&op_JumpIfEqualI32, &&op_JumpIfEqualI32Long,
+		&&op_JumpIfLessEqualI32, &&op_JumpIfLessEqualI32Long,
+		&&op_JumpIfLessI32, &&op_JumpIfLessI32Long,
+		&&op_JumpIfGreaterEqualI32, &&op_JumpIfGreaterEqualI32Long,
+		&&op_JumpIfGreaterI32, &&op_JumpIfGreaterI32Long,
+		&&op_Null,
+		&&op_Pop,
+		&&op_PopN,
+		&&op_Return,
+	};
+	static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == OPCODE_COUNT,
+		"The dispatch table needs a label for every opcode.");
+#undef TYPED_LABELS
+#undef FUSED_LABELS
+
+#define TARGET(op) op_##op: case OpCode::op:
+#define DISPATCH() do { TRACE(); COUNT_DISPATCH(); goto *dispatchTable[ReadByte()]; } while(false)
+#else
+#define TARGET(op) case OpCode::op:
+#define DISPATCH() continue
+#endif
+
+	while (true) {
+		// With computed gotos, the switch is only used to reach the first instruction.
+		TRACE();
+		COUNT_DISPATCH();
+		switch (static_cast<OpCode>(ReadByte())) {
+		TARGET(IntLiteral)
+		TARGET(FloatLiteral)
+		TARGET(StringLiteral)
+		TARGET(CharLiteral)
+			push(ReadConstant());
+			DISPATCH();
+		TARGET(TrueLiteral) push(Value(true)); DISPATCH();
+		TARGET(FalseLiteral) push(Value(false)); DISPATCH();
+		TARGET(VarDeclar)
+		{
+			auto type = static_cast<ValueType>(ReadByte());
+			m_Globals[ReadGlobalSlot()] = Value(type);
+			DISPATCH();
 		}
-		case OpCode::TrueLiteral:
+		TARGET(VarAssign)
 		{
-			Value val(true);
-			push(val); 
-			break;
+			// The Compiler already converted the value to the type of the variable. The assigned
+			// value stays on the stack as the result of the expression.
+			Value& global = m_Globals[ReadGlobalSlot()];
+			global = peek(0);
+#ifdef _DEBUG
+			std::cout << std::setw(8) << " " << "| Var " << m_Compiler.GlobalName(&global - m_Globals.data());
+			std::cout << " = | " << peek(0).ToString() << " | " << std::endl;
+#endif // DEBUG
+			DISPATCH();
 		}
-		case OpCode::FalseLiteral: 
-		{ 
-			Value val(false);
-			push(val); 
-			break;
+		TARGET(VarDeclarAndAssign)
+		{
+			Value& global = m_Globals[ReadGlobalSlot()];
+			global = pop();
+#ifdef _DEBUG
+			std::cout << std::setw(8) << " " << "| Var " << m_Compiler.GlobalName(&global - m_Globals.data());
+			std::cout << " = | " << global.ToString() << " | " << std::endl;
+#endif // DEBUG
+			DISPATCH();
 		}
-		case OpCode::VarDeclar:
+		TARGET(Var)
 		{
-			auto type = static_cast<ValueType>(ReadByte());
-			Value value(type);
-			Value nameVal = ReadConstant();
-			std::string name = nameVal.AsValue<std::string>();
-			if (m_Variables.find(name) == m_Variables.end()) {
-				m_Variables.insert({ name, value });
-			} else {
-				runtimeError("Identifier '%s' already declared.", name.c_str());
+			size_t slot = ReadGlobalSlot();
+			const Value& value = m_Globals[slot];
+			if (!value.IsInitilized()) {
+				runtimeError("Identifier '%s' unitiliazed.", m_Compiler.GlobalName(slot).c_str());
 				return InterpretResults::RuntimeError;
 			}
-			break;
-		}
-		case OpCode::VarAssign:
-		{
-			Value nameVal = ReadConstant();
-			std::string name = nameVal.AsValue<std::string>();
-			auto iter = m_Variables.find(name);
-			if (iter != m_Variables.end()) {
-				Value val = pop();
-				m_Variables[name] = val;
-				push(val);
 #ifdef _DEBUG
-				std::cout << std::setw(8) << " " << "| Var " << name;
-				std::cout << " = | " << val.ToString() << " | " << std::endl;
+			std::cout << std::setw(8) << " " << "| Var " << m_Compiler.GlobalName(slot);
+			std::cout << " = | " << value.ToString() << " | " << std::endl;
 #endif // DEBUG
-			} else {
-				runtimeError("Unknown identifier: '%s'.", name.c_str());
+			push(value);
+			DISPATCH();
+		}
+		TARGET(LocalDeclar) push(Value(static_cast<ValueType>(ReadByte()))); DISPATCH();
+		TARGET(GetLocal)
+		{
+			const Value& value = m_Stack[ReadByte()];
+			if (!value.IsInitilized()) {
+				runtimeError("Local variable unitiliazed.");
 				return InterpretResults::RuntimeError;
 			}
-			break;
+			push(value);
+			DISPATCH();
 		}
-		case OpCode::VarDeclarAndAssign:
+		TARGET(SetLocal)
 		{
-			Value nameVal = ReadConstant();
-			std::string name = nameVal.AsValue<std::string>();
-			if (m_Variables.find(name) == m_Variables.end()) {
-				Value val = pop();
-				m_Variables.insert({ name, val });
-				push(val);
-#ifdef _DEBUG
-				std::cout << std::setw(8) << " " << "| Var " << name;
-				std::cout << " = | " << val.ToString() << " | " << std::endl;
-#endif // DEBUG
-			} else {
-				runtimeError("Variable %s already declared.", name.c_str());
+			// The assigned value stays on the stack as the result of the expression.
+			m_Stack[ReadByte()] = peek(0);
+			DISPATCH();
+		}
+		TARGET(Equal) BINARY_OP(== ); DISPATCH();
+		TARGET(NotEqual) BINARY_OP(!= ); DISPATCH();
+		TARGET(Greater) BINARY_OP(> ); DISPATCH();
+		TARGET(GreaterEqual) BINARY_OP(>= ); DISPATCH();
+		TARGET(Less) BINARY_OP(< ); DISPATCH();
+		TARGET(LessEqual) BINARY_OP(<= ); DISPATCH();
+		TARGET(Add) BINARY_OP(+); DISPATCH();
+		TARGET(Subtract) BINARY_OP(-); DISPATCH();
+		TARGET(Multiply) BINARY_OP(*); DISPATCH();
+		TARGET(Divide)
+		{
+			if (const char* error = divisionError(peek(1), peek(0))) {
+				runtimeError("%s", error);
 				return InterpretResults::RuntimeError;
 			}
-			break;
+			BINARY_OP(/ );
+			DISPATCH();
 		}
-		case OpCode::Var:
+		TARGET(Concatenate)
 		{
-			Value nameVal = ReadConstant();
-			std::string name = nameVal.AsValue<std::string>();
-			auto valIter = m_Variables.find(name);
-			if (valIter != m_Variables.end()) {
-				Value value = (*valIter).second;
-				if (!value.IsInitilized()) {
-					runtimeError("Identifier '%s' unitiliazed.", name.c_str());
-					return InterpretResults::RuntimeError;
-				}
-#ifdef _DEBUG
-				std::cout << std::setw(8) << " " << "| Var " << name;
-				std::cout << " = | " << value.ToString() << " | " << std::endl;
-#endif // DEBUG
-				push(value);
-			} else {
-				runtimeError("Unknown identifier: '%s'.", name.c_str());
-				return InterpretResults::RuntimeError;
+			Value& a = peek(1);
+			a = Value(StringObject::Concatenate(a.AsString(), peek(0).AsString()));
+			drop();
+			DISPATCH();
+		}
+		TARGET(Not)
+		{
+			Value& val = peek(0);
+			val = Value(!val);
+			DISPATCH();
+		}
+		TARGET(Negate)
+		{
+			Value& val = peek(0);
+			val = -val;
+			DISPATCH();
+		}
+		TYPED_OPS(I32, ValueType::Int32)
+		TYPED_OPS(I64, ValueType::Int64)
+		TYPED_OPS(F32, ValueType::Float)
+		TYPED_OPS(F64, ValueType::Double)
+		TARGET(I32ToI64) WIDEN(ValueType::Int32, ValueType::Int64); DISPATCH();
+		TARGET(I32ToF32) WIDEN(ValueType::Int32, ValueType::Float); DISPATCH();
+		TARGET(I32ToF64) WIDEN(ValueType::Int32, ValueType::Double); DISPATCH();
+		TARGET(I64ToF32) WIDEN(ValueType::Int64, ValueType::Float); DISPATCH();
+		TARGET(I64ToF64) WIDEN(ValueType::Int64, ValueType::Double); DISPATCH();
+		TARGET(F32ToF64) WIDEN(ValueType::Float, ValueType::Double); DISPATCH();
+		TARGET(Convert)
+		{
+			Value converted(static_cast<ValueType>(ReadByte()));
+			converted.Assign(peek(0));
+			peek(0) = std::move(converted);
+			DISPATCH();
+		}
+		FUSED_OPS(VarVar, LOAD_GLOBAL, LOAD_GLOBAL)
+		FUSED_OPS(VarConstant, LOAD_GLOBAL, LOAD_CONSTANT)
+		FUSED_OPS(LocalLocal, LOAD_LOCAL, LOAD_LOCAL)
+		FUSED_OPS(LocalConstant, LOAD_LOCAL, LOAD_CONSTANT)
+		TARGET(Jump) JUMP_IF(true, ReadByte()); DISPATCH();
+		TARGET(JumpLong) JUMP_IF(true, ReadShort()); DISPATCH();
+		BOOL_JUMP(JumpIfFalse, false, false)
+		BOOL_JUMP(JumpIfTrue, true, false)
+		BOOL_JUMP(JumpIfFalseOrPop, false, true)
+		BOOL_JUMP(JumpIfTrueOrPop, true, true)
+		TARGET(Loop)
+		{
+			byte distance = ReadByte();
+			m_IP -= distance;
+			DISPATCH();
+		}
+		TARGET(LoopLong)
+		{
+			uint16_t distance = ReadShort();
+			m_IP -= distance;
+			DISPATCH();
+		}
+		FUSED_JUMP(JumpIfNotEqualI32, ==)
+		FUSED_JUMP(JumpIfEqualI32, !=)
+		FUSED_JUMP(JumpIfLessEqualI32, >)
+		FUSED_JUMP(JumpIfLessI32, >=)
+		FUSED_JUMP(JumpIfGreaterEqualI32, <)
+		FUSED_JUMP(JumpIfGreaterI32, <=)
+		TARGET(Null) push(Value()); DISPATCH();
+		TARGET(Pop) drop(); DISPATCH();
+		TARGET(PopN)
+		{
+			for (byte count = ReadByte(); count > 0; count--) {
+				drop();
 			}
-			
+			DISPATCH();
+		}
+		TARGET(Return)
+			resetStack();
+			return InterpretResults::OK;
+		}
+	}
+
+#undef BINARY_OP
+#undef TYPED_BINARY_OP
+#undef TYPED_DIVIDE_OP
+#undef TYPED_COMPARISON_OP
+#undef TYPED_OPS
+#undef WIDEN
+#undef LOAD_GLOBAL
+#undef LOAD_LOCAL
+#undef LOAD_CONSTANT
+#undef FUSED_COMPARISON_OP
+#undef FUSED_BINARY_OP
+#undef FUSED_OPS
+#undef JUMP_IF
+#undef BOOL_JUMP
+#undef FUSED_JUMP
+#undef TRACE
+#undef COUNT_DISPATCH
+#undef TARGET
+#undef DISPATCH
+}
+
+#ifdef DEBUG_TRACE_EXCEPTION
+void VM::traceInstruction() {
+	std::cout << "        ";
+	for (const Value* slot = m_Stack; slot < m_StackTop; slot++) {
+		std::cout << "[ " << slot->ToString() << " ]";
+	}
+	std::cout << std::endl;
+	Debugger::DisassembleInstruction(m_Chunk.get(), static_cast<int>(m_IP - m_Chunk->getStart()));
+}
+#endif
+
+InterpretResults VM::runRegisters() {
+	const RegisterCode& registers = *m_Chunk->m_RegisterCode;
+	m_Registers = registers.frame;
+
+	Value* frame = m_Registers.data();
+	const RegisterInstruction* start = registers.code.data();
+	const RegisterInstruction* ip = start;
 
+	// Errors are reported at the stack instruction the failing instruction was translated from.
+#define REGISTER_ERROR(...) do { \
+		m_IP = m_Chunk->getStart() + registers.origins[ip - start - 1] + 1; \
+		runtimeError(__VA_ARGS__); \
+		return InterpretResults::RuntimeError; \
+	} while(false)
+
+#define BINARY_OP(op) frame[instruction.a] = Value(frame[instruction.b] op frame[instruction.c])
+
+	// The destination register may still hold a string from an earlier expression, so typed
+	// results are assigned as a whole Value instead of with Set().
+#define TYPED_BINARY_OP(type, op) \
+	frame[instruction.a] = Value(static_cast<NativeType<type>>(frame[instruction.b].Get<type>() op frame[instruction.c].Get<type>()))
+
+#define TYPED_DIVIDE_OP(type) do { \
+		if (const char* error = divisionError(frame[instruction.b].Get<type>(), frame[instruction.c].Get<type>())) REGISTER_ERROR("%s", error); \
+		TYPED_BINARY_OP(type, /); \
+	} while(false)
+
+#define TYPED_COMPARISON_OP(type, op) \
+	frame[instruction.a] = Value(frame[instruction.b].Get<type>() op frame[instruction.c].Get<type>())
+
+#define TYPED_OPS(suffix, type) \
+	case OpCode::Equal##suffix: TYPED_COMPARISON_OP(type, ==); break; \
+	case OpCode::NotEqual##suffix: TYPED_COMPARISON_OP(type, !=); break; \
+	case OpCode::Greater##suffix: TYPED_COMPARISON_OP(type, >); break; \
+	case OpCode::GreaterEqual##suffix: TYPED_COMPARISON_OP(type, >=); break; \
+	case OpCode::Less##suffix: TYPED_COMPARISON_OP(type, <); break; \
+	case OpCode::LessEqual##suffix: TYPED_COMPARISON_OP(type, <=); break; \
+	case OpCode::Add##suffix: TYPED_BINARY_OP(type, +); break; \
+	case OpCode::Subtract##suffix: TYPED_BINARY_OP(type, -); break; \
+	case OpCode::Multiply##suffix: TYPED_BINARY_OP(type, *); break; \
+	case OpCode::Divide##suffix: TYPED_DIVIDE_OP(type); break;
+
+#define WIDEN(from, to) do { \
+		Value& val = frame[instruction.a]; \
+		val.Set<to>(static_cast<NativeType<to>>(val.Get<from>())); \
+	} while(false)
+
+	while (true) {
+#ifdef DEBUG_TRACE_EXCEPTION
+		std::cout << "        ";
+		for (size_t slot = 0; slot < registers.registerCount; slot++) {
+			std::cout << "[ " << frame[slot].ToString() << " ]";
+		}
+		std::cout << std::endl;
+		Debugger::DisassembleRegisterInstruction(m_Chunk.get(), static_cast<int>(ip - start));
+#endif
+#ifdef ILIAD_VM_STATISTICS
+		m_Statistics.registerDispatches++;
+#endif
+		const RegisterInstruction& instruction = *ip++;
+		switch (instruction.op) {
+		case OpCode::VarDeclar: m_Globals[instruction.a] = Value(static_cast<ValueType>(instruction.type)); break;
+		case OpCode::VarAssign:
+		case OpCode::VarDeclarAndAssign:
+			m_Globals[instruction.a] = frame[instruction.b];
+			break;
+		case OpCode::Var:
+		{
+			const Value& value = m_Globals[instruction.b];
+			if (!value.IsInitilized()) REGISTER_ERROR("Identifier '%s' unitiliazed.", m_Compiler.GlobalName(instruction.b).c_str());
+
+			frame[instruction.a] = value;
+			break;
+		}
+		case OpCode::LocalDeclar: frame[instruction.a] = Value(static_cast<ValueType>(instruction.type)); break;
+		case OpCode::GetLocal:
+		{
+			const Value& value = frame[instruction.b];
+			if (!value.IsInitilized()) REGISTER_ERROR("Local variable unitiliazed.");
+
+			frame[instruction.a] = value;
 			break;
 		}
+		case OpCode::SetLocal: frame[instruction.a] = frame[instruction.b]; break;
 		case OpCode::Equal: BINARY_OP(== ); break;
 		case OpCode::NotEqual: BINARY_OP(!= ); break;
 		case OpCode::Greater: BINARY_OP(> ); break;
@@ -148,53 +611,46 @@ InterpretResults VM::run() {
 		case OpCode::Add: BINARY_OP(+); break;
 		case OpCode::Subtract: BINARY_OP(-); break;
 		case OpCode::Multiply: BINARY_OP(*); break;
-		case OpCode::Divide: BINARY_OP(/ ); break;
-		case OpCode::Concatenate:
-		{
-			auto b = pop();
-			auto a = pop();
-			std::string newString = a.AsValue<std::string>() + b.AsValue<std::string>();
-			Value value(FWD(newString));
-			push(value);
+		case OpCode::Divide:
+			if (const char* error = divisionError(frame[instruction.b], frame[instruction.c])) REGISTER_ERROR("%s", error);
+			BINARY_OP(/ );
 			break;
-		}
-		case OpCode::Not: 
-		{
-			bool not = !pop();
-			Value val(FWD(not));
-			push(val); break; 
-		}
-		case OpCode::Negate:
-		{
-			auto val = -pop();
-			push(val);
+		case OpCode::Concatenate:
+			frame[instruction.a] = Value(StringObject::Concatenate(frame[instruction.b].AsString(), frame[instruction.c].AsString()));
 			break;
-		}
-		case OpCode::Null:
+		case OpCode::Not: frame[instruction.a] = Value(!frame[instruction.b]); break;
+		case OpCode::Negate: frame[instruction.a] = -frame[instruction.b]; break;
+		TYPED_OPS(I32, ValueType::Int32)
+		TYPED_OPS(I64, ValueType::Int64)
+		TYPED_OPS(F32, ValueType::Float)
+		TYPED_OPS(F64, ValueType::Double)
+		case OpCode::I32ToI64: WIDEN(ValueType::Int32, ValueType::Int64); break;
+		case OpCode::I32ToF32: WIDEN(ValueType::Int32, ValueType::Float); break;
+		case OpCode::I32ToF64: WIDEN(ValueType::Int32, ValueType::Double); break;
+		case OpCode::I64ToF32: WIDEN(ValueType::Int64, ValueType::Float); break;
+		case OpCode::I64ToF64: WIDEN(ValueType::Int64, ValueType::Double); break;
+		case OpCode::F32ToF64: WIDEN(ValueType::Float, ValueType::Double); break;
+		case OpCode::Convert:
 		{
-			Value null;
-			push(null);
+			Value converted(static_cast<ValueType>(instruction.type));
+			converted.Assign(frame[instruction.a]);
+			frame[instruction.a] = std::move(converted);
 			break;
 		}
 		case OpCode::Return:
-			// pop();
 			return InterpretResults::OK;
+		default:
+			REGISTER_ERROR("Unknown register instruction.");
 		}
 	}
 
+#undef REGISTER_ERROR
 #undef BINARY_OP
-}
-
-void VM::push(Value& value) {
-	m_Stack.push_back(value);
-	m_StackTop++;
-}
-
-Value VM::pop() {
-	m_StackTop--;
-	Value value = m_Stack.back();
-	m_Stack.pop_back();
-	return value;
+#undef TYPED_BINARY_OP
+#undef TYPED_DIVIDE_OP
+#undef TYPED_COMPARISON_OP
+#undef TYPED_OPS
+#undef WIDEN
 }
 
 void VM::runtimeError(const char * format, ...) {
@@ -204,9 +660,10 @@ void VM::runtimeError(const char * format, ...) {
 	va_end(args);
 	fputs("\n", stderr);
 
-	size_t instruction = m_IP - m_Chunk->getStart();
-	std::cerr << "[line " << instruction << "] in script\n";
+	// m_IP is past the opcode of the failing instruction, or at the start for errors found before
+	// running. Every byte of an instruction is on its line.
+	size_t instruction = m_IP > m_Chunk->getStart() ? m_IP - m_Chunk->getStart() - 1 : 0;
+	std::cerr << "[line " << m_Chunk->getLine(instruction) << "] in script\n";
 
-	// reset stack
-	m_StackTop = 0;
+	resetStack();
 }
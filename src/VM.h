@@ -2,14 +2,17 @@
 //! \brief Details the VM that interprets the bytecode and executes the program.
 #pragma once
 
+#include <cassert>
 #include <memory>
-#include <unordered_map>
+#include <new>
 
 #include "Chunk.h"
+#include "ChunkCache.h"
 #include "Value.h"
 #include "Compiler.h"
+#include "MappedFile.h"
 
-//! The maximum number of Value the VM can hold in its statck.
+//! The default number of Value the VM can hold in its stack.
 #define STACK_MAX 256
 
 //! Results to be given by VM as it interprets and runs the code.
@@ -23,6 +26,18 @@ enum class InterpretResults {
 	RuntimeError //!< Error occurred during interpreting.
 };
 
+#ifdef ILIAD_VM_STATISTICS
+//! What a VM did while running code, to compare the stack and register bytecodes.
+/*!
+  Only counted in builds defining ILIAD_VM_STATISTICS, counting slows down every instruction.
+*/
+struct VMStatistics {
+	size_t stackDispatches = 0; //!< Instructions of the stack bytecode dispatched.
+	size_t registerDispatches = 0; //!< Instructions of the register bytecode dispatched.
+	size_t copies = 0; //!< Values copied while running, see valueCopyCount.
+};
+#endif
+
 //! A small virtual machine to run generated bytecode.
 /*!
   The VM takes the source code and hands it off to the Compiler to be converted to bytecode.
@@ -31,30 +46,102 @@ enum class InterpretResults {
 */
 class VM {
 private:
+	std::vector<std::shared_ptr<MappedFile>> m_Files; //!< Bytecode files loaded by the VM. Their strings are used in place, so they are declared first to outlive every string.
+	StringTable m_Strings; //!< Strings interned by the VM and its Compiler. Declared first so it outlives every Value the VM holds.
+	Compiler m_Compiler; //!< Compiles the source given to Interpret(). Keeps the types of the variables declared so far.
+	ChunkCache m_Cache; //!< Chunks compiled by earlier calls to Interpret(), by source.
 	std::shared_ptr<Chunk> m_Chunk; //!< Current Chunk of bytecode being interpreted. Shared with Compiler to generate bytecode.
 	const byte* m_IP; //!< Instruction Pointer. Pointer to current instruction the VM is running from the Chunk.
-	std::vector<Value> m_Stack; //!< A statck of Values.
-	size_t m_StackTop = 0; //!< A pointer to where in m_Stack the next Value will be written to.
-
-	std::unordered_map<std::string, Value> m_Variables; //!< A map of all the variables, indexed by string of the variable name.
+	const size_t m_StackSize; //!< Number of Values m_Stack has room for.
+	Value* m_Stack; //!< A stack of Values. Raw storage, only the slots below m_StackTop hold constructed Values.
+	Value* m_StackTop; //!< A pointer to where in m_Stack the next Value will be written to.
+	std::vector<Value> m_Registers; //!< Register file of the register bytecode: the registers followed by the constants.
+	std::vector<Value> m_Globals; //!< Global variables, indexed by the slot the Compiler gave them. Their names are kept by the Compiler.
+#ifdef ILIAD_VM_STATISTICS
+	VMStatistics m_Statistics; //!< What the VM did since its statistics were last reset.
+#endif
 
 public:
-	//! Default compiler
-	VM();
+	//! Creates a VM with a stack of fixed size.
+	/*!
+	  \param stackSize Number of Values the stack has room for. Code that would grow the stack past
+	  it is refused with a runtime error before it runs.
+	*/
+	explicit VM(size_t stackSize = STACK_MAX);
+
+	//! Releases the stack.
+	~VM();
 
 	//! Interprets source code and runs it.
 	/*!
 	  Takes in a string of source code, creates a Compiler, and let's it compile the source coude into a
 	  bytecode Chunk, then runs the bytecode and processes it.
-	  \param source A string of source code to be compiled and interpreted.
+	  \param source A string of source code to be compiled and interpreted. Only needs to live until
+	  Interpret() returns.
+	  \param cache If the compiled chunk is looked up in and added to the cache. Code only run once,
+	  such as a script file, isn't worth keeping a copy of.
 	  \return InterpretResults representation of compiling and interpreting the source code.
 		- InterpretResults::OK if there were no errors.
 		- InterpretResults::CompileError if there was an error in the compiling phase.
 		- InterpretResults::RuntimeError if there was an error in the running phase.
 	*/
-	InterpretResults Interpret(const std::string& source);
+	InterpretResults Interpret(std::string_view source, bool cache = true);
+
+	//! Runs a chunk loaded from a bytecode file, see BytecodeFile.
+	/*!
+	  The code runs where the file is mapped and its string constants are used in place, so the
+	  VM keeps the file mapped for as long as it lives. The globals of the file take the first
+	  slots, so it can only be loaded by a VM that has no globals yet.
+	  \param file A mapped bytecode file.
+	  \return
+		- InterpretResults::OK if there were no errors.
+		- InterpretResults::CompileError if the file isn't valid bytecode, or the VM already has globals.
+		- InterpretResults::RuntimeError if there was an error in the running phase.
+	*/
+	InterpretResults InterpretBytecode(std::shared_ptr<MappedFile> file);
+
+	//! Chooses the bytecode the Compiler generates for the following calls to Interpret().
+	/*!
+	  \param target CompileTarget::Stack to run the stack bytecode, CompileTarget::Registers to run
+	  the register bytecode where it can express the program.
+	*/
+	void SetTarget(CompileTarget target) { m_Compiler.SetTarget(target); m_Cache.Clear(); }
+
+	//! Turns the peephole optimizer of the Compiler on or off, see Compiler::SetOptimize().
+	void SetOptimize(bool optimize) { m_Compiler.SetOptimize(optimize); m_Cache.Clear(); }
+
+	//! Turns the superinstructions of the Compiler on or off, see Compiler::SetSuperinstructions().
+	void SetSuperinstructions(bool superinstructions) { m_Compiler.SetSuperinstructions(superinstructions); m_Cache.Clear(); }
+
+	//! Turns the parallel scan of the Compiler on or off, see Compiler::SetParallelScan(). The code compiled is the same.
+	void SetParallelScan(bool parallelScan) { m_Compiler.SetParallelScan(parallelScan); }
+
+	//! The cache of compiled chunks.
+	/*!
+	  Interpret() runs a cached chunk instead of compiling source it has already compiled. Code
+	  declaring globals isn't cached, running it again has to report the redeclaration.
+	  \return The cache, to read its hit and miss counters or change its capacity.
+	*/
+	ChunkCache& Cache() { return m_Cache; }
+
+#ifdef ILIAD_VM_STATISTICS
+	//!@{ \name Statistics
+
+	//! \return What the VM did since its statistics were last reset. Compiling isn't counted.
+	const VMStatistics& Statistics() const { return m_Statistics; }
+	//! Sets every counter back to 0.
+	void ResetStatistics() { m_Statistics = VMStatistics(); }
+	//!@}
+#endif
 
 private:
+	//! Checks the stack depth of m_Chunk and runs it.
+	/*!
+	  \param depth Chunk::maxStackDepth() of m_Chunk.
+	  \return Result of running the chunk.
+	*/
+	InterpretResults execute(int depth);
+
 	//! Runs the bytecode from m_Chunk.
 	/*!
 	  \return
@@ -63,30 +150,76 @@ private:
 	*/
 	InterpretResults run();
 
+#ifdef DEBUG_TRACE_EXCEPTION
+	//! Prints the stack and the instruction at m_IP.
+	void traceInstruction();
+#endif
+
+	//! Runs the register bytecode of m_Chunk.
+	/*!
+	  \return
+		- InterpretResults::OK if there were no errors.
+		- InterpretResults::RuntimeError if an error was encountered.
+	*/
+	InterpretResults runRegisters();
+
+	//!@{ \name Stack
+	//! The depth of the stack is checked once before a Chunk runs, see Chunk::maxStackDepth(), so
+	//! pushing and popping never check for room. They are only asserted in debug builds.
+
 	//! Pushes a Value onto the top of m_Stack
 	/*!
-	  \param value Value to be written to m_Stack
+	  \param value Value to be moved to m_Stack
+	*/
+	void push(Value&& value) { assert(m_StackTop < m_Stack + m_StackSize); new (m_StackTop++) Value(std::move(value)); }
+
+	//! \overload void push(Value&& value)
+	/*!
+	  \param value Value to be copied to m_Stack
 	*/
-	void push(Value& value);
+	void push(const Value& value) { assert(m_StackTop < m_Stack + m_StackSize); new (m_StackTop++) Value(value); }
 
-	//! Pops the Value off the top of m_Stack and sets it to be overwritten on the next push.
+	//! Pops the Value off the top of m_Stack.
 	/*!
-	  \return Value from the top of the stack.
+	  \return Value from the top of the stack, moved out of m_Stack.
 	*/
-	Value pop();
+	Value pop() {
+		assert(m_StackTop > m_Stack);
+		Value value = std::move(*--m_StackTop);
+		m_StackTop->~Value();
+		return value;
+	}
+
+	//! Removes the Value on top of m_Stack without returning it.
+	void drop() { assert(m_StackTop > m_Stack); (--m_StackTop)->~Value(); }
+
+	//! Removes every Value from m_Stack.
+	void resetStack() { while (m_StackTop > m_Stack) drop(); }
+	//!@}
 
 	//! Checks a Value in the stack without removing it.
 	/*!
+	  Operators write their result over their first operand through the returned reference, instead
+	  of popping and pushing copies.
 	  \param distance Distance from the top of the stack. 0 is the current stack top.
-	  \return The value located at (m_Stacktop - distance) index in m_Stack.
+	  \return The value located distance slots below m_StackTop.
 	*/
-	Value peek(int distance) const { return m_Stack[m_StackTop - 1 - distance]; }
+	Value& peek(int distance) { return m_StackTop[-1 - distance]; }
+
+	//! \overload Value& peek(int distance)
+	const Value& peek(int distance) const { return m_StackTop[-1 - distance]; }
 
 	//! Returns the byte at m_IP and increments the pointer.
 	byte ReadByte() { return *m_IP++; }
 
-	//! Returns the constant from the index provided by the next byte
-	Value ReadConstant() { return m_Chunk->m_Constants[ReadByte()]; }
+	//! Returns the two bytes at m_IP, lowest first, and moves the pointer past them.
+	uint16_t ReadShort() { m_IP += 2; return static_cast<uint16_t>(m_IP[-2] | m_IP[-1] << 8); }
+
+	//! Returns the constant from the index provided by the next bytes, see readConstantIndex().
+	const Value& ReadConstant() { return m_Chunk->m_Constants[readConstantIndex(m_IP)]; }
+
+	//! Returns the global slot provided by the next bytes, see readGlobalSlot().
+	size_t ReadGlobalSlot() { return readGlobalSlot(m_IP); }
 
 	//! Prints a provided error message to stderr. Supports string formating.
 	void runtimeError(const char* format, ...);
@@ -1,19 +1,181 @@
 #include "stdafx.h"
 #include "Value.h"
 
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <functional>
 #include <sstream>
 #include <iomanip>
+#include <utility>
 
-Value::Value(const Value & value) : m_Type(value.Type()), m_Size(value.Size()), m_Initialized(true) {
-	m_Data = value.AsBytes();
+#ifdef ILIAD_VM_STATISTICS
+size_t valueCopyCount = 0;
+#endif
+
+Value::Value(const Value & value) : m_Type(value.Type()), m_Initialized(value.m_Initialized), m_As(value.m_As) {
+#ifdef ILIAD_VM_STATISTICS
+	valueCopyCount++;
+#endif
+	if (IsString() && m_As.string) m_As.string->Retain();
 }
 
-Value::Value(ByteArray bytes, ValueType type) : m_Type(type), m_Size(bytes.size()), m_Initialized(true) {
-	m_Data = bytes;
+Value::Value(const std::string& value) : Value(StringObject::Create(value)) {}
+
+Value::Value(StringObject* string) : m_Type(ValueType::String), m_Initialized(true) {
+	m_As.int64 = 0;
+	m_As.string = string;
+	m_As.string->Retain();
 }
 
-const ByteArray& Value::AsBytes() const {
-	return m_Data;
+namespace {
+	//!@{ \name Kernels
+	//! Every binary operator is a table of kernels, one per pair of operand types. The tables are
+	//! generated at compile time, each kernel knows the types of its operands and reads them
+	//! directly with Value::Get, so running an operator is a single indirect call.
+
+	//! Arithmetic operators, index of their kernel table.
+	enum class ArithmeticOperator { Add, Subtract, Multiply, Divide, Count };
+	//! Comparison operators, index of their kernel table. The others are derived from these.
+	enum class ComparisonOperator { Equal, Less, LessEqual, Count };
+
+	typedef Value(*ArithmeticKernel)(const Value&, const Value&);
+	typedef bool(*ComparisonKernel)(const Value&, const Value&);
+
+	constexpr size_t KERNEL_COUNT = VALUE_TYPE_COUNT * VALUE_TYPE_COUNT;
+
+	//! Index of the kernel for a pair of types. ValueType::Invalid is -1, so types are offset by one.
+	constexpr size_t kernelIndex(ValueType lhs, ValueType rhs) {
+		return (static_cast<size_t>(lhs) + 1) * VALUE_TYPE_COUNT + (static_cast<size_t>(rhs) + 1);
+	}
+
+	//! Type of the lhs operand of the kernel at Index.
+	template<size_t Index>
+	constexpr ValueType LhsType = static_cast<ValueType>(static_cast<int>(Index / VALUE_TYPE_COUNT) - 1);
+
+	//! Type of the rhs operand of the kernel at Index.
+	template<size_t Index>
+	constexpr ValueType RhsType = static_cast<ValueType>(static_cast<int>(Index % VALUE_TYPE_COUNT) - 1);
+
+	//! Applies an arithmetic operator to two numbers of types Lhs and Rhs.
+	/*!
+	  Both operands are converted to the type the compiler gives the result, smallestTypeNeeded(Lhs, Rhs).
+	  Pairs that aren't both numbers return a Null value.
+	*/
+	template<ArithmeticOperator Op, ValueType Lhs, ValueType Rhs>
+	Value arithmetic(const Value& a, const Value& b) {
+		if constexpr (IsNumber(Lhs) && IsNumber(Rhs)) {
+			typedef NativeType<smallestTypeNeeded(Lhs, Rhs)> Result;
+			Result lhs = static_cast<Result>(a.Get<Lhs>());
+			Result rhs = static_cast<Result>(b.Get<Rhs>());
+
+			if constexpr (Op == ArithmeticOperator::Add) return Value(static_cast<Result>(lhs + rhs));
+			else if constexpr (Op == ArithmeticOperator::Subtract) return Value(static_cast<Result>(lhs - rhs));
+			else if constexpr (Op == ArithmeticOperator::Multiply) return Value(static_cast<Result>(lhs * rhs));
+			else return Value(static_cast<Result>(lhs / rhs));
+		} else {
+			return Value();
+		}
+	}
+
+	//! Applies a comparison operator to two values of types Lhs and Rhs.
+	/*!
+	  Numbers are compared after the usual arithmetic conversions. Other types can only be tested
+	  for equality against the same type, and are unordered. Invalid values are never equal to anything.
+	*/
+	template<ComparisonOperator Op, ValueType Lhs, ValueType Rhs>
+	bool comparison(const Value& a, const Value& b) {
+		if constexpr (IsNumber(Lhs) && IsNumber(Rhs)) {
+			typedef std::common_type_t<NativeType<Lhs>, NativeType<Rhs>> Common;
+			Common lhs = static_cast<Common>(a.Get<Lhs>());
+			Common rhs = static_cast<Common>(b.Get<Rhs>());
+
+			if constexpr (Op == ComparisonOperator::Equal) return lhs == rhs;
+			else if constexpr (Op == ComparisonOperator::Less) return lhs < rhs;
+			else return lhs <= rhs;
+		} else if constexpr (Op != ComparisonOperator::Equal || Lhs != Rhs || Lhs == ValueType::Invalid) {
+			return false;
+		} else if constexpr (Lhs == ValueType::Null) {
+			return true;
+		} else if constexpr (Lhs == ValueType::String) {
+			StringObject* lhs = a.Get<Lhs>();
+			StringObject* rhs = b.Get<Rhs>();
+			if (!lhs || !rhs) return lhs == rhs;
+			return lhs->Equals(rhs);
+		} else {
+			return a.Get<Lhs>() == b.Get<Rhs>();
+		}
+	}
+
+	template<ArithmeticOperator Op, size_t... Index>
+	constexpr std::array<ArithmeticKernel, KERNEL_COUNT> makeArithmeticKernels(std::index_sequence<Index...>) {
+		return { { &arithmetic<Op, LhsType<Index>, RhsType<Index>>... } };
+	}
+
+	template<ComparisonOperator Op, size_t... Index>
+	constexpr std::array<ComparisonKernel, KERNEL_COUNT> makeComparisonKernels(std::index_sequence<Index...>) {
+		return { { &comparison<Op, LhsType<Index>, RhsType<Index>>... } };
+	}
+
+	//! Kernel tables, indexed by operator, then by kernelIndex().
+	constexpr std::array<ArithmeticKernel, KERNEL_COUNT> ARITHMETIC_KERNELS[] = {
+		makeArithmeticKernels<ArithmeticOperator::Add>(std::make_index_sequence<KERNEL_COUNT>()),
+		makeArithmeticKernels<ArithmeticOperator::Subtract>(std::make_index_sequence<KERNEL_COUNT>()),
+		makeArithmeticKernels<ArithmeticOperator::Multiply>(std::make_index_sequence<KERNEL_COUNT>()),
+		makeArithmeticKernels<ArithmeticOperator::Divide>(std::make_index_sequence<KERNEL_COUNT>()),
+	};
+
+	constexpr std::array<ComparisonKernel, KERNEL_COUNT> COMPARISON_KERNELS[] = {
+		makeComparisonKernels<ComparisonOperator::Equal>(std::make_index_sequence<KERNEL_COUNT>()),
+		makeComparisonKernels<ComparisonOperator::Less>(std::make_index_sequence<KERNEL_COUNT>()),
+		makeComparisonKernels<ComparisonOperator::LessEqual>(std::make_index_sequence<KERNEL_COUNT>()),
+	};
+
+	static_assert(std::size(ARITHMETIC_KERNELS) == static_cast<size_t>(ArithmeticOperator::Count), "Missing arithmetic kernels.");
+	static_assert(std::size(COMPARISON_KERNELS) == static_cast<size_t>(ComparisonOperator::Count), "Missing comparison kernels.");
+
+	inline Value arithmeticKernel(ArithmeticOperator op, const Value& a, const Value& b) {
+		return ARITHMETIC_KERNELS[static_cast<size_t>(op)][kernelIndex(a.Type(), b.Type())](a, b);
+	}
+
+	inline bool comparisonKernel(ComparisonOperator op, const Value& a, const Value& b) {
+		return COMPARISON_KERNELS[static_cast<size_t>(op)][kernelIndex(a.Type(), b.Type())](a, b);
+	}
+	//!@}
+}
+
+uint64_t Value::dataBits() const {
+	uint64_t bits = 0;
+
+	switch (m_Type) {
+	case ValueType::Int8: std::memcpy(&bits, &m_As.int8, sizeof(m_As.int8)); break;
+	case ValueType::Int16: std::memcpy(&bits, &m_As.int16, sizeof(m_As.int16)); break;
+	case ValueType::Int32: std::memcpy(&bits, &m_As.int32, sizeof(m_As.int32)); break;
+	case ValueType::Int64: std::memcpy(&bits, &m_As.int64, sizeof(m_As.int64)); break;
+	case ValueType::Float: std::memcpy(&bits, &m_As._float, sizeof(m_As._float)); break;
+	case ValueType::Double: std::memcpy(&bits, &m_As._double, sizeof(m_As._double)); break;
+	case ValueType::Char: std::memcpy(&bits, &m_As.character, sizeof(m_As.character)); break;
+	case ValueType::Bool: bits = m_As.boolean; break;
+	default: break;
+	}
+
+	return bits;
+}
+
+bool Value::Identical(const Value& value) const {
+	if (m_Type != value.m_Type || m_Initialized != value.m_Initialized) return false;
+
+	if (IsString()) {
+		if (!m_As.string || !value.m_As.string) return m_As.string == value.m_As.string;
+		return m_As.string->Equals(value.m_As.string);
+	}
+
+	return dataBits() == value.dataBits();
+}
+
+size_t Value::Hash() const {
+	size_t hash = IsString() && m_As.string ? m_As.string->Hash() : std::hash<uint64_t>()(dataBits());
+	return hash ^ (static_cast<size_t>(m_Type) * 0x9e3779b97f4a7c15ull);
 }
 
 std::string Value::ToString() const {
@@ -54,8 +216,8 @@ Value Value::operator-() const {
 	if (!IsNumber()) return *this;
 
 	switch (m_Type) {
-	case ValueType::Int8: return Value(-AsValue<int8_t>());
-	case ValueType::Int16: return Value(-AsValue<int16_t>());
+	case ValueType::Int8: return Value(static_cast<int8_t>(-m_As.int8));
+	case ValueType::Int16: return Value(static_cast<int16_t>(-m_As.int16));
 	case ValueType::Int32: return Value(-AsValue<int32_t>());
 	case ValueType::Int64: return Value(-AsValue<int64_t>());
 	case ValueType::Float: return Value(-AsValue<float>());
@@ -64,192 +226,88 @@ Value Value::operator-() const {
 	}
 }
 
-Value Value::operator+(Value value) const {
-	if (!(IsNumber() && value.IsNumber())) return Value();
-
-	ValueType outputType = smallestTypeNeeded(m_Type, value.m_Type);
-
-	switch (outputType) {
-	case ValueType::Char: return Value(AsValue<char>() + AsValue<char>());
-	case ValueType::Int8: return Value(AsValue<int8_t>() + value.AsValue<int8_t>());
-	case ValueType::Int16: return Value(AsValue<int16_t>() + value.AsValue<int16_t>());
-	case ValueType::Int32: return Value(AsValue<int32_t>() + value.AsValue<int32_t>());
-	case ValueType::Int64: return Value(AsValue<int64_t>() + value.AsValue<int64_t>());
-	case ValueType::Float: return Value(AsValue<float>() + value.AsValue<float>());
-	case ValueType::Double: return Value(AsValue<double>() + value.AsValue<double>());
-	default: return Value();
-	}
-}
-
-Value Value::operator-(Value value) const {
-	if (!IsNumber() && !value.IsNumber()) return Value();
+Value Value::operator+(const Value& value) const { return arithmeticKernel(ArithmeticOperator::Add, *this, value); }
+Value Value::operator-(const Value& value) const { return arithmeticKernel(ArithmeticOperator::Subtract, *this, value); }
+Value Value::operator*(const Value& value) const { return arithmeticKernel(ArithmeticOperator::Multiply, *this, value); }
+Value Value::operator/(const Value& value) const { return arithmeticKernel(ArithmeticOperator::Divide, *this, value); }
 
-	ValueType outputType = smallestTypeNeeded(m_Type, value.m_Type);
-
-	switch (outputType) {
-	case ValueType::Int8: return Value(AsValue<int8_t>() - value.AsValue<int8_t>());
-	case ValueType::Int16: return Value(AsValue<int16_t>() - value.AsValue<int16_t>());
-	case ValueType::Int32: return Value(AsValue<int32_t>() - value.AsValue<int32_t>());
-	case ValueType::Int64: return Value(AsValue<int64_t>() - value.AsValue<int64_t>());
-	case ValueType::Float: return Value(AsValue<float>() - value.AsValue<float>());
-	case ValueType::Double: return Value(AsValue<double>() - value.AsValue<double>());
-	default: return Value();
-	}
+const char* divisionError(const Value& lhs, const Value& rhs) {
+	if (!lhs.IsIntegral() || !rhs.IsIntegral()) return nullptr;
+	// Results narrower than int32 are computed in int, where the smallest of them can't overflow.
+	if (smallestTypeNeeded(lhs.Type(), rhs.Type()) == ValueType::Int64) return divisionError(lhs.AsValue<int64_t>(), rhs.AsValue<int64_t>());
+	return divisionError(lhs.AsValue<int32_t>(), rhs.AsValue<int32_t>());
 }
 
+Value& Value::operator=(const Value& value) {
+	if (this == &value) return *this;
+#ifdef ILIAD_VM_STATISTICS
+	valueCopyCount++;
+#endif
 
-Value Value::operator*(Value value) const {
-	if (!IsNumber() && !value.IsNumber()) return Value();
-
-	ValueType outputType = smallestTypeNeeded(m_Type, value.m_Type);
+	if (value.IsString() && value.m_As.string) value.m_As.string->Retain();
+	if (IsString() && m_As.string) m_As.string->Release();
 
-	switch (outputType) {
-	case ValueType::Int8: return Value(AsValue<int8_t>() * value.AsValue<int8_t>());
-	case ValueType::Int16: return Value(AsValue<int16_t>() * value.AsValue<int16_t>());
-	case ValueType::Int32: return Value(AsValue<int32_t>() * value.AsValue<int32_t>());
-	case ValueType::Int64: return Value(AsValue<int64_t>() * value.AsValue<int64_t>());
-	case ValueType::Float: return Value(AsValue<float>() * value.AsValue<float>());
-	case ValueType::Double: return Value(AsValue<double>() * value.AsValue<double>());
-	default: return Value();
-	}
+	m_Type = value.m_Type;
+	m_Initialized = value.m_Initialized;
+	m_As = value.m_As;
+	return *this;
 }
 
+Value& Value::operator=(Value&& value) noexcept {
+	if (this == &value) return *this;
 
-Value Value::operator/(Value value) const {
-	if (!IsNumber() && !value.IsNumber()) return Value();
-
-	ValueType outputType = smallestTypeNeeded(m_Type, value.m_Type);
+	if (IsString() && m_As.string) m_As.string->Release();
 
-	switch (outputType) {
-	case ValueType::Int8: return Value(AsValue<int8_t>() / value.AsValue<int8_t>());
-	case ValueType::Int16: return Value(AsValue<int16_t>() / value.AsValue<int16_t>());
-	case ValueType::Int32: return Value(AsValue<int32_t>() / value.AsValue<int32_t>());
-	case ValueType::Int64: return Value(AsValue<int64_t>() / value.AsValue<int64_t>());
-	case ValueType::Float: return Value(AsValue<float>() / value.AsValue<float>());
-	case ValueType::Double: return Value(AsValue<double>() / value.AsValue<double>());
-	default: return Value();
-	}
-}
-
-Value& Value::operator=(const Value& value) {
-	
-	if (m_Type == value.Type()) {
-		m_Data = value.AsBytes();
-		m_Initialized = true;
-	}
-	else {
-		// Hopefule the compiler is taking care of type-checking, so we can assume
-		// that the types are easily convertable.
-		switch (m_Type) {
-		case ValueType::Invalid: 
-			static_assert(true, "Dear god, what have you done?");
-		case ValueType::Int8: 
-			*this = value.AsValue<int8_t>();
-			return *this;
-		case ValueType::Int16:
-			*this = value.AsValue<int16_t>();
-			return *this;
-		case ValueType::Int32:
-			*this = value.AsValue<int32_t>();
-			return *this;
-		case ValueType::Int64:
-			*this = value.AsValue<int64_t>();
-			return *this;
-		case ValueType::Float:
-			*this = value.AsValue<float>();
-			return *this;
-		case ValueType::Double:
-			*this = value.AsValue<double>();
-			return *this;
-		case ValueType::Char:
-			*this = value.AsValue<char>();
-			return *this;
-		case ValueType::String:
-			*this = value.AsValue<std::string>();
-			return *this;
-		case ValueType::Bool:
-			*this = value.AsValue<bool>();
-			return *this;
-		default:
-			return *this; // Unreachable.
-		}
-	}
+	m_Type = value.m_Type;
+	m_Initialized = value.m_Initialized;
+	m_As = value.m_As;
 
+	value.m_Type = ValueType::Null;
+	value.m_Initialized = false;
 	return *this;
 }
 
-template <typename T>
-bool equalTo(T valueA, Value valueB) {
-	static_assert(std::is_arithmetic<T>::value, "Type must be a number.");
-
-	switch (valueB.Type()) {
-	case ValueType::Int8: return valueA == valueB.AsValue<int8_t>();
-	case ValueType::Int16: return valueA == valueB.AsValue<int16_t>();
-	case ValueType::Int32: return valueA == valueB.AsValue<int32_t>();
-	case ValueType::Int64: return valueA == valueB.AsValue<int64_t>();
-	case ValueType::Float: return valueA == valueB.AsValue<float>();
-	case ValueType::Double: return valueA == valueB.AsValue<double>();
-	default: return false;
-	}
-}
-
-bool Value::operator==(const Value& value) const {
-	// Invalid types are always false compared to others. Even other invalids.
-	if (!IsValid() || !value.IsValid()) return false;
-
-	// If they're the same type, just compare the bits directly.
-	if (m_Type == value.Type()) {
-		return m_Data == value.AsBytes();
-	}
+Value& Value::Assign(const Value& value) {
+	if (this == &value) return *this;
 
+	// Hopefule the compiler is taking care of type-checking, so we can assume
+	// that the types are easily convertable.
 	switch (m_Type) {
-	case ValueType::Int8: return equalTo(AsValue<int8_t>(), value);
-	case ValueType::Int16: return equalTo(AsValue<int16_t>(), value);
-	case ValueType::Int32: return equalTo(AsValue<int32_t>(), value);
-	case ValueType::Int64: return equalTo(AsValue<int64_t>(), value);
-	case ValueType::Float: return equalTo(AsValue<float>(), value);
-	case ValueType::Double: return equalTo(AsValue<double>(), value);
-	case ValueType::Bool: return AsValue<bool>() == value.AsValue<bool>();
-	}
-
-	return false;
-}
-
-template <typename T>
-bool lessThan(T valueA, Value valueB) {
-	switch (valueB.Type()) {
-	case ValueType::Int8: return valueA < valueB.AsValue<int8_t>();
-	case ValueType::Int16: return valueA < valueB.AsValue<int16_t>();
-	case ValueType::Int32: return valueA < valueB.AsValue<int32_t>();
-	case ValueType::Int64: return valueA < valueB.AsValue<int64_t>();
-	case ValueType::Float: return valueA < valueB.AsValue<float>();
-	case ValueType::Double: return valueA < valueB.AsValue<double>();
-	default: return false;
+	case ValueType::Invalid:
+		static_assert(true, "Dear god, what have you done?");
+		return *this;
+	case ValueType::Int8: m_As.int8 = value.AsValue<int8_t>(); break;
+	case ValueType::Int16: m_As.int16 = value.AsValue<int16_t>(); break;
+	case ValueType::Int32: m_As.int32 = value.AsValue<int32_t>(); break;
+	case ValueType::Int64: m_As.int64 = value.AsValue<int64_t>(); break;
+	case ValueType::Float: m_As._float = value.AsValue<float>(); break;
+	case ValueType::Double: m_As._double = value.AsValue<double>(); break;
+	case ValueType::Char: m_As.character = value.AsValue<char>(); break;
+	case ValueType::Bool: m_As.boolean = value.AsValue<bool>(); break;
+	case ValueType::String:
+	{
+		StringObject* string = value.IsString() ? value.m_As.string : StringObject::Create(value.AsValue<std::string>());
+		if (string) string->Retain();
+		if (m_As.string) m_As.string->Release();
+		m_As.string = string;
+		break;
 	}
-}
-
-bool Value::operator<(const Value& value) const {
-	// If the values are not numbers, they really shouldn't be compared.
-	// Right now, this situation returns false, but when partial_ordering is
-	// supported, it'll return partial_ordering::unordered
-	if (!IsNumber() || !IsNumber()) return false;
-
-	switch (m_Type) {
-	case ValueType::Int8: return lessThan(AsValue<int8_t>(), value);
-	case ValueType::Int16: return lessThan(AsValue<int16_t>(), value);
-	case ValueType::Int32: return lessThan(AsValue<int32_t>(), value);
-	case ValueType::Int64: return lessThan(AsValue<int64_t>(), value);
-	case ValueType::Float: return lessThan(AsValue<float>(), value);
-	case ValueType::Double: return lessThan(AsValue<double>(), value);
+	default:
+		return *this; // Unreachable.
 	}
 
-	return false;
+	m_Initialized = true;
+	return *this;
 }
 
+bool Value::operator==(const Value& value) const { return comparisonKernel(ComparisonOperator::Equal, *this, value); }
+bool Value::operator<(const Value& value) const { return comparisonKernel(ComparisonOperator::Less, *this, value); }
+bool Value::operator<=(const Value& value) const { return comparisonKernel(ComparisonOperator::LessEqual, *this, value); }
+
 Value::operator bool() const {
 	switch (m_Type) {
 	case ValueType::Invalid: return false;
-	case ValueType::Bool: return m_Data[0] == 1 ? true : false;
+	case ValueType::Bool: return m_As.boolean;
 	default: return true;
 	}
 }
@@ -3,23 +3,41 @@
 #pragma once
 
 #include "ValueType.h"
+#include "Object.h"
+
+#include <limits>
 
 
 
 //! Basical value representation
 /*!
-  Values are stored in an std::vector of unsigned chars of the binary of the value.
-  This class stores the bytes, size and an enum of the type of data that is represented.
+  Values are a small tagged union. Scalars (integrals, decimals, chars and bools) are stored
+  inline, so creating or copying them never touches the heap. Strings are the only values that
+  point to heap memory, a reference counted StringObject.
   Basic arithmetic operators are overloaded to make using values in the compiler code as easy
-  as using normal data-types. Values are stored in little endian.
+  as using normal data-types.
 */
 class Value {
 private:
-	const ValueType m_Type; //!< The type the value represents.
-	size_t m_Size; //!< Size of the data in bytes.
-	ByteArray m_Data; //!< Bytes of data. Stored in little endian.
+	ValueType m_Type; //!< The type the value represents.
 	bool m_Initialized; //!< If it has been given a value to begin with or not.
 
+	//! Storage of the value, the active member is given by m_Type.
+	union Data {
+		int8_t int8;
+		int16_t int16;
+		int32_t int32;
+		int64_t int64;
+		float _float;
+		double _double;
+		char character;
+		bool boolean;
+		StringObject* string;
+	} m_As; //!< Data of the value.
+
+	//! \return The bits of the data of a scalar value, with the unused bytes cleared.
+	uint64_t dataBits() const;
+
 
 public:
 
@@ -27,43 +45,51 @@ public:
 	//! Initilizes values
 
 	//! Default constructor, returns an "Null" value
-	Value() : m_Type(ValueType::Null), m_Size(0), m_Initialized(false) {}
+	Value() : m_Type(ValueType::Null), m_Initialized(false) { m_As.int64 = 0; }
 
 
 	//! Copy constructor
 	Value(const Value& value);
 
-	
-private:
-	//! Main constructor
-	/*!
-	  This constructor is the one called by the templated one, and initilizes a valid value.
-	  \param bytes A vector<uint8_t> of the binary to be stored, in little endian.
-	  \param type ValueType of value.
-	*/
-	Value(ByteArray bytes, ValueType type);
+	//! Move constructor, leaves value as an uninitialized Null.
+	Value(Value&& value) noexcept : m_Type(value.m_Type), m_Initialized(value.m_Initialized), m_As(value.m_As) {
+		value.m_Type = ValueType::Null;
+		value.m_Initialized = false;
+	}
 
-public:
-	//! Template constructor, takes in a value and serializes it.
-	/*!
-	  Calls main constructor after passing input through both toBytes and getType
-	  \param value value of any supported ValueType.
-	*/
-	template<typename T, typename = std::enable_if_t<!std::is_same_v<T, Value&>&& !std::is_same_v<T, Value>>>
-	Value(T&& value) : Value(Serialize::toBytes<T>(value), Transformer::getType(value)) {}
+	//!@{ Scalar constructors, store the value inline.
+	Value(int8_t value) : m_Type(ValueType::Int8), m_Initialized(true) { m_As.int64 = 0; m_As.int8 = value; }
+	Value(int16_t value) : m_Type(ValueType::Int16), m_Initialized(true) { m_As.int64 = 0; m_As.int16 = value; }
+	Value(int32_t value) : m_Type(ValueType::Int32), m_Initialized(true) { m_As.int64 = 0; m_As.int32 = value; }
+	Value(int64_t value) : m_Type(ValueType::Int64), m_Initialized(true) { m_As.int64 = value; }
+	Value(float value) : m_Type(ValueType::Float), m_Initialized(true) { m_As.int64 = 0; m_As._float = value; }
+	Value(double value) : m_Type(ValueType::Double), m_Initialized(true) { m_As._double = value; }
+	Value(char value) : m_Type(ValueType::Char), m_Initialized(true) { m_As.int64 = 0; m_As.character = value; }
+	Value(bool value) : m_Type(ValueType::Bool), m_Initialized(true) { m_As.int64 = 0; m_As.boolean = value; }
+	//!@}
+
+	//! Creates a string value, copying the characters into a new StringObject.
+	Value(const std::string& value);
+
+	//! \overload Value(const std::string& value)
+	Value(const char* value) : Value(std::string(value)) {}
+
+	//! Creates a string value referring to an existing StringObject.
+	Value(StringObject* string);
 
 	//! Creates an "uninitilized" value of the given type.
-	Value(ValueType type) : m_Type(type), m_Size(ValueTypeSize(type)), m_Initialized(false) { m_Data.reserve(m_Size); }
+	Value(ValueType type) : m_Type(type), m_Initialized(false) { m_As.int64 = 0; m_As.string = nullptr; }
 
-	
+	//! Releases the string held by the value, if any.
+	~Value() { if (IsString() && m_As.string) m_As.string->Release(); }
 
 	//!@}
 
 	//!@{ \name Getters
 	//! Gets const data from private members.
 
-	//! Converts byte array into type T
-	/*! Converts the data into a usable value type. Is able to cast to appropiate types. 
+	//! Converts the stored data into type T
+	/*! Converts the data into a usable value type. Is able to cast to appropiate types.
 		May result in data lost if used to convert a float to an integral or a larger value
 		to a smaller one.
 	  \return Value called for.
@@ -71,78 +97,30 @@ public:
 	template<typename T>
 	T AsValue() const;
 
-	//! Specialized AsValue for bool values. Returns bool operator
-	template<>
-	bool AsValue<bool>() const { return static_cast<bool>(*this); }
-
-	//! Specialized AsValue for float values.
-	template <>
-	float AsValue<float>() const {
-		// If value is not a number, it's not convertable to a float.
-		if (!IsNumber()) return 0;
-
-		if (m_Type == ValueType::Float) {
-			int32_t intermediate = 0;
-
-			for (size_t i = 0; i < m_Size; i++) {
-				intermediate |= (m_Data[i] << (8 * (m_Size - i - 1)));
-			}
-
-			return reinterpret_cast<float&>(intermediate);
-		} else {
-			switch (m_Type) {
-			case ValueType::Int8: return static_cast<float>(AsValue<int8_t>());
-			case ValueType::Int16: return static_cast<float>(AsValue<int16_t>());
-			case ValueType::Int32: return static_cast<float>(AsValue<int32_t>());
-			case ValueType::Int64: return static_cast<float>(AsValue<int64_t>());
-			case ValueType::Double: return static_cast<float>(AsValue<double>());
-			default: return 0; // Unreachable
-			}
-		}
-	}
-
-	//! Specialized AsValue for double Values.
-	template <>
-	double AsValue<double>() const {
-		// If value is not a number, it's not convertable to a float.
-		if (!IsNumber()) return 0;
-
-		if (m_Type == ValueType::Double) {
-			int64_t intermediate = 0;
-
-			for (size_t i = 0; i < m_Size; i++) {
-				intermediate |= (m_Data[i] << (8 * (m_Size - i - 1)));
-			}
-
-			return reinterpret_cast<double&>(intermediate);
-		} else {
-			switch (m_Type) {
-			case ValueType::Int8: return static_cast<double>(AsValue<int8_t>());
-			case ValueType::Int16: return static_cast<double>(AsValue<int16_t>());
-			case ValueType::Int32: return static_cast<double>(AsValue<int32_t>());
-			case ValueType::Int64: return static_cast<double>(AsValue<int64_t>());
-			case ValueType::Float: return static_cast<double>(AsValue<float>());
-			default: return 0; // Unreachable
-			}
-		}
-	}
+	//! Reads the data stored as Type, without checking or converting it.
+	/*! Only valid when Type is the type of the Value. Used where the type is already known,
+		such as the operator kernels.
+	  \return Data of the value.
+	*/
+	template<ValueType Type>
+	NativeType<Type> Get() const;
 
-	//! Specialized AsValue for string values.
-	template<>
-	std::string AsValue<std::string>() const {
-		if (IsChar() || IsString())
-			return std::string(m_Data.begin(), m_Data.end());
-		else return ToString();
-	}
+	//! Overwrites the value with a scalar of type Type, without releasing what it held.
+	/*! Only valid when the Value doesn't hold a string. Used where the types are already known,
+		such as the typed opcodes of the VM.
+	  \param data Data of the new value.
+	*/
+	template<ValueType DataType>
+	void Set(NativeType<DataType> data);
 
-	//! returns a byte array of the value.
-	const ByteArray& AsBytes() const;
+	//! \return The string object held by a string value, or nullptr for other types.
+	StringObject* AsString() const { return IsString() ? m_As.string : nullptr; }
 
 	//! A string representation of the value for printing.
 	std::string ToString() const;
 
 	//! \return Size of Value in bytes.
-	size_t Size() const { return m_Size; }
+	size_t Size() const { return IsString() && m_As.string ? m_As.string->Length() : ValueTypeSize(m_Type); }
 	//! \return ValueType of Value.
 	const ValueType& Type() const { return m_Type; }
 	//!@}
@@ -160,29 +138,26 @@ public:
 
 
 	//!@{ Binary operator, should only be used for number values.
-	Value operator+(Value value) const;
-	Value operator-(Value value) const;
-	Value operator*(Value value) const;
-	Value operator/(Value value) const;
+	Value operator+(const Value& value) const;
+	Value operator-(const Value& value) const;
+	Value operator*(const Value& value) const;
+	Value operator/(const Value& value) const;
 	//!@}
 
 	//!@{ Assignment
+	//! Replaces this Value, type included, with a copy of value.
 	Value& operator=(const Value& value);
 
-	template<typename T>
-	Value& operator=(T value) { 
-		m_Data = Serialize::toBytes(FWD(value));
-		m_Initialized = true;
-		return *this;
-	}
+	//! Replaces this Value, type included, with value. Leaves value as an uninitialized Null.
+	Value& operator=(Value&& value) noexcept;
 
-	template<>
-	Value& operator=<std::string>(std::string value) {
-		m_Size = value.size();
-		m_Data.assign(value.begin(), value.end());
-		m_Initialized = true;
-		return *this;
-	}
+	//! Assigns value, converting it to the type of this Value.
+	/*!
+	  Unlike operator=, the type of this Value never changes. Used to store into typed variables.
+	  \param value Value to convert and store.
+	  \return This value.
+	*/
+	Value& Assign(const Value& value);
 	//!@}
 
 	//!@{ Comparison
@@ -191,8 +166,8 @@ public:
 	bool operator!=(const Value& value) const { return !(*this == value); }
 	bool operator<(const Value& value) const;
 	bool operator>(const Value& value) const { return value < *this; }
-	bool operator<=(const Value& value) const { return (*this < value) || (*this == value); }
-	bool operator>=(const Value& value) const { return (*this > value) || (*this == value); }
+	bool operator<=(const Value& value) const;
+	bool operator>=(const Value& value) const { return value <= *this; }
 	//!@}
 
 	//!@{ Boolean value
@@ -200,6 +175,16 @@ public:
 	//!@}
 	//!@}
 
+	//!@{ \name Identity
+	//! Used to find identical constants.
+
+	//! \return If both values have the same type and the same data. Unlike ==, 0.0 and -0.0 differ and 1 and 1.0 differ.
+	bool Identical(const Value& value) const;
+
+	//! \return A hash of the type and data of the value, consistent with Identical(). Strings hash their characters.
+	size_t Hash() const;
+	//!@}
+
 	//!@{ \name Utilities
 	//! Functions to help determine the type of Value
 	inline bool IsNumber() const { return m_Type >= ValueType::Int8 && m_Type <= ValueType::Double; }
@@ -214,56 +199,90 @@ public:
 	//!@}
 };
 
+static_assert(sizeof(Value) <= 16, "Value should fit in two machine words.");
+
+#ifdef ILIAD_VM_STATISTICS
+//! Number of Values copied so far, by the copy constructor and the copy assignment. Only counted
+//! in builds defining ILIAD_VM_STATISTICS, see VMStatistics.
+extern size_t valueCopyCount;
+#endif
+
+
+template<ValueType Type>
+NativeType<Type> Value::Get() const {
+	if constexpr (Type == ValueType::Int8) return m_As.int8;
+	else if constexpr (Type == ValueType::Int16) return m_As.int16;
+	else if constexpr (Type == ValueType::Int32) return m_As.int32;
+	else if constexpr (Type == ValueType::Int64) return m_As.int64;
+	else if constexpr (Type == ValueType::Float) return m_As._float;
+	else if constexpr (Type == ValueType::Double) return m_As._double;
+	else if constexpr (Type == ValueType::Char) return m_As.character;
+	else if constexpr (Type == ValueType::String) return m_As.string;
+	else if constexpr (Type == ValueType::Bool) return m_As.boolean;
+	else static_assert(Type == ValueType::Bool, "Type has no data.");
+}
+
+template<ValueType DataType>
+void Value::Set(NativeType<DataType> data) {
+	static_assert(DataType != ValueType::String, "Strings are reference counted, assign a Value instead.");
+
+	m_Type = DataType;
+	m_Initialized = true;
+
+	if constexpr (DataType == ValueType::Int8) m_As.int8 = data;
+	else if constexpr (DataType == ValueType::Int16) m_As.int16 = data;
+	else if constexpr (DataType == ValueType::Int32) m_As.int32 = data;
+	else if constexpr (DataType == ValueType::Int64) m_As.int64 = data;
+	else if constexpr (DataType == ValueType::Float) m_As._float = data;
+	else if constexpr (DataType == ValueType::Double) m_As._double = data;
+	else if constexpr (DataType == ValueType::Char) m_As.character = data;
+	else if constexpr (DataType == ValueType::Bool) m_As.boolean = data;
+}
 
 template<typename T>
 T Value::AsValue() const {
 	static_assert(std::is_arithmetic<T>::value, "Type mismatch.");
 
-	// If finding the boolean, use bool operator.
-	if (std::is_same<T, bool>()) {
-		return static_cast<bool>(*this);
-	}
-
-	// If the types matchup, just convert byte array to type.
-	if (m_Type == Transformer::getType(T())) {
-		T value = 0;
-		for (size_t i = 0; i < m_Size; i++) {
-			value |= (m_Data[i] << (8 * (m_Size - i - 1)));
-		}
-
-		return value;
+	switch (m_Type) {
+	case ValueType::Int8: return static_cast<T>(m_As.int8);
+	case ValueType::Int16: return static_cast<T>(m_As.int16);
+	case ValueType::Int32: return static_cast<T>(m_As.int32);
+	case ValueType::Int64: return static_cast<T>(m_As.int64);
+	case ValueType::Float: return static_cast<T>(m_As._float);
+	case ValueType::Double: return static_cast<T>(m_As._double);
+	case ValueType::Char: return static_cast<T>(m_As.character);
+	case ValueType::Bool: return static_cast<T>(m_As.boolean);
+	default: return T();
 	}
+}
 
-	if (IsDecimal()) {
-		if (m_Type == ValueType::Float) {
-			int32_t intermediate = 0;
-
-			for (size_t i = 0; i < m_Size; i++) {
-				intermediate |= (m_Data[i] << (8 * (m_Size - i - 1)));
-			}
-
-			float floatVal = reinterpret_cast<float&>(intermediate);
-			return static_cast<T>(floatVal);
-		} else if (m_Type == ValueType::Double) {
-			int64_t intermediate = 0;
-
-			for (size_t i = 0; i < m_Size; i++) {
-				intermediate |= (m_Data[i] << (8 * (m_Size - i - 1)));
-			}
+//! Specialized AsValue for bool values. Returns bool operator
+template<>
+inline bool Value::AsValue<bool>() const { return static_cast<bool>(*this); }
 
-			double doubleVal = reinterpret_cast<double&>(intermediate);
-			return static_cast<T>(doubleVal);
-		}
-	}
+//! Specialized AsValue for string values.
+template<>
+inline std::string Value::AsValue<std::string>() const {
+	if (IsString()) return m_As.string ? std::string(m_As.string->Chars()) : std::string();
+	else if (IsChar()) return std::string(1, m_As.character);
+	else return ToString();
+}
 
-	// If types do not match up, get origianl type and convert.
-	switch (m_Type) {
-	case ValueType::Int8: return static_cast<T>(AsValue<int8_t>());
-	case ValueType::Int16: return static_cast<T>(AsValue<int16_t>());
-	case ValueType::Int32: return static_cast<T>(AsValue<int32_t>());
-	case ValueType::Int64: return static_cast<T>(AsValue<int64_t>());
-	default: static_assert(true, "Type not supported.");
+//!@{ \name Division errors
+//! Finds why a division can't be done: integers can't be divided by zero, and the smallest
+//! integer divided by -1 overflows. Floating point divisions never fail.
+/*!
+  \return The message of the error, or nullptr if lhs / rhs can be computed.
+*/
+template<typename T>
+const char* divisionError(T lhs, T rhs) {
+	if constexpr (std::is_integral<T>::value) {
+		if (rhs == 0) return "Integer division by zero.";
+		if (rhs == -1 && lhs == std::numeric_limits<T>::min()) return "Integer division overflows.";
 	}
-
-	return T();
+	return nullptr;
 }
+
+//! Checks a division of Values, done in the type their operator gives the result.
+const char* divisionError(const Value& lhs, const Value& rhs);
+//!@}
@@ -36,6 +36,3 @@ size_t ValueTypeSize(ValueType type) {
 	}
 }
 
-ValueType smallestTypeNeeded(ValueType a, ValueType b) {
-	return a > b ? a : b;
-}
@@ -16,3 +16,9 @@
 #define DEBUG_PRINT_CODE
 
 #endif // DEBUG
+
+// The VM dispatches through a table of label addresses, an extension of GCC and Clang, unless
+// the switch is asked for.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(ILIAD_SWITCH_DISPATCH)
+#define COMPUTED_GOTO
+#endif
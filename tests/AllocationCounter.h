@@ -0,0 +1,35 @@
+//! \file AllocationCounter.h
+//! \brief Counts the allocations of a test program by replacing the global operator new.
+/*!
+  The replacements are definitions, so the header is included by a single source file of the
+  program. The array and nothrow versions of operator new call the one replaced here.
+*/
+#pragma once
+
+#include <cstdlib>
+#include <new>
+
+//! Number of calls to operator new since the program started.
+inline size_t allocationCount = 0;
+
+void* operator new(size_t size) {
+	allocationCount++;
+	if (void* memory = std::malloc(size ? size : 1)) return memory;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept { std::free(memory); }
+
+void operator delete(void* memory, size_t) noexcept { std::free(memory); }
+
+//! Counts the allocations made by a function.
+/*!
+  \param function Function to run.
+  \return Number of calls to operator new while it ran.
+*/
+template<typename Function>
+size_t countAllocations(Function function) {
+	size_t before = allocationCount;
+	function();
+	return allocationCount - before;
+}
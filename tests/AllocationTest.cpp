@@ -0,0 +1,107 @@
+//! \file AllocationTest.cpp
+//! \brief Checks that arithmetic on scalar Values never touches the allocator.
+/*!
+  Code run by a VM is compiled on the first call to VM::Interpret(), which allocates, and taken
+  from the chunk cache on the next calls with the same source. Only those calls are counted, so
+  the count is the one of running the code.
+*/
+#include "stdafx.h"
+#include "AllocationCounter.h"
+#include "VM.h"
+
+#include <algorithm>
+
+namespace {
+	//! Runs a function and reports it if it allocated.
+	/*!
+	  \param name Name printed for the function.
+	  \param function Function to run.
+	  \return 1 if the function allocated, 0 otherwise.
+	*/
+	template<typename Function>
+	int expectNoAllocations(const char* name, Function function) {
+		size_t count = countAllocations(function);
+		if (count == 0) return 0;
+
+		std::cout << name << ": " << count << " allocations." << std::endl;
+		return 1;
+	}
+
+	//! Runs source a second time, from the chunk cache, and reports it if that allocated.
+	/*!
+	  \param vm VM running the source.
+	  \param source Code to run, that can't declare globals: code declaring them isn't cached.
+	  \return 1 if running the source failed or allocated, 0 otherwise.
+	*/
+	int expectRunWithoutAllocations(VM& vm, const char* source) {
+		if (vm.Interpret(source) != InterpretResults::OK) {
+			std::cout << source << ": doesn't run." << std::endl;
+			return 1;
+		}
+
+		InterpretResults result = InterpretResults::OK;
+		int failures = expectNoAllocations(source, [&] { result = vm.Interpret(source); });
+		if (result != InterpretResults::OK || vm.Cache().Hits() == 0) {
+			std::cout << source << ": doesn't run from the cache." << std::endl;
+			return 1;
+		}
+		return failures;
+	}
+}
+
+int main() {
+	int failures = 0;
+
+	// Scalars of every type are stored inline, creating, copying and combining them is free.
+	failures += expectNoAllocations("Value arithmetic", [] {
+		Value result = Value(1) + Value(2) * Value(3);
+		if (result.AsValue<int>() != 7) std::cout << "1 + 2 * 3 isn't 7." << std::endl;
+	});
+	failures += expectNoAllocations("Scalar values", [] {
+		Value values[] = {
+			Value(int8_t(1)), Value(int16_t(2)), Value(int32_t(3)), Value(int64_t(4)),
+			Value(5.0f), Value(6.0), Value('7'), Value(true), Value(ValueType::Int32),
+		};
+		for (const Value& value : values) {
+			Value copy = value;
+			copy = value;
+			if (!copy.Identical(value)) std::cout << "A copy differs from its value." << std::endl;
+		}
+	});
+
+	// Debug builds trace the instructions they run, which allocates.
+#ifndef _DEBUG
+	VM vm;
+	failures += expectRunWithoutAllocations(vm, "1 + 2 * 3;");
+
+	// A long expression over variables, so it isn't folded. Mixing the types runs the generic
+	// operators of the stack as well as the typed ones.
+	if (vm.Interpret("int8 a = 3; int16 b = 5; int32 c = 7; int64 d = 11;") != InterpretResults::OK) {
+		std::cout << "The variables aren't declared." << std::endl;
+		failures++;
+	}
+	const char* const terms[] = { "a", "b", "c", "d", "(a + c)", "(b - d)", "-c", "(d * a)" };
+	const char* const operators[] = { " + ", " - ", " * " };
+	std::string expression = "a";
+	for (int i = 0; i < 400; i++) {
+		expression += operators[i % 3];
+		expression += terms[i % 8];
+	}
+	expression += " < d";
+	std::string statement = expression + ";";
+	failures += expectRunWithoutAllocations(vm, statement.c_str());
+
+	// The same expression over locals.
+	std::string block = "{ int8 e = 3; int16 f = 5; int32 g = 7; int64 h = 11; " + expression + "; }";
+	for (auto [global, local] : { std::pair('a', 'e'), std::pair('b', 'f'), std::pair('c', 'g'), std::pair('d', 'h') }) {
+		std::replace(block.begin() + block.find(';', block.find("h =")), block.end(), global, local);
+	}
+	failures += expectRunWithoutAllocations(vm, block.c_str());
+#endif
+
+	if (failures) {
+		std::cout << failures << " checks allocated." << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,127 @@
+//! \file BytecodeFileTest.cpp
+//! \brief Checks that damaged bytecode files are refused instead of run.
+/*!
+  Compiles a script to a bytecode file, then loads it cut at every length and with every byte
+  flipped, each of which BytecodeFile::Load() has to refuse. Chunks whose constants don't have
+  the type their instruction expects have to fail Chunk::validate().
+
+  Leaves Truncated.ilc and Flipped.ilc in the output directory, for the tests checking that
+  Iliad refuses them with the exit code of a compile error.
+
+  Usage: BytecodeFileTest script output-directory
+*/
+#include "stdafx.h"
+#include "Bytecode.h"
+#include "Compiler.h"
+#include "MappedFile.h"
+#include "Object.h"
+
+#include <fstream>
+#include <sstream>
+
+namespace {
+	//! \return If Load() accepts data.
+	bool loads(const std::string& data) {
+		StringTable strings;
+		std::vector<BytecodeFile::Global> globals;
+		std::string error;
+		return BytecodeFile::Load(data, strings, globals, error) != nullptr;
+	}
+
+	//! Writes data to a file, returns false if it couldn't.
+	bool writeFile(const std::string& path, const std::string& data) {
+		std::ofstream file(path, std::ios::binary | std::ios::trunc);
+		file.write(data.data(), data.size());
+		return static_cast<bool>(file);
+	}
+
+	//! \return A chunk of code that only returns, holding constant.
+	Chunk chunkWith(const Value& constant, std::initializer_list<byte> code) {
+		Chunk chunk;
+		chunk.addConstant(constant);
+		for (byte value : code) chunk.writeByte(value, 1);
+		chunk.writeByte(static_cast<byte>(OpCode::Return), 1);
+		return chunk;
+	}
+
+	//! \return 1 if validate() doesn't return expected for chunk, 0 otherwise.
+	int expectValid(const char* name, const Chunk& chunk, bool expected) {
+		if (chunk.validate(1) == expected) return 0;
+		std::cout << name << (expected ? " is refused." : " is accepted.") << std::endl;
+		return 1;
+	}
+}
+
+int main(int argc, char** argv) {
+	if (argc != 3) {
+		std::cerr << "Usage: BytecodeFileTest script output-directory" << std::endl;
+		return 1;
+	}
+
+	MappedFile source(argv[1]);
+	StringTable strings;
+	Compiler compiler;
+	auto chunk = std::make_shared<Chunk>();
+	std::string output = std::string(argv[2]) + "/";
+	std::string error;
+	if (!source.IsOpen() || !compiler.Compile(source.View(), chunk, strings) || !BytecodeFile::Write(output + "Intact.ilc", *chunk, compiler, error)) {
+		std::cout << "The script doesn't compile to a bytecode file. " << error << std::endl;
+		return 1;
+	}
+
+	std::ifstream file(output + "Intact.ilc", std::ios::binary);
+	std::stringstream contents;
+	contents << file.rdbuf();
+	const std::string intact = contents.str();
+
+	int failures = 0;
+	if (!loads(intact)) {
+		std::cout << "The intact file is refused." << std::endl;
+		failures++;
+	}
+
+	for (size_t length = 0; length < intact.size(); length++) {
+		if (loads(intact.substr(0, length))) {
+			std::cout << "The file cut to " << length << " bytes is accepted." << std::endl;
+			failures++;
+		}
+	}
+
+	for (size_t offset = 0; offset < intact.size(); offset++) {
+		std::string flipped = intact;
+		flipped[offset] ^= 0xff;
+		if (loads(flipped)) {
+			std::cout << "The file with byte " << offset << " flipped is accepted." << std::endl;
+			failures++;
+		}
+	}
+
+	// Byte 40 is in the header, where a flip used to move the constants onto other records.
+	std::string flipped = intact;
+	flipped[40] ^= 0xff;
+	if (!writeFile(output + "Truncated.ilc", intact.substr(0, intact.size() / 2)) || !writeFile(output + "Flipped.ilc", flipped)) {
+		std::cout << "The damaged files can't be written." << std::endl;
+		failures++;
+	}
+
+	// Constants whose type doesn't match their instruction, which the checksum doesn't catch
+	// when the file was written that way.
+	auto op = [](OpCode op) { return static_cast<byte>(op); };
+	Value string(strings.Intern("text"));
+	failures += expectValid("An int literal of an int32", chunkWith(Value(7), { op(OpCode::IntLiteral), 0, op(OpCode::Pop) }), true);
+	failures += expectValid("An int literal of a double", chunkWith(Value(7.0), { op(OpCode::IntLiteral), 0, op(OpCode::Pop) }), true);
+	failures += expectValid("An int literal of a string", chunkWith(string, { op(OpCode::IntLiteral), 0, op(OpCode::Pop) }), false);
+	failures += expectValid("A string literal of an int32", chunkWith(Value(7), { op(OpCode::StringLiteral), 0, op(OpCode::Pop) }), false);
+	failures += expectValid("A char literal of a bool", chunkWith(Value(true), { op(OpCode::CharLiteral), 0, op(OpCode::Pop) }), false);
+	failures += expectValid("A global and a double", chunkWith(Value(0.5), { op(OpCode::VarConstant), 0, 0, op(OpCode::PopN), 2 }), true);
+	failures += expectValid("A global and a bool", chunkWith(Value(true), { op(OpCode::VarConstant), 0, 0, op(OpCode::PopN), 2 }), false);
+	failures += expectValid("A global plus an int32", chunkWith(Value(7), { op(OpCode::VarConstantAddI32), 0, 0, op(OpCode::Pop) }), true);
+	failures += expectValid("A global plus a double", chunkWith(Value(0.5), { op(OpCode::VarConstantAddI32), 0, 0, op(OpCode::Pop) }), false);
+	failures += expectValid("A local plus an int64", chunkWith(Value(int64_t(7)), { op(OpCode::LocalDeclar), static_cast<byte>(ValueType::Int32), op(OpCode::LocalConstantAddI32), 0, 0, op(OpCode::PopN), 2 }), false);
+
+	if (failures) {
+		std::cout << failures << " checks failed." << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,6 @@
+# Runs COMMAND with the ;-separated ARGUMENTS and fails unless it exits with EXIT_CODE.
+# Usage: cmake -DCOMMAND=... -DARGUMENTS=... -DEXIT_CODE=... -P ExpectExitCode.cmake
+execute_process(COMMAND ${COMMAND} ${ARGUMENTS} RESULT_VARIABLE result)
+if(NOT result EQUAL EXIT_CODE)
+    message(FATAL_ERROR "${COMMAND} exited with ${result} instead of ${EXIT_CODE}.")
+endif()
@@ -0,0 +1,88 @@
+//! \file ParallelScanTest.cpp
+//! \brief Checks that Scanner::ScanAllTokensParallel() returns the same tokens as the serial scanner.
+/*!
+  Built with PARALLEL_SCAN_MIN_PIECE lowered, so that small random sources are cut into many
+  pieces. The sources are made of fragments that make pieces start inside tokens: strings and
+  char literals going over lines, comments, and literals that never end.
+*/
+#include "stdafx.h"
+#include "Scanner.h"
+
+#include <iostream>
+#include <random>
+
+namespace {
+	//! Number of random sources scanned.
+	const int SOURCE_COUNT = 20000;
+
+	//! Most fragments in a source.
+	const size_t MAX_FRAGMENTS = 400;
+
+	//! Pieces of source the random sources are made of.
+	const char* const FRAGMENTS[] = {
+		"int", " ", "  ", "\t", "\n", "\n\n", "\r\n", "\"", "'", "'\n'", "'\\n'", "\\", "//", "// c \"\n",
+		"x", "_y1", "12", "3.5", ";", "=", "==", "&", "&&", "|", "@", "{", "}", "/", "\xc3\xa9",
+	};
+
+	//! \return If both lists have the same tokens, with lexemes viewing the same characters of the source.
+	bool sameTokens(const TokenList& serial, const TokenList& parallel) {
+		if (serial.Size() != parallel.Size()) return false;
+
+		for (size_t i = 0; i < serial.Size(); i++) {
+			if (serial.Type(i) != parallel.Type(i) || serial.Line(i) != parallel.Line(i) || serial.Lexeme(i) != parallel.Lexeme(i)) {
+				return false;
+			}
+			// Error messages aren't in the source.
+			if (serial.Type(i) != TokenType::Error && serial.Lexeme(i).data() != parallel.Lexeme(i).data()) return false;
+		}
+		return true;
+	}
+
+	//! Prints both lists side by side.
+	void printTokens(const TokenList& serial, const TokenList& parallel) {
+		for (size_t i = 0; i < std::max(serial.Size(), parallel.Size()); i++) {
+			if (i < serial.Size()) {
+				std::cout << static_cast<int>(serial.Type(i)) << " " << serial.Line(i) << " [" << serial.Lexeme(i) << "]";
+			}
+			std::cout << "   |   ";
+			if (i < parallel.Size()) {
+				std::cout << static_cast<int>(parallel.Type(i)) << " " << parallel.Line(i) << " [" << parallel.Lexeme(i) << "]";
+			}
+			std::cout << std::endl;
+		}
+	}
+}
+
+int main() {
+	// A fixed seed, so a failure can be reproduced.
+	std::mt19937 random(12345);
+	const size_t fragmentCount = sizeof(FRAGMENTS) / sizeof(FRAGMENTS[0]);
+	int failures = 0;
+
+	for (int i = 0; i < SOURCE_COUNT; i++) {
+		std::string source;
+		size_t length = random() % MAX_FRAGMENTS;
+		for (size_t fragment = 0; fragment < length; fragment++) {
+			source += FRAGMENTS[random() % fragmentCount];
+		}
+
+		TokenList serial = Scanner(source).ScanAllTokens();
+		for (unsigned threadCount : { 2u, 3u, 7u, 16u }) {
+			TokenList parallel = Scanner::ScanAllTokensParallel(source, threadCount);
+			if (sameTokens(serial, parallel)) continue;
+
+			// Only the first mismatch is printed, the others are counted.
+			if (failures++ == 0) {
+				std::cout << "Mismatch at " << threadCount << " threads in source " << i << ":" << std::endl;
+				std::cout << "[" << source << "]" << std::endl;
+				printTokens(serial, parallel);
+			}
+		}
+	}
+
+	if (failures) {
+		std::cout << failures << " parallel scans differ from the serial scan." << std::endl;
+		return 1;
+	}
+	return 0;
+}